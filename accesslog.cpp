@@ -0,0 +1,417 @@
+#include "accesslog.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "affinity.hpp"
+#include "metrics.hpp"
+
+// Most bytes the writer collects before writing them out.
+#define ACCESS_LOG_BATCH (256 * 1024)
+
+static const Counter dropped_lines(
+    "cppserver_access_log_dropped_total",
+    "Access log lines dropped because their thread's buffer was full.");
+
+// Lines logged by one thread, waiting for the writer. head and tail count
+// the bytes ever added and taken: only the owner moves head, only the
+// writer moves tail, and the ring holds whole lines.
+struct LogRing {
+  std::vector<char> data;
+  std::atomic<size_t> head;
+  std::atomic<size_t> tail;
+  unsigned seen;  // Requests offered by the owner, for sampling.
+
+  explicit LogRing(size_t size) : data(size), head(0), tail(0), seen(0) {}
+};
+
+struct AccessLog {
+  std::mutex mutex;  // Guards what follows, up to on.
+  std::condition_variable wake;
+  std::vector<std::shared_ptr<LogRing>> rings;
+  AccessLogOptions options;
+  int fd = -1;
+  bool stopping = false;  // Told to write out and stop.
+  bool stopped = true;    // The writer has stopped.
+
+  std::atomic<bool> on{false};          // Lines are taken.
+  std::atomic<bool> half_full{false};   // A ring wants collecting now.
+};
+
+// Never destroyed: threads may still log while the program exits.
+static AccessLog &accessLog() {
+  static AccessLog *log = new AccessLog;
+  return *log;
+}
+
+// The calling thread's ring. The owner reference keeps it for the writer
+// until the thread exits; the writer forgets it once it is empty.
+static thread_local LogRing *local_ring = nullptr;
+static thread_local std::shared_ptr<LogRing> ring_owner;
+
+static LogRing *attachRing(AccessLog &log) {
+  std::lock_guard<std::mutex> lock(log.mutex);
+  ring_owner = std::make_shared<LogRing>(log.options.ring_size);
+  log.rings.push_back(ring_owner);
+  local_ring = ring_owner.get();
+  return local_ring;
+}
+
+// Builds a line in a fixed buffer, cutting off what does not fit but
+// keeping room for the newline.
+class LineWriter {
+  char *out;
+  size_t used;
+  size_t limit;
+
+ public:
+  LineWriter(char *buffer, size_t size)
+      : out(buffer), used(0), limit(size - 1) {}
+
+  void Put(char c) {
+    if (used < limit) {
+      out[used++] = c;
+    }
+  }
+
+  void Put(std::string_view text) {
+    size_t n = std::min(text.size(), limit - used);
+    memcpy(out + used, text.data(), n);
+    used += n;
+  }
+
+  void PutNumber(uint64_t n) {
+    char digits[24];
+    int length = snprintf(digits, sizeof(digits), "%llu",
+                          static_cast<unsigned long long>(n));
+    Put(std::string_view(digits, static_cast<size_t>(length)));
+  }
+
+  // text between double quotes. Quotes, backslashes and control characters
+  // are escaped as JSON does, or as \xHH (with bytes above 0x7e) as nginx
+  // does, so that clients cannot forge lines.
+  void PutQuoted(std::string_view text, bool json) {
+    static const char hex[] = "0123456789ABCDEF";
+    Put('"');
+    for (char c : text) {
+      unsigned char byte = static_cast<unsigned char>(c);
+      if (json && (c == '"' || c == '\\')) {
+        Put('\\');
+        Put(c);
+      } else if (json && byte < 0x20) {
+        Put("\\u00");
+        Put(hex[byte >> 4]);
+        Put(hex[byte & 0xf]);
+      } else if (!json && (c == '"' || c == '\\' || byte < 0x20 ||
+                           byte > 0x7e)) {
+        Put("\\x");
+        Put(hex[byte >> 4]);
+        Put(hex[byte & 0xf]);
+      } else {
+        Put(c);
+      }
+    }
+    Put('"');
+  }
+
+  // Ends the line; returns its length.
+  size_t Finish() {
+    out[used++] = '\n';
+    return used;
+  }
+};
+
+// The current second in local time, formatted once per second per thread.
+struct LogTime {
+  time_t second = -1;
+  char common[32];  // 10/Oct/2000:13:55:36 -0700
+  char iso[32];     // 2000-10-10T13:55:36-0700
+};
+
+static thread_local LogTime log_time;
+
+static const LogTime &currentTime() {
+  time_t now = time(NULL);
+  if (now != log_time.second) {
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(log_time.common, sizeof(log_time.common),
+             "%d/%b/%Y:%H:%M:%S %z", &tm);
+    strftime(log_time.iso, sizeof(log_time.iso), "%Y-%m-%dT%H:%M:%S%z",
+             &tm);
+    log_time.second = now;
+  }
+  return log_time;
+}
+
+// Value of request header name, or null.
+static const std::string *headerValue(Request *request, const char *name) {
+  Header *header = request ? request->findRequestHeader(name) : nullptr;
+  return header ? &header->value : nullptr;
+}
+
+static size_t formatCommon(const AccessRecord &record, bool combined,
+                           LineWriter &line) {
+  std::string peer = record.client->PeerAddress();
+  line.Put(peer.empty() ? "-" : peer);
+  line.Put(" - - [");
+  line.Put(currentTime().common);
+  line.Put("] ");
+
+  if (record.request) {
+    std::string request_line = method_tostring(record.request->getMethod());
+    request_line += ' ';
+    request_line += record.request->getPath();
+    request_line += ' ';
+    request_line += record.request->getVersion();
+    line.PutQuoted(request_line, false);
+  } else {
+    line.Put("\"-\"");
+  }
+
+  line.Put(' ');
+  if (record.status) {
+    line.PutNumber(static_cast<uint64_t>(record.status));
+  } else {
+    line.Put('-');
+  }
+  line.Put(' ');
+  line.PutNumber(record.bytes);
+
+  if (combined) {
+    for (const char *name : {"Referer", "User-Agent"}) {
+      const std::string *value = headerValue(record.request, name);
+      line.Put(' ');
+      if (value) {
+        line.PutQuoted(*value, false);
+      } else {
+        line.Put("\"-\"");
+      }
+    }
+  }
+  return line.Finish();
+}
+
+static size_t formatJson(const AccessRecord &record, LineWriter &line) {
+  line.Put("{\"time\":\"");
+  line.Put(currentTime().iso);
+  line.Put("\",\"remote\":");
+  line.PutQuoted(record.client->PeerAddress(), true);
+  if (record.request) {
+    line.Put(",\"method\":");
+    line.PutQuoted(method_tostring(record.request->getMethod()), true);
+    line.Put(",\"path\":");
+    line.PutQuoted(record.request->getPath(), true);
+    line.Put(",\"protocol\":");
+    line.PutQuoted(record.request->getVersion(), true);
+  }
+  line.Put(",\"status\":");
+  line.PutNumber(static_cast<uint64_t>(record.status));
+  line.Put(",\"bytes\":");
+  line.PutNumber(record.bytes);
+  line.Put(",\"duration_us\":");
+  line.PutNumber((metricsNow() - record.start) / 1000);
+
+  const std::string *referer = headerValue(record.request, "Referer");
+  if (referer) {
+    line.Put(",\"referer\":");
+    line.PutQuoted(*referer, true);
+  }
+  const std::string *agent = headerValue(record.request, "User-Agent");
+  if (agent) {
+    line.Put(",\"user_agent\":");
+    line.PutQuoted(*agent, true);
+  }
+  line.Put('}');
+  return line.Finish();
+}
+
+// Ask the writer to collect the rings now rather than at its next tick.
+static void wakeWriter(AccessLog &log) {
+  if (!log.half_full.exchange(true, std::memory_order_relaxed)) {
+    log.wake.notify_one();
+  }
+}
+
+void logAccess(const AccessRecord &record) {
+  AccessLog &log = accessLog();
+  if (!log.on.load(std::memory_order_acquire)) {
+    return;
+  }
+  LogRing *ring = local_ring;
+  if (__builtin_expect(ring == nullptr, 0)) {
+    ring = attachRing(log);
+  }
+  if (log.options.sample > 1 && ring->seen++ % log.options.sample != 0) {
+    return;
+  }
+
+  char buffer[ACCESS_LOG_LINE_MAX];
+  LineWriter line(buffer, sizeof(buffer));
+  size_t length = log.options.format == AccessLogFormat::Json
+                      ? formatJson(record, line)
+                      : formatCommon(record,
+                                     log.options.format ==
+                                         AccessLogFormat::Combined,
+                                     line);
+
+  size_t size = ring->data.size();
+  size_t head = ring->head.load(std::memory_order_relaxed);
+  size_t used = head - ring->tail.load(std::memory_order_acquire);
+  if (size - used < length) {
+    dropped_lines.Add();
+    wakeWriter(log);
+    return;
+  }
+
+  size_t at = head % size;
+  size_t first = std::min(length, size - at);
+  memcpy(ring->data.data() + at, buffer, first);
+  memcpy(ring->data.data(), buffer + first, length - first);
+  ring->head.store(head + length, std::memory_order_release);
+
+  if (used < size / 2 && used + length >= size / 2) {
+    wakeWriter(log);
+  }
+}
+
+static void writeOut(int fd, std::string &batch) {
+  const char *data = batch.data();
+  size_t left = batch.size();
+  while (left > 0) {
+    ssize_t n = write(fd, data, left);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("access log");
+      break;
+    }
+    data += n;
+    left -= static_cast<size_t>(n);
+  }
+  batch.clear();
+}
+
+// Move the lines in ring to batch, writing batch out when it is large.
+static void collect(LogRing &ring, std::string &batch, int fd) {
+  size_t tail = ring.tail.load(std::memory_order_relaxed);
+  size_t head = ring.head.load(std::memory_order_acquire);
+  if (head == tail) {
+    return;
+  }
+  size_t size = ring.data.size();
+  size_t at = tail % size;
+  size_t first = std::min(head - tail, size - at);
+  batch.append(ring.data.data() + at, first);
+  batch.append(ring.data.data(), head - tail - first);
+  ring.tail.store(head, std::memory_order_release);
+
+  if (batch.size() >= ACCESS_LOG_BATCH) {
+    writeOut(fd, batch);
+  }
+}
+
+static void writerLoop() {
+  pinIoThread();
+  AccessLog &log = accessLog();
+  std::string batch;
+  batch.reserve(ACCESS_LOG_BATCH + ACCESS_LOG_RING_SIZE);
+
+  std::unique_lock<std::mutex> lock(log.mutex);
+  while (true) {
+    log.wake.wait_for(
+        lock, std::chrono::milliseconds(log.options.flush_interval_ms),
+        [&log] { return log.stopping || log.half_full.load(); });
+    log.half_full = false;
+    bool stop = log.stopping;
+    std::vector<std::shared_ptr<LogRing>> current = log.rings;
+    int fd = log.fd;
+    lock.unlock();
+
+    for (const std::shared_ptr<LogRing> &ring : current) {
+      collect(*ring, batch, fd);
+    }
+    if (!batch.empty()) {
+      writeOut(fd, batch);
+    }
+    current.clear();
+
+    lock.lock();
+    // Forget the rings of threads that have exited once they are empty.
+    log.rings.erase(
+        std::remove_if(log.rings.begin(), log.rings.end(),
+                       [](const std::shared_ptr<LogRing> &ring) {
+                         return ring.use_count() == 1 &&
+                                ring->head.load() == ring->tail.load();
+                       }),
+        log.rings.end());
+    if (stop) {
+      break;
+    }
+  }
+
+  log.stopped = true;
+  log.wake.notify_all();
+}
+
+void startAccessLog(const AccessLogOptions &options) {
+  stopAccessLog();
+  if (options.format == AccessLogFormat::Off) {
+    return;
+  }
+
+  int fd = STDOUT_FILENO;
+  if (!options.path.empty()) {
+    fd = open(options.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+              0644);
+    if (fd == -1) {
+      perror(options.path.c_str());
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  AccessLog &log = accessLog();
+  {
+    std::lock_guard<std::mutex> lock(log.mutex);
+    log.options = options;
+    log.options.sample = std::max(options.sample, 1u);
+    log.options.ring_size = std::max<size_t>(options.ring_size,
+                                             ACCESS_LOG_LINE_MAX);
+    log.fd = fd;
+    log.stopping = false;
+    log.stopped = false;
+  }
+  std::thread(writerLoop).detach();
+  log.on.store(true, std::memory_order_release);
+}
+
+void stopAccessLog() {
+  AccessLog &log = accessLog();
+  if (!log.on.exchange(false)) {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(log.mutex);
+  log.stopping = true;
+  log.wake.notify_all();
+  log.wake.wait(lock, [&log] { return log.stopped; });
+  if (log.fd != STDOUT_FILENO) {
+    close(log.fd);
+  }
+  log.fd = -1;
+}
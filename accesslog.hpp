@@ -0,0 +1,68 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <cstdint>
+#include <string>
+
+#include "client.hpp"
+#include "request.hpp"
+
+// Access log. A request is formatted on the thread that served it, into
+// that thread's ring buffer, without locks or system calls. A writer
+// thread collects the rings every flush interval, or sooner once one is
+// half full, and writes them out in large writes. A line that does not
+// fit in its thread's ring is dropped and counted in the metrics
+// (cppserver_access_log_dropped_total), so logging never holds up serving.
+
+// Bytes of log lines buffered per thread.
+#define ACCESS_LOG_RING_SIZE (256 * 1024)
+
+// How often the writer collects the rings (milliseconds).
+#define ACCESS_LOG_FLUSH_MS 100
+
+// Longest line; longer ones are cut short.
+#define ACCESS_LOG_LINE_MAX 2048
+
+enum class AccessLogFormat {
+  Off,
+  // NCSA Common Log Format:
+  //   host - - [10/Oct/2000:13:55:36 -0700] "GET / HTTP/1.1" 200 2326
+  Common,
+  // Common, then the quoted Referer and User-Agent.
+  Combined,
+  // One JSON object per line, with the duration in microseconds.
+  Json
+};
+
+struct AccessLogOptions {
+  AccessLogFormat format = AccessLogFormat::Common;
+
+  // File appended to; standard output if empty.
+  std::string path;
+
+  // Log one request in sample (counted per thread); 1 logs them all.
+  unsigned sample = 1;
+
+  size_t ring_size = ACCESS_LOG_RING_SIZE;
+  int flush_interval_ms = ACCESS_LOG_FLUSH_MS;
+};
+
+// A request that has been answered.
+struct AccessRecord {
+  cppserver::Client *client;  // Connection it came on.
+  Request *request;           // Null if it could not be parsed.
+  int status;                 // 0 if no response was sent.
+  uint64_t bytes;             // Response body bytes.
+  uint64_t start;             // When serving it began (metricsNow).
+};
+
+// Open the log and start its writer. Exits if the file cannot be opened.
+void startAccessLog(const AccessLogOptions &options);
+
+// Log record, if the log is on and the request is sampled.
+void logAccess(const AccessRecord &record);
+
+// Write out the lines logged so far and stop the writer.
+void stopAccessLog();
+
+#endif /* ACCESSLOG_H */
@@ -0,0 +1,101 @@
+#include "affinity.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <mutex>
+
+#include <sched.h>
+
+bool parseCpuList(const std::string &text, CpuList &cpus) {
+  cpus.clear();
+  size_t pos = 0;
+  while (pos <= text.size()) {
+    size_t end = text.find(',', pos);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    std::string item = text.substr(pos, end - pos);
+    pos = end + 1;
+
+    // "a" or "a-b", both decimal CPU numbers below CPU_SETSIZE.
+    const char *p = item.c_str();
+    char *stop;
+    if (*p < '0' || *p > '9') {
+      return false;
+    }
+    long first = strtol(p, &stop, 10);
+    long last = first;
+    if (*stop == '-') {
+      p = stop + 1;
+      if (*p < '0' || *p > '9') {
+        return false;
+      }
+      last = strtol(p, &stop, 10);
+    }
+    if (*stop != '\0' || last < first || last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(static_cast<int>(cpu));
+    }
+  }
+  return true;
+}
+
+std::string formatCpuList(const CpuList &cpus) {
+  std::string out;
+  for (size_t i = 0; i < cpus.size();) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+      j++;
+    }
+    out += (out.empty() ? "" : ",") + std::to_string(cpus[i]);
+    if (j > i) {
+      out += "-" + std::to_string(cpus[j]);
+    }
+    i = j + 1;
+  }
+  return out;
+}
+
+bool pinThread(pthread_t thread, const CpuList &cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+      errno = EINVAL;
+      return false;
+    }
+    CPU_SET(cpu, &set);
+  }
+  int error = pthread_setaffinity_np(thread, sizeof(set), &set);
+  if (error != 0) {
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+static std::mutex io_cpus_mutex;
+static CpuList io_cpus;
+
+void setIoCpus(const CpuList &cpus) {
+  std::lock_guard<std::mutex> lock(io_cpus_mutex);
+  io_cpus = cpus;
+}
+
+void pinIoThread() {
+  CpuList cpus;
+  {
+    std::lock_guard<std::mutex> lock(io_cpus_mutex);
+    cpus = io_cpus;
+  }
+  if (!cpus.empty()) {
+    pinThread(pthread_self(), cpus);
+  }
+}
+
+unsigned currentNode() {
+  unsigned cpu, node;
+  return getcpu(&cpu, &node) == 0 ? node : 0;
+}
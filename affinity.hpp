@@ -0,0 +1,50 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+// CPU numbers, e.g. from parseCpuList("0-3,8").
+typedef std::vector<int> CpuList;
+
+// Where the server's threads run. Each field is a CPU list in the kernel's
+// format ("0-3,8", as in /sys/devices/system/cpu/online); empty leaves
+// those threads to the scheduler. Keeping the event loop, the workers and
+// the NIC queue interrupts of a server on one NUMA node keeps its memory
+// local, since pinned threads allocate from the node they run on.
+struct CpuAffinity {
+  // The event loop thread (the one calling TCPServer::Listen).
+  std::string loop;
+
+  // Request workers: one per listed CPU, each pinned to its own CPU.
+  std::string workers;
+
+  // File I/O executors and the readers and writers of upgraded
+  // connections, which may run on any listed CPU. Only threads started
+  // after the setting is applied are placed.
+  std::string io;
+};
+
+// Parse a CPU list such as "0-3,8,10-11" into cpus, in the order given.
+// Returns false on syntax errors.
+bool parseCpuList(const std::string &text, CpuList &cpus);
+
+// Format cpus the way parseCpuList reads them, e.g. "0-3,8".
+std::string formatCpuList(const CpuList &cpus);
+
+// Restrict thread to cpus. Returns false, with errno set, if the kernel
+// refuses (e.g. a CPU that is offline or outside the cpuset).
+bool pinThread(pthread_t thread, const CpuList &cpus);
+
+// CPUs that I/O threads started from now on are restricted to.
+void setIoCpus(const CpuList &cpus);
+
+// Restrict the calling thread to the I/O CPUs, if any are set.
+void pinIoThread();
+
+// NUMA node of the CPU the calling thread is running on (0 without NUMA).
+unsigned currentNode();
+
+#endif /* AFFINITY_H */
@@ -0,0 +1,119 @@
+#include "bufferpool.hpp"
+
+#include <new>
+
+#include "affinity.hpp"
+
+static const size_t classSizes[RECV_BUFFER_CLASSES] = {
+    RECV_BUFFER_SMALL,
+    RECV_BUFFER_MEDIUM,
+    RECV_BUFFER_LARGE,
+};
+
+BufferPool::BufferPool(size_t max_free_bytes)
+    : free_bytes(0), max_free_bytes(max_free_bytes) {}
+
+std::string BufferPool::Acquire(size_t size) {
+  int size_class = RECV_BUFFER_CLASSES - 1;
+  for (int i = 0; i < RECV_BUFFER_CLASSES; i++) {
+    if (size <= classSizes[i]) {
+      size_class = i;
+      break;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::string> &free_list = free_lists[size_class];
+    if (!free_list.empty()) {
+      std::string buffer = std::move(free_list.back());
+      free_list.pop_back();
+      free_bytes -= buffer.capacity();
+      return buffer;
+    }
+  }
+
+  std::string buffer;
+  try {
+    buffer.reserve(classSizes[size_class]);
+  } catch (const std::bad_alloc &) {
+    // Under memory pressure give the cached buffers back and retry once.
+    Trim(0);
+    buffer.reserve(classSizes[size_class]);
+  }
+  return buffer;
+}
+
+void BufferPool::Release(std::string buffer) {
+  size_t capacity = buffer.capacity();
+  if (capacity < classSizes[0] ||
+      capacity > 2 * classSizes[RECV_BUFFER_CLASSES - 1]) {
+    return;
+  }
+
+  // File it under the largest class it has room for.
+  int size_class = 0;
+  while (size_class + 1 < RECV_BUFFER_CLASSES &&
+         capacity >= classSizes[size_class + 1]) {
+    size_class++;
+  }
+
+  buffer.clear();
+  std::lock_guard<std::mutex> lock(mutex);
+  if (free_bytes + capacity <= max_free_bytes) {
+    free_lists[size_class].push_back(std::move(buffer));
+    free_bytes += capacity;
+  }
+}
+
+void BufferPool::Trim(size_t keep_bytes) {
+  std::vector<std::string> excess;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    // Drop the largest buffers first.
+    for (int i = RECV_BUFFER_CLASSES - 1; i >= 0 && free_bytes > keep_bytes;
+         i--) {
+      std::vector<std::string> &free_list = free_lists[i];
+      while (!free_list.empty() && free_bytes > keep_bytes) {
+        free_bytes -= free_list.back().capacity();
+        excess.push_back(std::move(free_list.back()));
+        free_list.pop_back();
+      }
+    }
+  }
+  // excess frees the buffers outside the lock.
+}
+
+size_t BufferPool::FreeBytes() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return free_bytes;
+}
+
+void BufferPool::SetMaxFreeBytes(size_t bytes) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    max_free_bytes = bytes;
+  }
+  Trim(bytes);
+}
+
+BufferPool &recvBufferPool() {
+  static BufferPool pools[RECV_POOL_NODES];
+  return pools[currentNode() % RECV_POOL_NODES];
+}
+
+void reserveRecvSpace(std::string &buffer) {
+  size_t capacity = buffer.capacity();
+  if (capacity - buffer.size() >= RECV_READ_MIN_FREE) {
+    return;
+  }
+
+  size_t want = capacity * 2;
+  for (int i = 0; i < RECV_BUFFER_CLASSES; i++) {
+    if (capacity < classSizes[i]) {
+      want = classSizes[i];
+      break;
+    }
+  }
+  buffer.reserve(want);
+}
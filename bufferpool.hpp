@@ -0,0 +1,62 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Receive buffer size classes.
+#define RECV_BUFFER_SMALL (4 * 1024)
+#define RECV_BUFFER_MEDIUM (16 * 1024)
+#define RECV_BUFFER_LARGE (64 * 1024)
+#define RECV_BUFFER_CLASSES 3
+
+// Free space below which Read moves a buffer to the next size class.
+#define RECV_READ_MIN_FREE 1024
+
+// Free bytes kept by the pool before released buffers go back to malloc.
+#define RECV_POOL_MAX_FREE (8 * 1024 * 1024)
+
+// Connections use one pool per NUMA node (higher nodes share pools).
+#define RECV_POOL_NODES 8
+
+// Pool of receive buffers in three size classes. A buffer is a string
+// with reserved capacity, so a connection reads into it and parses it in
+// place. Connections take one when they are woken and give it back when
+// they go idle, so idle connections hold no receive buffer.
+class BufferPool {
+public:
+  explicit BufferPool(size_t max_free_bytes = RECV_POOL_MAX_FREE);
+
+  // Returns an empty buffer with room for at least size bytes, or for the
+  // largest class if size is bigger.
+  std::string Acquire(size_t size = RECV_BUFFER_SMALL);
+
+  // Keep buffer for reuse. It is freed instead if it is smaller than the
+  // smallest class, grew past twice the largest one, or the pool is full.
+  void Release(std::string buffer);
+
+  // Free cached buffers, largest first, until at most keep_bytes remain.
+  void Trim(size_t keep_bytes = 0);
+
+  size_t FreeBytes();
+  void SetMaxFreeBytes(size_t bytes);
+
+private:
+  std::mutex mutex;
+  std::vector<std::string> free_lists[RECV_BUFFER_CLASSES];
+  size_t free_bytes;     // Capacity of the cached buffers.
+  size_t max_free_bytes;
+};
+
+// The pool for connection input on the calling thread's NUMA node. A
+// buffer is first touched, and so placed, on the node that reads into it,
+// and goes back to the pool of the node that releases it.
+BufferPool &recvBufferPool();
+
+// Make room at the end of buffer for a read, moving it up through the
+// size classes and doubling past the largest one.
+void reserveRecvSpace(std::string &buffer);
+
+#endif
@@ -1,27 +1,80 @@
 #include "client.hpp"
+#include "bufferpool.hpp"
+#include "metrics.hpp"
 #include <cstring>
 
-cppserver::Client::Client(int client_fd, int epoll_fd)
-    : client_fd(client_fd), epoll_fd(epoll_fd) {}
+extern "C" {
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+}
+
+static const Counter received_bytes("cppserver_received_bytes_total",
+                                    "Bytes received from clients.");
+static const Counter sent_bytes("cppserver_sent_bytes_total",
+                                "Bytes sent to clients.");
+static const Histogram write_seconds(
+    "cppserver_write_seconds",
+    "Time taken by writes to clients, including waits for a full socket "
+    "buffer.");
+static const Gauge open_connections("cppserver_open_connections",
+                                    "Client connections open.");
+
+void cppserver::Client::CountAccepted() { open_connections.Add(1); }
+
+void cppserver::Client::CountReceived(size_t bytes) {
+  received_bytes.Add(bytes);
+}
+
+void cppserver::Client::CountWritten(size_t bytes, uint64_t start) {
+  sent_bytes.Add(bytes);
+  if (start != 0) {
+    write_seconds.RecordSince(start);
+  }
+}
+
+cppserver::Client::Client(int client_fd)
+    : client_fd(client_fd), corked(false), peer_closed(false),
+      bytes_sent(0), head_bytes(0) {}
 
 cppserver::Client::~Client() {
+  if (client_fd == -1) {
+    return;
+  }
+  Flush();
   shutdown(client_fd, SHUT_WR);
   close(client_fd);
+  open_connections.Add(-1);
+}
+
+int cppserver::Client::Release() {
+  Flush();
+  int fd = client_fd;
+  client_fd = -1;
+  return fd;
 }
 
-// Reads data from a client socket
+// Reads data from a client socket straight into the end of buffer.
 // Returns the total bytes read or -1 on failure
 int cppserver::Client::Read(std::string &buffer) {
   int success = 1;
+  size_t received = 0;
 
   while (true) {
-    char inner_buf[BUFSIZ];
-    ssize_t bytes_read = read(client_fd, inner_buf, sizeof(inner_buf));
+    reserveRecvSpace(buffer);
+    size_t used = buffer.size();
+    size_t room = buffer.capacity() - used;
+    buffer.resize(used + room);
+    ssize_t bytes_read = read(client_fd, &buffer[used], room);
+    buffer.resize(used + (bytes_read > 0 ? bytes_read : 0));
 
     if (bytes_read <= 0) {
       if (bytes_read == 0) {
         // End of file. The remote has closed the connection.
         success = 1;
+        peer_closed = true;
       } else if (bytes_read < 0) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
           // No more data to read for now, try again later
@@ -31,13 +84,24 @@ int cppserver::Client::Read(std::string &buffer) {
         }
       }
       break;
-    } else {
-      buffer.append(inner_buf, static_cast<size_t>(bytes_read));
     }
+    received += static_cast<size_t>(bytes_read);
   }
+
+  CountReceived(received);
   return success ? buffer.size() : -1;
 }
 
+void cppserver::Client::TakeReceived(std::string data, std::string &buffer) {
+  CountReceived(data.size());
+  // Copy into buffer when it has room, so that a pooled buffer is kept.
+  if (buffer.empty() && buffer.capacity() < data.size()) {
+    buffer = std::move(data);
+  } else {
+    buffer.append(data);
+  }
+}
+
 void cppserver::Client::SendHttpError(HttpStatus status,
                                       const std::string &message) {
   std::string reply;
@@ -46,14 +110,191 @@ void cppserver::Client::SendHttpError(HttpStatus status,
       "HTTP/1.1 " + std::to_string(status) + " " + StatusText(status) + "\r\n";
   reply += "Content-Type: text/html\r\n";
   reply += "Content-Length: " + std::to_string(message.size()) + "\r\n";
-  reply += "\r\n" + message + "\r\n";
+  reply += "\r\n" + message;
+
+  if (Send(reply) != -1) {
+    CountHead(reply.size() - message.size());
+  }
+  noteResponseStatus(status);
+}
+
+// Block until fd is writable. Returns false on timeout or error.
+static bool waitWritable(int fd) {
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+
+  int rc;
+  do {
+    rc = poll(&pfd, 1, SEND_TIMEOUT_MS);
+  } while (rc == -1 && errno == EINTR);
+  return rc == 1 && !(pfd.revents & (POLLERR | POLLHUP | POLLNVAL));
+}
+
+// Send all of iov with sendmsg(2), waiting while the socket buffer is full.
+// Returns false on errors.
+static bool sendAll(int fd, struct iovec *iov, int iovcnt, int flags) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+
+  while (msg.msg_iovlen > 0) {
+    ssize_t n = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && waitWritable(fd)) {
+        continue;
+      }
+      return false;
+    }
+
+    // Skip what was written.
+    size_t written = static_cast<size_t>(n);
+    while (msg.msg_iovlen > 0 && written >= msg.msg_iov->iov_len) {
+      written -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      char *base = static_cast<char *>(msg.msg_iov->iov_base);
+      msg.msg_iov->iov_base = base + written;
+      msg.msg_iov->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+ssize_t cppserver::Client::Send(std::string_view data, int flags) {
+  if (corked && out.size() + data.size() <= CORK_LIMIT) {
+    out.append(data);
+    bytes_sent += data.size();
+    return static_cast<ssize_t>(data.size());
+  }
+
+  // Write the batched output and data together.
+  struct iovec iov[2];
+  int iovcnt = 0;
+  if (!out.empty()) {
+    iov[iovcnt].iov_base = out.data();
+    iov[iovcnt].iov_len = out.size();
+    iovcnt++;
+  }
+  iov[iovcnt].iov_base = const_cast<char *>(data.data());
+  iov[iovcnt].iov_len = data.size();
+  iovcnt++;
 
-  send(client_fd, reply.c_str(), reply.size(), 0);
-  std::cout << "[ERROR]: " << message << std::endl;
+  uint64_t start = metricsNow();
+  bool ok = WriteAll(iov, iovcnt, flags);
+  if (ok) {
+    CountWritten(out.size() + data.size(), start);
+    bytes_sent += data.size();
+  }
+  out.clear();
+  return ok ? static_cast<ssize_t>(data.size()) : -1;
 }
 
-size_t cppserver::Client::Send(const std::string &data) {
-  return send(client_fd, data.c_str(), data.size(), 0);
+bool cppserver::Client::WriteAll(struct iovec *iov, int iovcnt, int flags) {
+  return sendAll(client_fd, iov, iovcnt, flags);
+}
+
+bool cppserver::Client::WriteBatched(int flags) {
+  if (out.empty()) {
+    return true;
+  }
+
+  struct iovec iov;
+  iov.iov_base = out.data();
+  iov.iov_len = out.size();
+  uint64_t start = metricsNow();
+  bool ok = WriteAll(&iov, 1, flags);
+  if (ok) {
+    CountWritten(out.size(), start);
+  }
+  out.clear();
+  return ok;
 }
 
-int cppserver::Client::fd() { return client_fd; }
\ No newline at end of file
+ssize_t cppserver::Client::TrySend(const struct iovec *iov, int iovcnt) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = const_cast<struct iovec *>(iov);
+  msg.msg_iovlen = iovcnt;
+
+  ssize_t n;
+  do {
+    n = sendmsg(client_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  } while (n == -1 && errno == EINTR);
+  if (n > 0) {
+    CountWritten(static_cast<size_t>(n), 0);
+  }
+  return n;
+}
+
+void cppserver::Client::Cork() { corked = true; }
+
+bool cppserver::Client::Flush() {
+  corked = false;
+  return WriteBatched(0);
+}
+
+ssize_t cppserver::Client::SendFile(int file_fd, off_t offset, size_t count) {
+  // Batched output goes first, in the same segment as the file if possible.
+  if (!WriteBatched(MSG_MORE)) {
+    return -1;
+  }
+
+  size_t sent = 0;
+  uint64_t start = metricsNow();
+  while (sent < count) {
+    ssize_t n = sendfile(client_fd, file_fd, &offset, count - sent);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+          waitWritable(client_fd)) {
+        continue;
+      }
+      perror("sendfile");
+      CountWritten(sent, start);
+      return -1;
+    }
+    if (n == 0) {
+      // File was truncated while sending.
+      break;
+    }
+    sent += static_cast<size_t>(n);
+  }
+  CountWritten(sent, start);
+  bytes_sent += sent;
+  return static_cast<ssize_t>(sent);
+}
+
+int cppserver::Client::fd() { return client_fd; }
+
+std::string cppserver::Client::PeerAddress() {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (getpeername(client_fd, (struct sockaddr *)&addr, &len) == -1) {
+    return "";
+  }
+
+  char buf[INET6_ADDRSTRLEN];
+  const void *src;
+  if (addr.ss_family == AF_INET) {
+    src = &((struct sockaddr_in *)&addr)->sin_addr;
+  } else if (addr.ss_family == AF_INET6) {
+    src = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+  } else {
+    return "";
+  }
+
+  if (inet_ntop(addr.ss_family, src, buf, sizeof(buf)) == NULL) {
+    return "";
+  }
+  return buf;
+}
@@ -2,29 +2,116 @@
 #define CLIENT_H
 
 #include "status.hpp"
+#include <cstdint>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <vector>
 
+// How long a send waits for a full socket buffer to drain (milliseconds).
+#define SEND_TIMEOUT_MS 30000
+
+// Most bytes batched by Cork before they are written out.
+#define CORK_LIMIT (64 * 1024)
+
 namespace cppserver {
+// A connected socket. I/O methods are virtual so that an HTTP/2 stream
+// (see http2.hpp) can stand in for the socket and a TLS connection (see
+// tls.hpp) can encrypt it.
 class Client {
 private:
   int client_fd;
-  int epoll_fd;
+  bool corked;     // Batch sends in out until Flush.
+  std::string out; // Batched output.
+
+protected:
+  bool peer_closed;    // Read reached the end of the stream.
+  uint64_t bytes_sent; // Taken by Send and SendFile, see BodyBytesSent.
+  uint64_t head_bytes; // Of bytes_sent, those of response heads.
+
+  // Write all of iov, waiting while the socket buffer is full. Returns
+  // false on errors.
+  virtual bool WriteAll(struct iovec *iov, int iovcnt, int flags);
+
+  // Write the batched output. Returns false on errors.
+  bool WriteBatched(int flags);
+
+  // Count bytes received from the client (after decryption) in the
+  // metrics.
+  static void CountReceived(size_t bytes);
+
+  // Count bytes written to the client (before encryption), and the time
+  // the write took since start (metricsNow) unless start is 0.
+  static void CountWritten(size_t bytes, uint64_t start);
 
 public:
-  explicit Client(int client_fd, int epoll_fd);
-  ~Client();
+  explicit Client(int client_fd);
+  virtual ~Client();
 
   // Reads data from a client socket
   // Returns the total bytes read or -1 on failure
-  int Read(std::string &buffer);
-  size_t Send(const std::string &data);
+  virtual int Read(std::string &buffer);
+
+  // Take bytes the event loop already read from the socket. They are the
+  // start of buffer, or of the input to decrypt.
+  virtual void TakeReceived(std::string data, std::string &buffer);
+
+  // Advance the connection handshake, if the protocol has one. Returns 1
+  // when it is complete, 0 if it needs more input, -1 on failure.
+  virtual int Handshake() { return 1; }
+
+  // True if the connection has state beyond its socket (e.g. a TLS
+  // session) and must be kept, not released, between requests.
+  virtual bool Stateful() const { return false; }
+
+  // True once Read has seen the peer close the connection.
+  bool PeerClosed() const { return peer_closed; }
+
+  // Bytes of response bodies taken by Send and SendFile so far, written or
+  // still batched: those sent less the ones counted by CountHead.
+  uint64_t BodyBytesSent() const { return bytes_sent - head_bytes; }
+
+  // Count bytes just sent as a response head (status line and headers).
+  void CountHead(size_t bytes) { head_bytes += bytes; }
+
+  // Write as much of iov as the socket takes without blocking. Returns
+  // the bytes written, or -1 with errno set (EAGAIN if nothing fit).
+  virtual ssize_t TrySend(const struct iovec *iov, int iovcnt);
+
+  // Sends all of data, waiting for the socket to become writable when its
+  // buffer is full. flags are passed to send(2), e.g. MSG_MORE.
+  // Returns the bytes sent or -1 on failure.
+  virtual ssize_t Send(std::string_view data, int flags = 0);
+
+  // Batch the output of Send until Flush, so the responses to pipelined
+  // requests go out in as few writes as possible. Batches larger than
+  // CORK_LIMIT are written early.
+  void Cork();
+
+  // Write batched output and stop batching. Returns false on errors.
+  bool Flush();
+
+  // Flush and give up the socket: the destructor will not close it.
+  // Returns the file descriptor.
+  int Release();
+
+  // Sends count bytes of file_fd starting at offset using sendfile(2).
+  // Returns the bytes sent or -1 on failure.
+  virtual ssize_t SendFile(int file_fd, off_t offset, size_t count);
 
   // Returns the client file descriptor.
   int fd();
+
+  // Count a newly accepted connection as open in the metrics; the Client
+  // that closes its socket counts it as closed.
+  static void CountAccepted();
+
+  // Returns the peer IP address as text, or an empty string on failure.
+  virtual std::string PeerAddress();
   void SendHttpError(HttpStatus status, const std::string &message);
 };
 } // namespace cppserver
@@ -0,0 +1,382 @@
+#include "compression.hpp"
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+#include <zlib.h>
+
+#ifdef CPPSERVER_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#ifdef CPPSERVER_HAVE_ZSTD
+const std::vector<std::string_view> supportedEncodings = {"zstd", "gzip"};
+#else
+const std::vector<std::string_view> supportedEncodings = {"gzip"};
+#endif
+
+// Chunk size used when streaming files through a compressor.
+#define COMPRESS_CHUNK (64 * 1024)
+
+static bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    if (std::tolower(static_cast<unsigned char>(a[i])) !=
+        std::tolower(static_cast<unsigned char>(b[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void trimSpace(std::string_view &s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+}
+
+// Returns the q-value of coding in an Accept-Encoding header, or -1 if the
+// coding is not listed (directly or through "*").
+static double acceptedQuality(std::string_view header, std::string_view coding) {
+  double wildcard = -1;
+  size_t pos = 0;
+
+  while (pos < header.size()) {
+    size_t comma = header.find(',', pos);
+    if (comma == std::string_view::npos) {
+      comma = header.size();
+    }
+    std::string_view item = header.substr(pos, comma - pos);
+    pos = comma + 1;
+
+    double q = 1.0;
+    size_t semicolon = item.find(';');
+    if (semicolon != std::string_view::npos) {
+      std::string_view params = item.substr(semicolon + 1);
+      item = item.substr(0, semicolon);
+      trimSpace(params);
+      if (params.size() > 2 && (params[0] == 'q' || params[0] == 'Q') &&
+          params[1] == '=') {
+        std::string value(params.substr(2));
+        q = std::strtod(value.c_str(), nullptr);
+      }
+    }
+    trimSpace(item);
+
+    if (equalsIgnoreCase(item, coding)) {
+      return q;
+    }
+    if (item == "*") {
+      wildcard = q;
+    }
+  }
+  return wildcard;
+}
+
+std::string_view negotiateEncoding(std::string_view accept_encoding,
+                                   const std::vector<std::string_view> &available) {
+  std::string_view best;
+  double best_q = 0;
+
+  for (std::string_view coding : available) {
+    double q = acceptedQuality(accept_encoding, coding);
+    // Earlier entries win ties, so available order is the preference.
+    if (q > best_q) {
+      best = coding;
+      best_q = q;
+    }
+  }
+  return best;
+}
+
+std::string_view encodingSuffix(std::string_view encoding) {
+  if (encoding == "gzip") {
+    return ".gz";
+  }
+  if (encoding == "zstd") {
+    return ".zst";
+  }
+  return "";
+}
+
+static bool gzipStream(int in, int out, int level) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  // 15 window bits + 16 selects the gzip wrapper.
+  if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) !=
+      Z_OK) {
+    return false;
+  }
+
+  unsigned char inbuf[COMPRESS_CHUNK];
+  unsigned char outbuf[COMPRESS_CHUNK];
+  bool ok = true;
+  int flush;
+
+  do {
+    ssize_t n = read(in, inbuf, sizeof(inbuf));
+    if (n < 0) {
+      ok = false;
+      break;
+    }
+    flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+    zs.next_in = inbuf;
+    zs.avail_in = static_cast<uInt>(n);
+
+    do {
+      zs.next_out = outbuf;
+      zs.avail_out = sizeof(outbuf);
+      deflate(&zs, flush);
+      size_t have = sizeof(outbuf) - zs.avail_out;
+      if (have > 0 && write(out, outbuf, have) != static_cast<ssize_t>(have)) {
+        ok = false;
+        break;
+      }
+    } while (zs.avail_out == 0);
+  } while (ok && flush != Z_FINISH);
+
+  deflateEnd(&zs);
+  return ok;
+}
+
+#ifdef CPPSERVER_HAVE_ZSTD
+static bool zstdStream(int in, int out, int level) {
+  ZSTD_CCtx *cctx = ZSTD_createCCtx();
+  if (cctx == NULL) {
+    return false;
+  }
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+
+  std::vector<char> inbuf(ZSTD_CStreamInSize());
+  std::vector<char> outbuf(ZSTD_CStreamOutSize());
+  bool ok = true;
+  bool last;
+
+  do {
+    ssize_t n = read(in, inbuf.data(), inbuf.size());
+    if (n < 0) {
+      ok = false;
+      break;
+    }
+    last = n == 0;
+    ZSTD_EndDirective mode = last ? ZSTD_e_end : ZSTD_e_continue;
+    ZSTD_inBuffer input = {inbuf.data(), static_cast<size_t>(n), 0};
+
+    bool finished;
+    do {
+      ZSTD_outBuffer output = {outbuf.data(), outbuf.size(), 0};
+      size_t remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+      if (ZSTD_isError(remaining) ||
+          write(out, outbuf.data(), output.pos) !=
+              static_cast<ssize_t>(output.pos)) {
+        ok = false;
+        break;
+      }
+      finished = last ? (remaining == 0) : (input.pos == input.size);
+    } while (!finished);
+  } while (ok && !last);
+
+  ZSTD_freeCCtx(cctx);
+  return ok;
+}
+#endif
+
+bool compressFile(std::string_view encoding, const std::string &src,
+                  const std::string &dst, int level) {
+  int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in == -1) {
+    return false;
+  }
+
+  std::string tmp = dst + ".tmp" + std::to_string(getpid());
+  int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out == -1) {
+    close(in);
+    return false;
+  }
+
+  bool ok = false;
+  if (encoding == "gzip") {
+    ok = gzipStream(in, out, level);
+  }
+#ifdef CPPSERVER_HAVE_ZSTD
+  else if (encoding == "zstd") {
+    ok = zstdStream(in, out, level);
+  }
+#endif
+
+  close(in);
+  if (close(out) == -1) {
+    ok = false;
+  }
+
+  if (!ok || rename(tmp.c_str(), dst.c_str()) == -1) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// zlib-based codec. window_bits selects the wrapper: 15 + 16 for gzip,
+// 15 for the zlib format used by the "deflate" coding.
+class ZlibCompressor : public Compressor {
+ public:
+  explicit ZlibCompressor(int window_bits) : level(Z_DEFAULT_COMPRESSION) {
+    memset(&zs, 0, sizeof(zs));
+    ready = deflateInit2(&zs, level, Z_DEFLATED, window_bits, 8,
+                         Z_DEFAULT_STRATEGY) == Z_OK;
+  }
+
+  ~ZlibCompressor() override {
+    if (ready) {
+      deflateEnd(&zs);
+    }
+  }
+
+  bool Reset(int new_level) override {
+    if (!ready || deflateReset(&zs) != Z_OK) {
+      return false;
+    }
+    if (new_level != level) {
+      if (deflateParams(&zs, new_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+      }
+      level = new_level;
+    }
+    return true;
+  }
+
+  bool Compress(std::string_view data, FlushMode flush,
+                std::string &out) override {
+    int mode = flush == FlushMode::Finish ? Z_FINISH
+               : flush == FlushMode::Sync ? Z_SYNC_FLUSH
+                                          : Z_NO_FLUSH;
+
+    zs.next_in = (Bytef *)data.data();
+    zs.avail_in = static_cast<uInt>(data.size());
+
+    int rc;
+    do {
+      size_t offset = out.size();
+      size_t room = deflateBound(&zs, zs.avail_in) + 64;
+      out.resize(offset + room);
+      zs.next_out = reinterpret_cast<Bytef *>(&out[offset]);
+      zs.avail_out = static_cast<uInt>(room);
+
+      rc = deflate(&zs, mode);
+      out.resize(offset + room - zs.avail_out);
+      if (rc == Z_STREAM_ERROR) {
+        return false;
+      }
+    } while (zs.avail_out == 0 || zs.avail_in > 0);
+
+    return mode != Z_FINISH || rc == Z_STREAM_END;
+  }
+
+ private:
+  z_stream zs;
+  int level;
+  bool ready;
+};
+
+#ifdef CPPSERVER_HAVE_ZSTD
+class ZstdCompressor : public Compressor {
+ public:
+  ZstdCompressor() : cctx(ZSTD_createCCtx()) {}
+  ~ZstdCompressor() override { ZSTD_freeCCtx(cctx); }
+
+  bool Reset(int level) override {
+    if (cctx == NULL) {
+      return false;
+    }
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+    return !ZSTD_isError(
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level));
+  }
+
+  bool Compress(std::string_view data, FlushMode flush,
+                std::string &out) override {
+    ZSTD_EndDirective mode = flush == FlushMode::Finish ? ZSTD_e_end
+                             : flush == FlushMode::Sync ? ZSTD_e_flush
+                                                        : ZSTD_e_continue;
+    ZSTD_inBuffer input = {data.data(), data.size(), 0};
+
+    size_t remaining;
+    do {
+      size_t offset = out.size();
+      size_t room = ZSTD_compressBound(input.size - input.pos) + 64;
+      out.resize(offset + room);
+      ZSTD_outBuffer output = {&out[offset], room, 0};
+
+      remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+      out.resize(offset + output.pos);
+      if (ZSTD_isError(remaining)) {
+        return false;
+      }
+    } while (input.pos < input.size ||
+             (mode != ZSTD_e_continue && remaining != 0));
+    return true;
+  }
+
+ private:
+  ZSTD_CCtx *cctx;
+};
+#endif
+
+static std::unordered_map<std::string, CompressorFactory> &compressorFactories() {
+  static std::unordered_map<std::string, CompressorFactory> factories = {
+      {"gzip", [] { return std::make_unique<ZlibCompressor>(15 + 16); }},
+      {"deflate", [] { return std::make_unique<ZlibCompressor>(15); }},
+#ifdef CPPSERVER_HAVE_ZSTD
+      {"zstd", [] { return std::make_unique<ZstdCompressor>(); }},
+#endif
+  };
+  return factories;
+}
+
+void registerCompressor(std::string_view encoding, CompressorFactory factory) {
+  compressorFactories()[std::string(encoding)] = std::move(factory);
+}
+
+Compressor *threadCompressor(std::string_view encoding, int level) {
+  thread_local std::unordered_map<std::string, std::unique_ptr<Compressor>>
+      compressors;
+
+  std::string key(encoding);
+  auto it = compressors.find(key);
+  if (it == compressors.end()) {
+    auto factory = compressorFactories().find(key);
+    if (factory == compressorFactories().end()) {
+      return nullptr;
+    }
+    it = compressors.emplace(key, factory->second()).first;
+  }
+
+  Compressor *compressor = it->second.get();
+  if (!compressor || !compressor->Reset(level)) {
+    return nullptr;
+  }
+  return compressor;
+}
+
+static CompressionOptions compressionOptions;
+
+void setCompressionOptions(const CompressionOptions &options) {
+  compressionOptions = options;
+}
+
+const CompressionOptions &getCompressionOptions() { return compressionOptions; }
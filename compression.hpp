@@ -0,0 +1,76 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Content codings understood by the server, in order of preference.
+// "zstd" is only available when built with CPPSERVER_HAVE_ZSTD.
+extern const std::vector<std::string_view> supportedEncodings;
+
+// Pick the best coding from available (in order of server preference) for
+// an Accept-Encoding header value. Returns an empty view if the client does
+// not accept any of them, meaning the identity coding should be used.
+std::string_view negotiateEncoding(std::string_view accept_encoding,
+                                   const std::vector<std::string_view> &available);
+
+// Compress src into dst with the named coding ("gzip" or "zstd").
+// dst is written to a temporary file and renamed into place, so readers
+// never observe a partial file. Returns false on failure.
+bool compressFile(std::string_view encoding, const std::string &src,
+                  const std::string &dst, int level);
+
+// File name suffix used for a coding's precompressed variant (".gz", ".zst").
+std::string_view encodingSuffix(std::string_view encoding);
+
+// How a Compressor call ends the data it was given.
+enum class FlushMode {
+  None,   // Buffer internally; output may be held back.
+  Sync,   // Emit everything so far so the client can decode it now.
+  Finish, // End the stream.
+};
+
+// Streaming compressor for one content coding.
+// Instances are kept per thread and reused across responses, so Reset must
+// start a fresh stream without releasing the compression window.
+class Compressor {
+ public:
+  virtual ~Compressor() = default;
+
+  // Start a new stream at the given level.
+  virtual bool Reset(int level) = 0;
+
+  // Compress data and append the output to out.
+  virtual bool Compress(std::string_view data, FlushMode flush,
+                        std::string &out) = 0;
+};
+
+typedef std::function<std::unique_ptr<Compressor>()> CompressorFactory;
+
+// Register a codec for on-the-fly response compression, or replace a
+// built-in one ("gzip", "deflate", and "zstd" when available).
+// Must be called at startup, before the server is listening.
+void registerCompressor(std::string_view encoding, CompressorFactory factory);
+
+// Returns the calling thread's compressor for encoding, reset to level, or
+// nullptr if no codec is registered for it.
+Compressor *threadCompressor(std::string_view encoding, int level);
+
+// Settings for compressing dynamic responses (Response::Send and
+// Response::SendChunk). Off unless enabled.
+struct CompressionOptions {
+  bool enabled = false;
+  size_t min_size = 1024; // Smaller bodies are sent as is.
+  int level = 6;
+  // Codings to offer, in order of preference. Each must be registered.
+  std::vector<std::string> encodings = {"gzip", "deflate"};
+};
+
+void setCompressionOptions(const CompressionOptions &options);
+const CompressionOptions &getCompressionOptions();
+
+#endif /* COMPRESSION_H */
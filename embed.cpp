@@ -0,0 +1,27 @@
+#include "embed.hpp"
+
+#include <algorithm>
+#include <string>
+
+const EmbeddedFile *findEmbeddedFile(const EmbeddedBundle &bundle,
+                                     std::string_view path) {
+  std::string index;
+  if (path.empty() || path.back() == '/') {
+    index.reserve(path.size() + 11);
+    index.append(path.empty() ? "/" : path);
+    index.append("index.html");
+    path = index;
+  }
+
+  const EmbeddedFile *begin = bundle.files;
+  const EmbeddedFile *end = bundle.files + bundle.count;
+  const EmbeddedFile *it = std::lower_bound(
+      begin, end, path, [](const EmbeddedFile &file, std::string_view key) {
+        return std::string_view(file.path) < key;
+      });
+
+  if (it != end && std::string_view(it->path) == path) {
+    return it;
+  }
+  return nullptr;
+}
@@ -0,0 +1,31 @@
+#ifndef EMBED_H
+#define EMBED_H
+
+#include <cstddef>
+#include <string_view>
+
+// A file compiled into the binary by cppserver-embed.
+struct EmbeddedFile {
+  const char *path;                // Path within the bundle, e.g. "/app.js".
+  const unsigned char *data;       // File contents.
+  size_t size;                     // Size of data in bytes.
+  const char *content_type;        // MIME type.
+  const char *etag;                // Quoted strong ETag (content hash).
+  const char *headers;             // Pre-serialized header lines, each
+                                   // ending in CRLF (Content-Type,
+                                   // Content-Length, ETag).
+  size_t headers_size;             // Length of headers.
+};
+
+// A directory compiled into the binary. Files are sorted by path.
+struct EmbeddedBundle {
+  const EmbeddedFile *files;
+  size_t count;
+};
+
+// Find the file at path in bundle. A path that is empty or ends in '/'
+// resolves to its index.html. Returns nullptr if there is no such file.
+const EmbeddedFile *findEmbeddedFile(const EmbeddedBundle &bundle,
+                                     std::string_view path);
+
+#endif /* EMBED_H */
@@ -0,0 +1,194 @@
+// cppserver-embed: compile a directory into a C++ source file.
+//
+// Usage: cppserver-embed <symbol> <directory> <output-basename>
+//
+// Writes <output-basename>.cpp, defining `const EmbeddedBundle <symbol>`,
+// and <output-basename>.hpp declaring it. Serve the bundle with
+// Router::EMBED. See cppserver_embed_directory in CMakeLists.txt.
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "mime.hpp"
+
+namespace fs = std::filesystem;
+
+struct InputFile {
+  std::string path; // Bundle path, e.g. "/css/site.css".
+  std::vector<unsigned char> data;
+};
+
+static bool isIdentifier(const std::string &s) {
+  if (s.empty() || std::isdigit(static_cast<unsigned char>(s[0]))) {
+    return false;
+  }
+  return std::all_of(s.begin(), s.end(), [](char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+  });
+}
+
+// Escape s for use inside a C string literal.
+static std::string quote(const std::string &s) {
+  std::string out = "\"";
+  for (char c : s) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    default:
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+static uint64_t contentHash(const std::vector<unsigned char> &data) {
+  uint64_t hash = 14695981039346656037ull;
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static bool readFile(const fs::path &path, std::vector<unsigned char> &data) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  data.assign(std::istreambuf_iterator<char>(in),
+              std::istreambuf_iterator<char>());
+  return !in.bad();
+}
+
+static void writeBytes(std::ostream &out, const std::vector<unsigned char> &data) {
+  char buf[8];
+  for (size_t i = 0; i < data.size(); i++) {
+    snprintf(buf, sizeof(buf), "%u,", data[i]);
+    out << buf;
+    if (i % 24 == 23) {
+      out << "\n";
+    }
+  }
+  if (data.empty()) {
+    out << "0";
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    std::cerr << "usage: " << argv[0]
+              << " <symbol> <directory> <output-basename>" << std::endl;
+    return 2;
+  }
+
+  std::string symbol = argv[1];
+  fs::path root = argv[2];
+  std::string output = argv[3];
+
+  if (!isIdentifier(symbol)) {
+    std::cerr << "invalid symbol name: " << symbol << std::endl;
+    return 2;
+  }
+
+  std::vector<InputFile> files;
+  std::error_code ec;
+  for (auto it = fs::recursive_directory_iterator(root, ec);
+       !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    if (!it->is_regular_file()) {
+      continue;
+    }
+
+    InputFile file;
+    file.path = "/" + fs::relative(it->path(), root).generic_string();
+    if (!readFile(it->path(), file.data)) {
+      std::cerr << "cannot read " << it->path() << std::endl;
+      return 1;
+    }
+    files.push_back(std::move(file));
+  }
+
+  if (ec) {
+    std::cerr << "cannot scan " << root << ": " << ec.message() << std::endl;
+    return 1;
+  }
+
+  // findEmbeddedFile does a binary search on path.
+  std::sort(files.begin(), files.end(),
+            [](const InputFile &a, const InputFile &b) {
+              return a.path < b.path;
+            });
+
+  std::ofstream cpp(output + ".cpp");
+  std::ofstream hpp(output + ".hpp");
+  if (!cpp || !hpp) {
+    std::cerr << "cannot write " << output << ".{cpp,hpp}" << std::endl;
+    return 1;
+  }
+
+  std::string guard = "EMBED_" + symbol + "_H";
+  std::transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+  hpp << "// Generated by cppserver-embed. Do not edit.\n"
+      << "#ifndef " << guard << "\n#define " << guard << "\n\n"
+      << "#include \"embed.hpp\"\n\n"
+      << "extern const EmbeddedBundle " << symbol << ";\n\n"
+      << "#endif /* " << guard << " */\n";
+
+  cpp << "// Generated by cppserver-embed from " << root.generic_string()
+      << ". Do not edit.\n"
+      << "#include \"embed.hpp\"\n\nnamespace {\n\n";
+
+  for (size_t i = 0; i < files.size(); i++) {
+    cpp << "const unsigned char data_" << i << "[] = {\n";
+    writeBytes(cpp, files[i].data);
+    cpp << "\n};\n\n";
+  }
+
+  if (files.empty()) {
+    std::cerr << "warning: " << root << " contains no files" << std::endl;
+    cpp << "} // namespace\n\n"
+        << "extern const EmbeddedBundle " << symbol << " = {nullptr, 0};\n";
+    return cpp && hpp ? 0 : 1;
+  }
+
+  cpp << "const EmbeddedFile files[] = {\n";
+  for (size_t i = 0; i < files.size(); i++) {
+    const InputFile &file = files[i];
+    std::string type(getContentType(file.path));
+
+    char etag[32];
+    snprintf(etag, sizeof(etag), "\"%016llx\"",
+             static_cast<unsigned long long>(contentHash(file.data)));
+
+    std::string headers = "Content-Type: " + type + "\r\n" +
+                          "Content-Length: " +
+                          std::to_string(file.data.size()) + "\r\n" +
+                          "ETag: " + etag + "\r\n";
+
+    cpp << "    {" << quote(file.path) << ", data_" << i << ", "
+        << file.data.size() << ", " << quote(type) << ", " << quote(etag)
+        << ",\n     " << quote(headers) << ", " << headers.size() << "},\n";
+  }
+  cpp << "};\n\n} // namespace\n\n"
+      << "extern const EmbeddedBundle " << symbol << " = {files, "
+      << files.size() << "};\n";
+
+  return cpp && hpp ? 0 : 1;
+}
@@ -0,0 +1,637 @@
+#include "eventloop.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+#include "server.hpp"
+
+extern "C" {
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The uapi header uses anonymous structs and flexible array members.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#include <linux/io_uring.h>
+#pragma GCC diagnostic pop
+}
+
+// Connections the epoll backend accepts per listener and wakeup, so that a
+// storm of connections cannot starve the clients already being served.
+#define ACCEPT_BATCH 64
+
+// Submission queue size of the io_uring backend.
+#define URING_ENTRIES 256
+
+// Provided receive buffers: count (power of two) and size of each.
+#define URING_RECV_BUFFERS 256
+#define URING_RECV_BUFFER_SIZE 8192
+
+// Registered file table size (listening sockets).
+#define URING_FIXED_FILES 16
+
+EventBackend eventBackendFromString(const std::string &value) {
+  if (value == "epoll") {
+    return EventBackend::Epoll;
+  }
+  if (value == "io_uring" || value == "uring") {
+    return EventBackend::IoUring;
+  }
+  return EventBackend::Auto;
+}
+
+// ---------------------------------------------------------------------------
+// epoll backend.
+
+class EpollLoop : public EventLoop {
+public:
+  EpollLoop() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+      perror("epoll_create1");
+      exit(1);
+    }
+  }
+
+  ~EpollLoop() override { close(epoll_fd); }
+
+  const char *Name() const override { return "epoll"; }
+
+  void AddListener(int listen_fd) override {
+    // When several loops (or processes) wait on the same listener, wake
+    // only one of them per connection (Linux 4.5).
+    event.data.fd = listen_fd;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+      cppserver::epoll_ctl_add(epoll_fd, listen_fd, &event, EPOLLIN);
+    }
+    listeners.push_back(listen_fd);
+  }
+
+  void RemoveListener(int listen_fd) override {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, NULL);
+    listeners.erase(std::remove(listeners.begin(), listeners.end(), listen_fd),
+                    listeners.end());
+  }
+
+  void AddWake(int fd) override {
+    cppserver::epoll_ctl_add(epoll_fd, fd, &event, EPOLLIN);
+    wakes.push_back(fd);
+  }
+
+  void ArmClient(int fd) override { Arm(fd, EPOLLIN); }
+
+  void ArmWritable(int fd) override { Arm(fd, EPOLLOUT); }
+
+  int Wait(std::vector<LoopEvent> &ready, int timeout_ms) override {
+    int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+    if (nfds == -1) {
+      return -1;
+    }
+
+    size_t before = ready.size();
+    for (int i = 0; i < nfds; i++) {
+      int fd = events[i].data.fd;
+      if (contains(listeners, fd)) {
+        AcceptBatch(fd, ready);
+      } else if (contains(wakes, fd)) {
+        ready.push_back({LoopEvent::Wake, fd, 0, std::string(), -1});
+      } else if (events[i].events & EPOLLOUT) {
+        ready.push_back({LoopEvent::Writable, fd, 0, std::string(), -1});
+      } else {
+        ready.push_back({LoopEvent::Readable, fd, 0, std::string(), -1});
+      }
+    }
+    return static_cast<int>(ready.size() - before);
+  }
+
+private:
+  // Accept the connections waiting on listen_fd, up to ACCEPT_BATCH. The
+  // listener is level-triggered: what is left is reported again.
+  static void AcceptBatch(int listen_fd, std::vector<LoopEvent> &ready) {
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+      int client_fd =
+          accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (client_fd != -1) {
+        ready.push_back(
+            {LoopEvent::Accept, client_fd, 0, std::string(), listen_fd});
+        continue;
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue; // The client gave up before we accepted it.
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        ready.push_back(
+            {LoopEvent::Accept, -1, errno, std::string(), listen_fd});
+      }
+      return;
+    }
+  }
+
+  void Arm(int fd, uint32_t interest) {
+    event.data.fd = fd;
+    event.events = interest | EPOLLET | EPOLLONESHOT;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1 &&
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      perror("epoll_ctl");
+    }
+  }
+
+  static bool contains(const std::vector<int> &fds, int fd) {
+    for (int candidate : fds) {
+      if (candidate == fd) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  int epoll_fd;
+  std::vector<int> listeners;
+  std::vector<int> wakes;
+  struct epoll_event event, events[MAX_EVENTS];
+};
+
+// ---------------------------------------------------------------------------
+// io_uring backend, using the raw system calls.
+//
+// - Listeners are registered files with one multishot accept each, so a
+//   burst of connections costs no accept(2) calls.
+// - Clients are armed with a recv that picks a buffer from a provided
+//   buffer ring; the request bytes arrive with the completion.
+// - Everything queued while handling completions is submitted together
+//   with the next wait, in a single io_uring_enter(2).
+
+static int uringSetup(unsigned entries, struct io_uring_params *params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int uringEnter(int fd, unsigned to_submit, unsigned min_complete,
+                      unsigned flags, void *arg, size_t argsz) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                  min_complete, flags, arg, argsz));
+}
+
+static int uringRegister(int fd, unsigned opcode, void *arg,
+                         unsigned nr_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+class IoUringLoop : public EventLoop {
+public:
+  // Returns nullptr if the kernel does not support what the loop needs.
+  static std::unique_ptr<EventLoop> Create() {
+    std::unique_ptr<IoUringLoop> loop(new IoUringLoop());
+    if (!loop->Setup()) {
+      return nullptr;
+    }
+    return loop;
+  }
+
+  ~IoUringLoop() override {
+    if (buffers) {
+      munmap(buffers, URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+    }
+    if (buf_ring) {
+      munmap(buf_ring, buf_ring_size);
+    }
+    if (sqes) {
+      munmap(sqes, sqes_size);
+    }
+    if (cq_ptr && cq_ptr != sq_ptr) {
+      munmap(cq_ptr, cq_size);
+    }
+    if (sq_ptr) {
+      munmap(sq_ptr, sq_size);
+    }
+    if (ring_fd != -1) {
+      close(ring_fd);
+    }
+  }
+
+  const char *Name() const override { return "io_uring"; }
+
+  void AddListener(int listen_fd) override {
+    int slot = RegisterFile(listen_fd);
+    if (slot != -1) {
+      fixed_slots[listen_fd] = slot;
+    }
+    PrepAccept(listen_fd);
+  }
+
+  void RemoveListener(int listen_fd) override {
+    removed.push_back(listen_fd);
+    struct io_uring_sqe *sqe = GetSqe(IORING_OP_ASYNC_CANCEL, -1, OpCancel);
+    sqe->addr = (static_cast<uint64_t>(OpAccept) << 32) |
+                static_cast<uint32_t>(listen_fd);
+
+    // The accept being cancelled holds its own reference to the file.
+    auto slot = fixed_slots.find(listen_fd);
+    if (slot != fixed_slots.end()) {
+      UpdateFile(slot->second, -1);
+      fixed_slots.erase(slot);
+    }
+  }
+
+  void AddWake(int fd) override { PrepPoll(fd, OpWake); }
+
+  void ArmClient(int fd) override {
+    if (!buf_ring) {
+      PrepPoll(fd, OpClientPoll);
+      return;
+    }
+
+    struct io_uring_sqe *sqe = GetSqe(IORING_OP_RECV, fd, OpRecv);
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+  }
+
+  void ArmWritable(int fd) override { PrepPoll(fd, OpClientWritable, POLLOUT); }
+
+  int Wait(std::vector<LoopEvent> &ready, int timeout_ms) override {
+    size_t before = ready.size();
+    Reap(ready);
+
+    unsigned wait_nr = ready.size() > before || timeout_ms == 0 ? 0 : 1;
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    void *arg = NULL;
+    size_t argsz = 0;
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg getevents;
+    if (wait_nr > 0 && timeout_ms > 0) {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+      memset(&getevents, 0, sizeof(getevents));
+      getevents.ts = reinterpret_cast<uint64_t>(&ts);
+      flags |= IORING_ENTER_EXT_ARG;
+      arg = &getevents;
+      argsz = sizeof(getevents);
+    }
+
+    int ret = uringEnter(ring_fd, Pending(), wait_nr, flags, arg, argsz);
+    if (ret == -1 && errno != ETIME && errno != EBUSY) {
+      if (ready.size() > before) {
+        return static_cast<int>(ready.size() - before);
+      }
+      return -1;
+    }
+
+    Reap(ready);
+    return static_cast<int>(ready.size() - before);
+  }
+
+private:
+  // Operation kinds, kept in the upper half of user_data; the fd is in the
+  // lower half.
+  enum Op : uint64_t {
+    OpAccept = 1,
+    OpRecv,
+    OpClientPoll,
+    OpWake,
+    OpClientWritable,
+    OpCancel,
+  };
+
+  IoUringLoop() = default;
+
+  bool Setup() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    ring_fd = uringSetup(URING_ENTRIES, &params);
+    if (ring_fd == -1 && errno == EINVAL) {
+      memset(&params, 0, sizeof(params));
+      ring_fd = uringSetup(URING_ENTRIES, &params);
+    }
+    if (ring_fd == -1) {
+      return false;
+    }
+
+    // Fast poll (5.7) makes recv on an idle socket wait without a worker
+    // thread, and the extended argument (5.11) lets Wait time out, which
+    // the drain deadline relies on; older kernels are better served by
+    // epoll.
+    if (!(params.features & IORING_FEAT_FAST_POLL) ||
+        !(params.features & IORING_FEAT_NODROP) ||
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+      errno = ENOSYS;
+      return false;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes +
+              params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+
+    sq_ptr = Map(sq_size, IORING_OFF_SQ_RING);
+    if (!sq_ptr) {
+      return false;
+    }
+    cq_ptr = single_mmap ? sq_ptr : Map(cq_size, IORING_OFF_CQ_RING);
+    if (!cq_ptr) {
+      return false;
+    }
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = static_cast<struct io_uring_sqe *>(Map(sqes_size, IORING_OFF_SQES));
+    if (!sqes) {
+      return false;
+    }
+
+    char *sq = static_cast<char *>(sq_ptr);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+    char *cq = static_cast<char *>(cq_ptr);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    // Both are optional: without them clients are polled and listeners
+    // are used by plain fd.
+    SetupBufferRing();
+    SetupFixedFiles();
+    return true;
+  }
+
+  void *Map(size_t size, off_t offset) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+  }
+
+  // Register a ring of provided buffers (group 0) for client recvs (5.19).
+  void SetupBufferRing() {
+    buf_ring_size = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+    void *ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *data = mmap(NULL, URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                      0);
+    if (ring == MAP_FAILED || data == MAP_FAILED) {
+      if (ring != MAP_FAILED) {
+        munmap(ring, buf_ring_size);
+      }
+      if (data != MAP_FAILED) {
+        munmap(data, URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+      }
+      return;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = 0;
+    if (uringRegister(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+      munmap(ring, buf_ring_size);
+      munmap(data, URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+      return;
+    }
+
+    buf_ring = static_cast<struct io_uring_buf_ring *>(ring);
+    buffers = static_cast<char *>(data);
+    buf_tail = 0;
+    for (unsigned short bid = 0; bid < URING_RECV_BUFFERS; bid++) {
+      RecycleBuffer(bid);
+    }
+  }
+
+  // True if RemoveListener was called for listen_fd.
+  bool Removed(int listen_fd) const {
+    return std::find(removed.begin(), removed.end(), listen_fd) !=
+           removed.end();
+  }
+
+  // Hand buffer bid back to the kernel.
+  void RecycleBuffer(unsigned short bid) {
+    // Not buf_ring->bufs: in C++ the header's flexible array wrapper puts
+    // it at offset 8 instead of 0.
+    struct io_uring_buf *ring =
+        reinterpret_cast<struct io_uring_buf *>(buf_ring);
+    struct io_uring_buf *buf = &ring[buf_tail & (URING_RECV_BUFFERS - 1)];
+    buf->addr =
+        reinterpret_cast<uint64_t>(buffers + bid * URING_RECV_BUFFER_SIZE);
+    buf->len = URING_RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+  }
+
+  // Register an empty file table for the listeners (5.19).
+  void SetupFixedFiles() {
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = URING_FIXED_FILES;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    fixed_files = uringRegister(ring_fd, IORING_REGISTER_FILES2, &reg,
+                                sizeof(reg)) != -1;
+  }
+
+  // Put fd in the first free slot of the registered file table. Returns
+  // the slot or -1.
+  int RegisterFile(int fd) {
+    if (!fixed_files) {
+      return -1;
+    }
+
+    bool used[URING_FIXED_FILES] = {};
+    for (const auto &entry : fixed_slots) {
+      used[entry.second] = true;
+    }
+    int slot = 0;
+    while (slot < URING_FIXED_FILES && used[slot]) {
+      slot++;
+    }
+    if (slot == URING_FIXED_FILES || !UpdateFile(slot, fd)) {
+      return -1;
+    }
+    return slot;
+  }
+
+  // Set slot of the registered file table to fd, or empty it if fd is -1.
+  bool UpdateFile(int slot, int fd) {
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = reinterpret_cast<uint64_t>(&fd);
+    return uringRegister(ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) ==
+           1;
+  }
+
+  // Number of queued submissions the kernel has not consumed yet.
+  unsigned Pending() const {
+    return *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  }
+
+  // Returns a zeroed SQE for op on fd, submitting queued ones if full.
+  struct io_uring_sqe *GetSqe(uint8_t opcode, int fd, Op op) {
+    while (Pending() >= sq_entries) {
+      if (uringEnter(ring_fd, Pending(), 0, 0, NULL, 0) == -1 &&
+          errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+        perror("io_uring_enter");
+        exit(1);
+      }
+    }
+
+    unsigned tail = *sq_tail;
+    unsigned index = tail & sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (static_cast<uint64_t>(op) << 32) |
+                     static_cast<uint32_t>(fd);
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+  }
+
+  void PrepAccept(int listen_fd) {
+    auto slot = fixed_slots.find(listen_fd);
+    struct io_uring_sqe *sqe = GetSqe(IORING_OP_ACCEPT, listen_fd, OpAccept);
+    if (slot != fixed_slots.end()) {
+      sqe->fd = slot->second;
+      sqe->flags = IOSQE_FIXED_FILE;
+    }
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (multishot_accept) {
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+  }
+
+  void PrepPoll(int fd, Op op, uint32_t events = POLLIN) {
+    struct io_uring_sqe *sqe = GetSqe(IORING_OP_POLL_ADD, fd, op);
+    sqe->poll32_events = events;
+  }
+
+  // Turn completed CQEs into events.
+  void Reap(std::vector<LoopEvent> &ready) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+      const struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+      Op op = static_cast<Op>(cqe->user_data >> 32);
+      int fd = static_cast<int>(cqe->user_data & 0xffffffff);
+      bool more = cqe->flags & IORING_CQE_F_MORE;
+
+      switch (op) {
+      case OpAccept:
+        if (cqe->res == -EINVAL && multishot_accept) {
+          // Kernel without multishot accept (< 5.19).
+          multishot_accept = false;
+        } else if (cqe->res >= 0) {
+          ready.push_back(
+              {LoopEvent::Accept, cqe->res, 0, std::string(), fd});
+        } else if (cqe->res != -ECONNABORTED && cqe->res != -EINTR &&
+                   cqe->res != -ECANCELED) {
+          ready.push_back(
+              {LoopEvent::Accept, -1, -cqe->res, std::string(), fd});
+        }
+        if (!more && !Removed(fd)) {
+          PrepAccept(fd);
+        }
+        break;
+
+      case OpRecv: {
+        LoopEvent event{LoopEvent::Readable, fd, 0, std::string(), -1};
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+          unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+          if (cqe->res > 0) {
+            event.data.assign(buffers + bid * URING_RECV_BUFFER_SIZE,
+                              static_cast<size_t>(cqe->res));
+          }
+          RecycleBuffer(bid);
+        }
+        // On errors, EOF or ENOBUFS the reader finds out from the socket.
+        ready.push_back(std::move(event));
+        break;
+      }
+
+      case OpClientPoll:
+        ready.push_back({LoopEvent::Readable, fd, 0, std::string(), -1});
+        break;
+
+      case OpWake:
+        ready.push_back({LoopEvent::Wake, fd, 0, std::string(), -1});
+        PrepPoll(fd, OpWake);
+        break;
+
+      case OpClientWritable:
+        ready.push_back({LoopEvent::Writable, fd, 0, std::string(), -1});
+        break;
+
+      case OpCancel:
+        break;
+      }
+    }
+
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  int ring_fd = -1;
+  bool multishot_accept = true;
+
+  void *sq_ptr = nullptr;
+  size_t sq_size = 0;
+  unsigned *sq_head = nullptr;
+  unsigned *sq_tail = nullptr;
+  unsigned *sq_array = nullptr;
+  unsigned sq_mask = 0;
+  unsigned sq_entries = 0;
+  struct io_uring_sqe *sqes = nullptr;
+  size_t sqes_size = 0;
+
+  void *cq_ptr = nullptr;
+  size_t cq_size = 0;
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  struct io_uring_cqe *cqes = nullptr;
+
+  struct io_uring_buf_ring *buf_ring = nullptr;
+  size_t buf_ring_size = 0;
+  char *buffers = nullptr;
+  unsigned short buf_tail = 0;
+
+  bool fixed_files = false;
+  std::unordered_map<int, int> fixed_slots; // Listener fd -> file slot.
+  std::vector<int> removed; // Listeners whose accept is cancelled.
+};
+
+std::unique_ptr<EventLoop> makeEventLoop(EventBackend backend) {
+  if (backend == EventBackend::Auto) {
+    const char *name = getenv("CPPSERVER_EVENT_BACKEND");
+    backend = name ? eventBackendFromString(name) : EventBackend::Auto;
+  }
+
+  if (backend != EventBackend::Epoll) {
+    std::unique_ptr<EventLoop> loop = IoUringLoop::Create();
+    if (loop) {
+      return loop;
+    }
+    if (backend == EventBackend::IoUring) {
+      fprintf(stderr, "io_uring unavailable (%s), using epoll\n",
+              strerror(errno));
+    }
+  }
+  return std::make_unique<EpollLoop>();
+}
@@ -0,0 +1,74 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Event loop implementations.
+enum class EventBackend {
+  Auto,    // $CPPSERVER_EVENT_BACKEND if set, else io_uring if supported.
+  Epoll,   // epoll(7).
+  IoUring, // io_uring(7), falls back to epoll if the kernel lacks it.
+};
+
+// Returns the backend named by value: "epoll", "io_uring" or "auto".
+// Unknown names select Auto.
+EventBackend eventBackendFromString(const std::string &value);
+
+// Something that happened on the loop.
+struct LoopEvent {
+  enum Type {
+    Accept,   // New connection on a listener (fd is -1 if accept failed).
+    Readable, // A client armed with ArmClient has input.
+    Writable, // A client armed with ArmWritable can be written to.
+    Wake,     // A wake fd added with AddWake is readable.
+  };
+
+  Type type;
+  int fd;           // Client fd, wake fd, or -1.
+  int error;        // errno of a failed accept.
+  std::string data; // Bytes the loop already received from the client.
+  int listener;     // Listening socket of an Accept, or -1.
+};
+
+// Readiness and accept notifications for the server.
+// All methods are called from the event loop thread.
+class EventLoop {
+public:
+  virtual ~EventLoop() = default;
+
+  // Backend name for logs, e.g "epoll".
+  virtual const char *Name() const = 0;
+
+  // Accept connections on the non-blocking listening socket listen_fd, in
+  // batches. Accepted sockets are non-blocking and close-on-exec. Failed
+  // accepts are reported (e.g. EMFILE) and retried on the next wakeup.
+  virtual void AddListener(int listen_fd) = 0;
+
+  // Stop accepting on listen_fd. Connections the backend accepted already
+  // are still reported. The caller closes the socket.
+  virtual void RemoveListener(int listen_fd) = 0;
+
+  // Report fd (e.g. an eventfd) as Wake whenever it becomes readable.
+  // The caller must consume the readiness (read the eventfd).
+  virtual void AddWake(int fd) = 0;
+
+  // Report the next input on client fd once. The backend may read some of
+  // it into LoopEvent::data; the rest is left in the socket. Call again to
+  // wait for more input.
+  virtual void ArmClient(int fd) = 0;
+
+  // Report once that client fd can be written to (or has failed). A socket
+  // waits for either input or writability at a time, not both.
+  virtual void ArmWritable(int fd) = 0;
+
+  // Wait up to timeout_ms (-1 waits forever) and append what happened to
+  // events. Returns the number of events, or -1 with errno set.
+  virtual int Wait(std::vector<LoopEvent> &events, int timeout_ms) = 0;
+};
+
+// Create an event loop. Exits if no backend can be set up.
+std::unique_ptr<EventLoop> makeEventLoop(EventBackend backend);
+
+#endif /* EVENTLOOP_H */
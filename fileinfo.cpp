@@ -0,0 +1,234 @@
+#include "fileinfo.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+}
+
+// Upper bound on cached entries. The cache is cleared when it fills up.
+#define FILEINFO_CACHE_MAX 4096
+
+static std::atomic<ETagMode> defaultETagMode{ETagMode::Strong};
+
+struct CacheKey {
+  std::string path;
+  ETagMode mode;
+
+  bool operator==(const CacheKey &other) const {
+    return mode == other.mode && path == other.path;
+  }
+};
+
+struct CacheKeyHash {
+  size_t operator()(const CacheKey &key) const {
+    return std::hash<std::string>()(key.path) ^ static_cast<size_t>(key.mode);
+  }
+};
+
+static std::mutex cache_mutex;
+static std::unordered_map<CacheKey, std::shared_ptr<const FileInfo>,
+                          CacheKeyHash>
+    cache;
+
+void setDefaultETagMode(ETagMode mode) { defaultETagMode = mode; }
+ETagMode getDefaultETagMode() { return defaultETagMode; }
+
+// 64-bit FNV-1a over the contents of fd. Returns false on read errors.
+static bool hashFileContents(int fd, uint64_t &hash) {
+  hash = 14695981039346656037ull;
+  char buffer[64 * 1024];
+  off64_t offset = 0;
+  ssize_t n;
+  while ((n = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+    for (ssize_t i = 0; i < n; i++) {
+      hash ^= static_cast<unsigned char>(buffer[i]);
+      hash *= 1099511628211ull;
+    }
+    offset += n;
+  }
+  return n == 0;
+}
+
+static bool hashFileContents(const std::string &path, int fd, uint64_t &hash) {
+  if (fd != -1) {
+    return hashFileContents(fd, hash);
+  }
+
+  fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  bool ok = hashFileContents(fd, hash);
+  close(fd);
+  return ok;
+}
+
+static bool sameVersion(const FileInfo &info, const struct stat &st) {
+  return info.inode == st.st_ino && info.device == st.st_dev &&
+         info.size == st.st_size && info.mtime == st.st_mtim.tv_sec &&
+         info.mtime_nsec == st.st_mtim.tv_nsec;
+}
+
+static std::shared_ptr<const FileInfo> makeFileInfo(const std::string &path,
+                                                    int fd,
+                                                    const struct stat &st,
+                                                    ETagMode mode) {
+  auto info = std::make_shared<FileInfo>();
+  info->path = path;
+  info->size = st.st_size;
+  info->mtime = st.st_mtim.tv_sec;
+  info->mtime_nsec = st.st_mtim.tv_nsec;
+  info->inode = st.st_ino;
+  info->device = st.st_dev;
+  info->is_directory = S_ISDIR(st.st_mode);
+  info->last_modified = formatHttpDate(info->mtime);
+
+  if (info->is_directory) {
+    return info;
+  }
+
+  char etag[64];
+  uint64_t hash;
+  if (mode == ETagMode::ContentHash && hashFileContents(path, fd, hash)) {
+    snprintf(etag, sizeof(etag), "\"%016llx\"",
+             static_cast<unsigned long long>(hash));
+  } else {
+    unsigned long long mtime_ns =
+        static_cast<unsigned long long>(info->mtime) * 1000000000ull +
+        static_cast<unsigned long long>(info->mtime_nsec);
+    snprintf(etag, sizeof(etag), "%s\"%llx-%llx-%llx\"",
+             mode == ETagMode::Weak ? "W/" : "",
+             static_cast<unsigned long long>(info->inode),
+             static_cast<unsigned long long>(info->size), mtime_ns);
+  }
+  info->etag = etag;
+  return info;
+}
+
+std::shared_ptr<const FileInfo> lookupFileInfo(const std::string &path) {
+  return lookupFileInfo(path, defaultETagMode);
+}
+
+// Returns the cached entry for path if it still matches st, otherwise
+// builds and caches a new one.
+static std::shared_ptr<const FileInfo> cachedFileInfo(const std::string &path,
+                                                      int fd,
+                                                      const struct stat &st,
+                                                      ETagMode mode) {
+  CacheKey key{path, mode};
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = cache.find(key);
+    if (it != cache.end() && sameVersion(*it->second, st)) {
+      return it->second;
+    }
+  }
+
+  // Build outside the lock: content hashing may read the whole file.
+  std::shared_ptr<const FileInfo> info = makeFileInfo(path, fd, st, mode);
+
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  if (cache.size() >= FILEINFO_CACHE_MAX) {
+    cache.clear();
+  }
+  cache[key] = info;
+  return info;
+}
+
+std::shared_ptr<const FileInfo> lookupFileInfo(const std::string &path,
+                                               ETagMode mode) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == -1) {
+    return nullptr;
+  }
+  return cachedFileInfo(path, -1, st, mode);
+}
+
+std::shared_ptr<const FileInfo> lookupFileInfo(int fd, const std::string &path) {
+  return lookupFileInfo(fd, path, defaultETagMode);
+}
+
+std::shared_ptr<const FileInfo> lookupFileInfo(int fd, const std::string &path,
+                                               ETagMode mode) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    return nullptr;
+  }
+  return cachedFileInfo(path, fd, st, mode);
+}
+
+std::string formatHttpDate(time_t t) {
+  struct tm tm;
+  char buf[64];
+  gmtime_r(&t, &tm);
+  size_t n = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return std::string(buf, n);
+}
+
+time_t parseHttpDate(std::string_view value) {
+  char buf[64];
+  if (value.size() >= sizeof(buf)) {
+    return -1;
+  }
+  memcpy(buf, value.data(), value.size());
+  buf[value.size()] = '\0';
+
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0') {
+    return -1;
+  }
+  return timegm(&tm);
+}
+
+// Strip the weak indicator from an entity tag.
+static std::string_view opaqueTag(std::string_view tag) {
+  if (tag.size() >= 2 && tag[0] == 'W' && tag[1] == '/') {
+    tag.remove_prefix(2);
+  }
+  return tag;
+}
+
+bool etagListMatches(std::string_view header, std::string_view etag) {
+  std::string_view target = opaqueTag(etag);
+
+  size_t pos = 0;
+  while (pos < header.size()) {
+    size_t comma = header.find(',', pos);
+    if (comma == std::string_view::npos) {
+      comma = header.size();
+    }
+
+    std::string_view tag = header.substr(pos, comma - pos);
+    while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) {
+      tag.remove_prefix(1);
+    }
+    while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) {
+      tag.remove_suffix(1);
+    }
+
+    if (tag == "*" || opaqueTag(tag) == target) {
+      return true;
+    }
+    pos = comma + 1;
+  }
+  return false;
+}
+
+bool etagStrongMatches(std::string_view a, std::string_view b) {
+  if (a.size() >= 2 && a[0] == 'W' && a[1] == '/') {
+    return false;
+  }
+  if (b.size() >= 2 && b[0] == 'W' && b[1] == '/') {
+    return false;
+  }
+  return a == b;
+}
@@ -0,0 +1,70 @@
+#ifndef FILEINFO_H
+#define FILEINFO_H
+
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+
+extern "C" {
+#include <sys/stat.h>
+#include <sys/types.h>
+}
+
+// How ETags are generated for files.
+enum class ETagMode {
+  Weak,        // W/"inode-size-mtime"
+  Strong,      // "inode-size-mtime"
+  ContentHash, // "hash of file contents", computed once per file version.
+};
+
+// Cached metadata and validators for a file on disk.
+struct FileInfo {
+  std::string path;          // Path passed to lookupFileInfo.
+  off64_t size;              // File size in bytes.
+  time_t mtime;              // Last modification time (seconds).
+  long mtime_nsec;           // Nanosecond part of mtime.
+  ino_t inode;               // Inode number.
+  dev_t device;              // Device id.
+  bool is_directory;         // True for directories.
+  std::string etag;          // Quoted ETag, including W/ prefix if weak.
+  std::string last_modified; // IMF-fixdate of mtime.
+};
+
+// Set the ETag mode used by lookupFileInfo when none is given.
+void setDefaultETagMode(ETagMode mode);
+ETagMode getDefaultETagMode();
+
+// Returns metadata for path, or nullptr if it cannot be stat'ed.
+// Only stat(2) is called when the cached entry is still valid (same inode,
+// size and mtime). The file is read only for ETagMode::ContentHash, once per
+// file version.
+std::shared_ptr<const FileInfo> lookupFileInfo(const std::string &path);
+std::shared_ptr<const FileInfo> lookupFileInfo(const std::string &path,
+                                               ETagMode mode);
+
+// Same as above for an already open file; fstat(2) is used instead of
+// stat(2). path is only used as the cache key and must identify the file.
+std::shared_ptr<const FileInfo> lookupFileInfo(int fd, const std::string &path);
+std::shared_ptr<const FileInfo> lookupFileInfo(int fd, const std::string &path,
+                                               ETagMode mode);
+
+// Format t as an IMF-fixdate (e.g. "Sun, 06 Nov 1994 08:49:37 GMT").
+std::string formatHttpDate(time_t t);
+
+// Parse an IMF-fixdate. Returns -1 if value is not a valid date.
+time_t parseHttpDate(std::string_view value);
+
+// Returns true if the If-None-Match header value matches etag using the
+// weak comparison function (RFC 7232 section 2.3.2).
+bool etagListMatches(std::string_view header, std::string_view etag);
+
+// Strong comparison of two entity tags. Weak tags never match.
+bool etagStrongMatches(std::string_view a, std::string_view b);
+
+#endif /* FILEINFO_H */
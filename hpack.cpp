@@ -0,0 +1,488 @@
+#include "hpack.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+
+struct StaticEntry {
+  std::string_view name;
+  std::string_view value;
+};
+
+// RFC 7541 Appendix A.
+static constexpr StaticEntry staticTable[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static constexpr size_t STATIC_TABLE_SIZE =
+    sizeof(staticTable) / sizeof(staticTable[0]);
+
+static_assert(STATIC_TABLE_SIZE == 61, "HPACK static table has 61 entries");
+
+// Per-entry overhead counted towards the table size (RFC 7541 4.1).
+#define HPACK_ENTRY_OVERHEAD 32
+
+// Returns the first static index with the given name, or 0.
+static size_t staticNameIndex(std::string_view name) {
+  static const std::unordered_map<std::string_view, size_t> names = [] {
+    std::unordered_map<std::string_view, size_t> map;
+    for (size_t i = STATIC_TABLE_SIZE; i > 0; i--) {
+      map[staticTable[i - 1].name] = i;
+    }
+    return map;
+  }();
+
+  auto it = names.find(name);
+  return it == names.end() ? 0 : it->second;
+}
+
+HpackTable::HpackTable(size_t max_size) : size(0), max_size(max_size) {}
+
+bool HpackTable::Get(size_t index, std::string_view &name,
+                     std::string_view &value) const {
+  if (index == 0) {
+    return false;
+  }
+  if (index <= STATIC_TABLE_SIZE) {
+    name = staticTable[index - 1].name;
+    value = staticTable[index - 1].value;
+    return true;
+  }
+
+  index -= STATIC_TABLE_SIZE + 1;
+  if (index >= entries.size()) {
+    return false;
+  }
+  name = entries[index].name;
+  value = entries[index].value;
+  return true;
+}
+
+void HpackTable::Add(std::string_view name, std::string_view value) {
+  size_t entry_size = name.size() + value.size() + HPACK_ENTRY_OVERHEAD;
+  if (entry_size > max_size) {
+    // An entry larger than the table empties it (RFC 7541 4.4).
+    Evict(0);
+    return;
+  }
+
+  Evict(max_size - entry_size);
+  entries.push_front(HeaderField{std::string(name), std::string(value)});
+  size += entry_size;
+}
+
+void HpackTable::SetMaxSize(size_t new_size) {
+  max_size = new_size;
+  Evict(max_size);
+}
+
+void HpackTable::Evict(size_t limit) {
+  while (size > limit && !entries.empty()) {
+    const HeaderField &oldest = entries.back();
+    size -= oldest.name.size() + oldest.value.size() + HPACK_ENTRY_OVERHEAD;
+    entries.pop_back();
+  }
+}
+
+size_t HpackTable::Find(std::string_view name, std::string_view value,
+                        size_t &name_index) const {
+  // Static table fast path: :status codes and names are direct lookups.
+  name_index = staticNameIndex(name);
+  if (name_index) {
+    for (size_t i = name_index;
+         i <= STATIC_TABLE_SIZE && staticTable[i - 1].name == name; i++) {
+      if (staticTable[i - 1].value == value) {
+        return i;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (entries[i].name == name) {
+      if (entries[i].value == value) {
+        return STATIC_TABLE_SIZE + 1 + i;
+      }
+      if (!name_index) {
+        name_index = STATIC_TABLE_SIZE + 1 + i;
+      }
+    }
+  }
+  return 0;
+}
+
+// Integer representation (RFC 7541 5.1).
+
+static void encodeInteger(std::string &out, uint8_t flags, int prefix_bits,
+                          uint64_t value) {
+  uint64_t max_prefix = (1u << prefix_bits) - 1;
+  if (value < max_prefix) {
+    out.push_back(static_cast<char>(flags | value));
+    return;
+  }
+
+  out.push_back(static_cast<char>(flags | max_prefix));
+  value -= max_prefix;
+  while (value >= 128) {
+    out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+static bool decodeInteger(std::string_view in, size_t &pos, int prefix_bits,
+                          uint64_t &value) {
+  if (pos >= in.size()) {
+    return false;
+  }
+
+  uint64_t max_prefix = (1u << prefix_bits) - 1;
+  value = static_cast<uint8_t>(in[pos++]) & max_prefix;
+  if (value < max_prefix) {
+    return true;
+  }
+
+  for (int shift = 0; shift <= 56; shift += 7) {
+    if (pos >= in.size()) {
+      return false;
+    }
+    uint8_t byte = static_cast<uint8_t>(in[pos++]);
+    value += static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false; // Too long.
+}
+
+// String literals are sent without Huffman coding.
+static void encodeString(std::string &out, std::string_view s) {
+  encodeInteger(out, 0, 7, s.size());
+  out.append(s);
+}
+
+static bool decodeString(std::string_view in, size_t &pos, std::string &out) {
+  if (pos >= in.size()) {
+    return false;
+  }
+
+  bool huffman = static_cast<uint8_t>(in[pos]) & 0x80;
+  uint64_t length;
+  if (!decodeInteger(in, pos, 7, length) || length > in.size() - pos) {
+    return false;
+  }
+
+  std::string_view data = in.substr(pos, length);
+  pos += length;
+  out.clear();
+  if (huffman) {
+    return huffmanDecode(data, out);
+  }
+  out.assign(data);
+  return true;
+}
+
+// Huffman code (RFC 7541 Appendix B): {code, length in bits} by symbol.
+// Symbol 256 is EOS.
+struct HuffmanCode {
+  uint32_t code;
+  uint8_t bits;
+};
+
+static const HuffmanCode huffmanCodes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6},
+    {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5},
+    {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6},
+    {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7},
+    {0x61, 7}, {0x62, 7}, {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7},
+    {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7}, {0xfd, 8},
+    {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6},
+    {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6},
+    {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5},
+    {0x2d, 6}, {0x77, 7}, {0x78, 7}, {0x79, 7}, {0x7a, 7}, {0x7b, 7},
+    {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22},
+    {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22},
+    {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23},
+    {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24},
+    {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24},
+    {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23},
+    {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22},
+    {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22},
+    {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22},
+    {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21}, {0x7fffea, 23},
+    {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21},
+    {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21},
+    {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23},
+    {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20},
+    {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23},
+    {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23}, {0x3ffffe0, 26},
+    {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22},
+    {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26},
+    {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27},
+    {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19},
+    {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27},
+    {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24}, {0x1fffe4, 21},
+    {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28},
+    {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20},
+    {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22},
+    {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22},
+    {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24},
+    {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23}, {0x3ffffeb, 26},
+    {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27},
+    {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27},
+    {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27},
+    {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30}
+,
+};
+
+// Binary decoding tree built from huffmanCodes. Leaves hold symbol + 1
+// in sym; inner nodes have sym == 0.
+struct HuffmanNode {
+  int16_t child[2];
+  int16_t sym;
+};
+
+static const std::vector<HuffmanNode> &huffmanTree() {
+  static const std::vector<HuffmanNode> tree = [] {
+    std::vector<HuffmanNode> nodes(1, HuffmanNode{{-1, -1}, 0});
+    for (int sym = 0; sym < 257; sym++) {
+      size_t node = 0;
+      for (int bit = huffmanCodes[sym].bits - 1; bit >= 0; bit--) {
+        int b = (huffmanCodes[sym].code >> bit) & 1;
+        if (nodes[node].child[b] == -1) {
+          nodes[node].child[b] = static_cast<int16_t>(nodes.size());
+          nodes.push_back(HuffmanNode{{-1, -1}, 0});
+        }
+        node = nodes[node].child[b];
+      }
+      nodes[node].sym = static_cast<int16_t>(sym + 1);
+    }
+    return nodes;
+  }();
+  return tree;
+}
+
+bool huffmanDecode(std::string_view in, std::string &out) {
+  const std::vector<HuffmanNode> &tree = huffmanTree();
+  size_t node = 0;
+  int pending_bits = 0;  // Bits read since the last symbol.
+  bool all_ones = true;  // Those bits are all 1 (valid padding so far).
+
+  for (unsigned char byte : in) {
+    for (int bit = 7; bit >= 0; bit--) {
+      int b = (byte >> bit) & 1;
+      int16_t next = tree[node].child[b];
+      if (next == -1) {
+        return false;
+      }
+      node = next;
+      pending_bits++;
+      all_ones = all_ones && b;
+
+      if (tree[node].sym) {
+        if (tree[node].sym == 257) {
+          return false; // EOS in the string.
+        }
+        out.push_back(static_cast<char>(tree[node].sym - 1));
+        node = 0;
+        pending_bits = 0;
+        all_ones = true;
+      }
+    }
+  }
+
+  // Padding is at most 7 bits of the EOS prefix (all ones).
+  return pending_bits < 8 && all_ones;
+}
+
+HpackDecoder::HpackDecoder(size_t max_table_size)
+    : table(max_table_size), max_table_size(max_table_size) {}
+
+bool HpackDecoder::Decode(std::string_view block,
+                          std::vector<HeaderField> &headers) {
+  size_t pos = 0;
+  bool fields_seen = false;
+
+  while (pos < block.size()) {
+    uint8_t first = static_cast<uint8_t>(block[pos]);
+    uint64_t index;
+
+    if (first & 0x80) {
+      // Indexed header field.
+      std::string_view name, value;
+      if (!decodeInteger(block, pos, 7, index) ||
+          !table.Get(index, name, value)) {
+        return false;
+      }
+      headers.push_back(HeaderField{std::string(name), std::string(value)});
+      fields_seen = true;
+      continue;
+    }
+
+    if ((first & 0xe0) == 0x20) {
+      // Dynamic table size update, only allowed before the first field.
+      uint64_t new_size;
+      if (fields_seen || !decodeInteger(block, pos, 5, new_size) ||
+          new_size > max_table_size) {
+        return false;
+      }
+      table.SetMaxSize(new_size);
+      continue;
+    }
+
+    // Literal: with incremental indexing (01), without indexing (0000) or
+    // never indexed (0001).
+    bool indexing = (first & 0xc0) == 0x40;
+    int prefix_bits = indexing ? 6 : 4;
+    if (!decodeInteger(block, pos, prefix_bits, index)) {
+      return false;
+    }
+
+    HeaderField field;
+    if (index) {
+      std::string_view name, value;
+      if (!table.Get(index, name, value)) {
+        return false;
+      }
+      field.name.assign(name);
+    } else if (!decodeString(block, pos, field.name)) {
+      return false;
+    }
+    if (!decodeString(block, pos, field.value)) {
+      return false;
+    }
+
+    if (indexing) {
+      table.Add(field.name, field.value);
+    }
+    headers.push_back(std::move(field));
+    fields_seen = true;
+  }
+  return true;
+}
+
+HpackEncoder::HpackEncoder() : table(HPACK_TABLE_SIZE), size_update(false) {}
+
+void HpackEncoder::SetMaxTableSize(size_t size) {
+  size = std::min<size_t>(size, HPACK_TABLE_SIZE);
+  if (size != table.MaxSize()) {
+    table.SetMaxSize(size);
+    size_update = true;
+  }
+}
+
+// Values of these headers usually differ between responses, so indexing
+// them would only evict useful entries.
+static bool isVolatileHeader(std::string_view name) {
+  return name == "content-length" || name == "date" || name == "etag" ||
+         name == "last-modified" || name == "content-range" ||
+         name == "set-cookie" || name == "age" || name == "expires" ||
+         name == "location";
+}
+
+void HpackEncoder::Encode(const std::vector<HeaderField> &headers,
+                          std::string &out) {
+  if (size_update) {
+    encodeInteger(out, 0x20, 5, table.MaxSize());
+    size_update = false;
+  }
+
+  for (const HeaderField &field : headers) {
+    size_t name_index;
+    size_t index = table.Find(field.name, field.value, name_index);
+    if (index) {
+      encodeInteger(out, 0x80, 7, index);
+      continue;
+    }
+
+    size_t entry_size =
+        field.name.size() + field.value.size() + HPACK_ENTRY_OVERHEAD;
+    if (!isVolatileHeader(field.name) && entry_size <= table.MaxSize() / 2) {
+      // Literal with incremental indexing.
+      encodeInteger(out, 0x40, 6, name_index);
+      if (!name_index) {
+        encodeString(out, field.name);
+      }
+      encodeString(out, field.value);
+      table.Add(field.name, field.value);
+    } else {
+      // Literal without indexing.
+      encodeInteger(out, 0x00, 4, name_index);
+      if (!name_index) {
+        encodeString(out, field.name);
+      }
+      encodeString(out, field.value);
+    }
+  }
+}
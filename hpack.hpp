@@ -0,0 +1,87 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Initial size of the HPACK dynamic tables, and the size we advertise.
+#define HPACK_TABLE_SIZE 4096
+
+// A header field of an HTTP/2 header block. Names are lowercase.
+struct HeaderField {
+  std::string name;
+  std::string value;
+};
+
+// Static and dynamic header table of one direction of a connection
+// (RFC 7541 section 2.3). Index 1-61 is the static table, the dynamic
+// table follows with the newest entry first.
+class HpackTable {
+public:
+  explicit HpackTable(size_t max_size = HPACK_TABLE_SIZE);
+
+  // Returns the name and value at index, false if there is no such entry.
+  bool Get(size_t index, std::string_view &name, std::string_view &value) const;
+
+  // Insert an entry, evicting old ones to stay within the size limit.
+  void Add(std::string_view name, std::string_view value);
+
+  // Change the size limit, evicting as needed.
+  void SetMaxSize(size_t size);
+  size_t MaxSize() const { return max_size; }
+
+  // Returns the index of an entry matching name and value, or 0. If there is
+  // none, name_index is set to an entry with the same name (or 0).
+  size_t Find(std::string_view name, std::string_view value,
+              size_t &name_index) const;
+
+private:
+  void Evict(size_t limit);
+
+  std::deque<HeaderField> entries;
+  size_t size;     // Sum of entry sizes (name + value + 32).
+  size_t max_size; // Current limit.
+};
+
+// Decodes the header blocks received on a connection.
+class HpackDecoder {
+public:
+  explicit HpackDecoder(size_t max_table_size = HPACK_TABLE_SIZE);
+
+  // Decode a complete header block into headers.
+  // Returns false on a compression error, which is fatal to the connection.
+  bool Decode(std::string_view block, std::vector<HeaderField> &headers);
+
+private:
+  HpackTable table;
+  size_t max_table_size; // Largest size the peer may switch the table to.
+};
+
+// Encodes the header blocks sent on a connection.
+// :status and common names use the static table; header fields that repeat
+// across responses are added to the dynamic table, fields that differ per
+// response (lengths, dates, validators) are not.
+class HpackEncoder {
+public:
+  HpackEncoder();
+
+  // Apply the peer's SETTINGS_HEADER_TABLE_SIZE.
+  void SetMaxTableSize(size_t size);
+
+  // Append the encoded header block for headers to out.
+  void Encode(const std::vector<HeaderField> &headers, std::string &out);
+
+private:
+  HpackTable table;
+  bool size_update; // A table size update must start the next block.
+};
+
+// Decode a Huffman-coded string literal (RFC 7541 Appendix B) and append it
+// to out. Returns false if the input is not validly encoded.
+bool huffmanDecode(std::string_view in, std::string &out);
+
+#endif /* HPACK_H */
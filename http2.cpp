@@ -0,0 +1,1036 @@
+#include "http2.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+extern "C" {
+#include <unistd.h>
+}
+
+// Frame types (RFC 9113 section 6).
+enum FrameType : uint8_t {
+  FRAME_DATA = 0x0,
+  FRAME_HEADERS = 0x1,
+  FRAME_PRIORITY = 0x2,
+  FRAME_RST_STREAM = 0x3,
+  FRAME_SETTINGS = 0x4,
+  FRAME_PUSH_PROMISE = 0x5,
+  FRAME_PING = 0x6,
+  FRAME_GOAWAY = 0x7,
+  FRAME_WINDOW_UPDATE = 0x8,
+  FRAME_CONTINUATION = 0x9,
+};
+
+// Frame flags.
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+// Error codes (RFC 9113 section 7).
+enum ErrorCode : uint32_t {
+  H2_NO_ERROR = 0x0,
+  H2_PROTOCOL_ERROR = 0x1,
+  H2_INTERNAL_ERROR = 0x2,
+  H2_FLOW_CONTROL_ERROR = 0x3,
+  H2_STREAM_CLOSED = 0x5,
+  H2_FRAME_SIZE_ERROR = 0x6,
+  H2_REFUSED_STREAM = 0x7,
+  H2_CANCEL = 0x8,
+  H2_COMPRESSION_ERROR = 0x9,
+};
+
+// Setting identifiers (RFC 9113 section 6.5.2).
+enum SettingId : uint16_t {
+  SETTINGS_HEADER_TABLE_SIZE = 0x1,
+  SETTINGS_ENABLE_PUSH = 0x2,
+  SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+  SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+  SETTINGS_MAX_FRAME_SIZE = 0x5,
+};
+
+#define FRAME_HEADER_SIZE 9
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+
+// Chunked decoder states of Http2Stream::SendChunked.
+enum ChunkState {
+  CHUNK_SIZE,    // Reading a chunk-size line.
+  CHUNK_DATA,    // Reading chunk data.
+  CHUNK_CRLF,    // Skipping the CRLF after chunk data.
+  CHUNK_TRAILER, // After the last chunk, until the empty line.
+  CHUNK_DONE,
+};
+
+static uint32_t readUint32(const char *p) {
+  const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+  return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) |
+         (uint32_t(u[2]) << 8) | uint32_t(u[3]);
+}
+
+static void appendUint32(std::string &out, uint32_t value) {
+  out.push_back(static_cast<char>(value >> 24));
+  out.push_back(static_cast<char>(value >> 16));
+  out.push_back(static_cast<char>(value >> 8));
+  out.push_back(static_cast<char>(value));
+}
+
+static void appendSetting(std::string &out, uint16_t id, uint32_t value) {
+  out.push_back(static_cast<char>(id >> 8));
+  out.push_back(static_cast<char>(id));
+  appendUint32(out, value);
+}
+
+// Decode base64url without padding, as used by HTTP2-Settings.
+static bool base64UrlDecode(std::string_view in, std::string &out) {
+  uint32_t bits = 0;
+  int count = 0;
+  for (char c : in) {
+    int value;
+    if (c >= 'A' && c <= 'Z') {
+      value = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      value = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      value = c - '0' + 52;
+    } else if (c == '-' || c == '+') {
+      value = 62;
+    } else if (c == '_' || c == '/') {
+      value = 63;
+    } else if (c == '=') {
+      break;
+    } else {
+      return false;
+    }
+
+    bits = (bits << 6) | static_cast<uint32_t>(value);
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      out.push_back(static_cast<char>((bits >> count) & 0xff));
+    }
+  }
+  return true;
+}
+
+static std::string lowercase(std::string_view s) {
+  std::string out(s);
+  std::transform(out.begin(), out.end(), out.begin(), ::tolower);
+  return out;
+}
+
+bool isHttp2Preface(std::string_view data) {
+  size_t n = std::min<size_t>(data.size(), H2_PREFACE_LEN);
+  return n >= 3 && data.compare(0, n, H2_PREFACE, n) == 0;
+}
+
+Http2Stream::Http2Stream(std::shared_ptr<Http2Session> session, uint32_t id)
+    : cppserver::Client(-1), session(std::move(session)), id(id),
+      head_sent(false), end_stream(false), chunked(false), remaining(-1),
+      chunk_left(0), chunk_state(CHUNK_SIZE) {}
+
+ssize_t Http2Stream::Send(std::string_view data, int flags) {
+  (void)flags;
+  if (end_stream) {
+    return data.empty() ? 0 : -1;
+  }
+
+  if (head_sent) {
+    if (!SendBody(data)) {
+      return -1;
+    }
+    bytes_sent += data.size();
+    return static_cast<ssize_t>(data.size());
+  }
+
+  // Collect the status line and headers, which may come in pieces.
+  size_t searched = head.size() < 3 ? 0 : head.size() - 3;
+  head.append(data);
+  size_t end = head.find("\r\n\r\n", searched);
+  if (end == std::string::npos) {
+    if (head.size() > H2_MAX_HEADER_BLOCK) {
+      return -1;
+    }
+    bytes_sent += data.size();
+    return static_cast<ssize_t>(data.size());
+  }
+
+  std::string body = head.substr(end + 4);
+  head.resize(end + 2);
+  if (!SendHead() || (!body.empty() && !SendBody(body))) {
+    return -1;
+  }
+  bytes_sent += data.size();
+  return static_cast<ssize_t>(data.size());
+}
+
+bool Http2Stream::SendHead() {
+  // Status line: HTTP/1.1 <code> <reason>
+  size_t line_end = head.find("\r\n");
+  size_t space = head.find(' ');
+  if (space == std::string::npos || space > line_end) {
+    return false;
+  }
+  int status = atoi(head.c_str() + space + 1);
+
+  std::vector<HeaderField> fields;
+  fields.push_back(HeaderField{":status", std::to_string(status)});
+
+  size_t pos = line_end + 2;
+  while (pos < head.size()) {
+    size_t eol = head.find("\r\n", pos);
+    std::string_view line(head.data() + pos, eol - pos);
+    pos = eol + 2;
+
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos) {
+      continue;
+    }
+    std::string name = lowercase(line.substr(0, colon));
+    std::string_view value = line.substr(colon + 1);
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+      value.remove_prefix(1);
+    }
+
+    // Connection-specific headers are not allowed in HTTP/2.
+    if (name == "connection" || name == "keep-alive" ||
+        name == "proxy-connection" || name == "upgrade") {
+      continue;
+    }
+    if (name == "transfer-encoding") {
+      chunked = lowercase(value).find("chunked") != std::string::npos;
+      continue;
+    }
+    if (name == "content-length") {
+      remaining = strtoll(std::string(value).c_str(), NULL, 10);
+    }
+    fields.push_back(HeaderField{std::move(name), std::string(value)});
+  }
+
+  head.clear();
+  head_sent = true;
+
+  bool no_body = (status >= 100 && status < 200) || status == 204 ||
+                 status == 304 || (!chunked && remaining == 0);
+  if (!session->WriteHeaders(id, fields, no_body)) {
+    return false;
+  }
+  if (no_body) {
+    end_stream = true;
+    session->CloseStream(id);
+  }
+  return true;
+}
+
+bool Http2Stream::SendBody(std::string_view data) {
+  if (end_stream) {
+    return true; // Nothing more belongs to the response.
+  }
+  if (chunked) {
+    return SendChunked(data);
+  }
+
+  bool last = false;
+  if (remaining >= 0) {
+    data = data.substr(0, static_cast<size_t>(remaining));
+    remaining -= static_cast<int64_t>(data.size());
+    last = remaining == 0;
+  }
+  if (data.empty() && !last) {
+    return true;
+  }
+
+  if (!session->WriteData(id, data, last)) {
+    return false;
+  }
+  if (last) {
+    end_stream = true;
+    session->CloseStream(id);
+  }
+  return true;
+}
+
+// Strip the chunked transfer coding: chunk data goes out as DATA frames,
+// the last chunk ends the stream.
+bool Http2Stream::SendChunked(std::string_view data) {
+  while (!data.empty() && chunk_state != CHUNK_DONE) {
+    size_t n;
+    switch (chunk_state) {
+    case CHUNK_SIZE:
+      n = data.find('\n');
+      if (n == std::string_view::npos) {
+        chunk.append(data);
+        return chunk.size() <= 1024;
+      }
+      chunk.append(data.substr(0, n));
+      data.remove_prefix(n + 1);
+      chunk_left = strtoul(chunk.c_str(), NULL, 16);
+      chunk.clear();
+      chunk_state = chunk_left ? CHUNK_DATA : CHUNK_TRAILER;
+      break;
+
+    case CHUNK_DATA:
+      n = std::min(chunk_left, data.size());
+      if (!session->WriteData(id, data.substr(0, n), false)) {
+        return false;
+      }
+      chunk_left -= n;
+      data.remove_prefix(n);
+      if (chunk_left == 0) {
+        chunk_state = CHUNK_CRLF;
+      }
+      break;
+
+    case CHUNK_CRLF:
+      n = data.find('\n');
+      if (n == std::string_view::npos) {
+        return true;
+      }
+      data.remove_prefix(n + 1);
+      chunk_state = CHUNK_SIZE;
+      break;
+
+    case CHUNK_TRAILER:
+      // Trailers are dropped; the coding ends with an empty line.
+      chunk.append(data);
+      data = std::string_view();
+      if (chunk.compare(0, 2, "\r\n") == 0 ||
+          chunk.find("\r\n\r\n") != std::string::npos) {
+        chunk.clear();
+        chunk_state = CHUNK_DONE;
+        end_stream = true;
+        bool ok = session->WriteData(id, std::string_view(), true);
+        session->CloseStream(id);
+        return ok;
+      }
+      break;
+
+    case CHUNK_DONE:
+      break;
+    }
+  }
+  return true;
+}
+
+ssize_t Http2Stream::SendFile(int file_fd, off_t offset, size_t count) {
+  std::vector<char> buffer(std::min<size_t>(count, 64 * 1024));
+  size_t sent = 0;
+  while (sent < count) {
+    ssize_t n = pread(file_fd, buffer.data(),
+                      std::min(buffer.size(), count - sent), offset);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      perror("pread");
+      return -1;
+    }
+    if (n == 0) {
+      // File was truncated while sending.
+      break;
+    }
+    if (Send(std::string_view(buffer.data(), n)) == -1) {
+      return -1;
+    }
+    offset += n;
+    sent += static_cast<size_t>(n);
+  }
+  return static_cast<ssize_t>(sent);
+}
+
+std::string Http2Stream::PeerAddress() {
+  return session->socket->PeerAddress();
+}
+
+void Http2Stream::Finish() {
+  if (end_stream) {
+    return;
+  }
+  end_stream = true;
+
+  if (!head_sent) {
+    // The handler sent no (complete) response.
+    session->ResetStream(id, H2_INTERNAL_ERROR);
+    return;
+  }
+  session->WriteData(id, std::string_view(), true);
+  session->CloseStream(id);
+}
+
+Http2Session::Http2Session(std::unique_ptr<cppserver::Client> socket,
+                           Http2Dispatch dispatch)
+    : socket(std::move(socket)), dispatch(std::move(dispatch)),
+      preface_received(false), last_stream(0), goaway(false),
+      continuation_stream(0), continuation_end_stream(false),
+      recv_unacked(0), send_window(DEFAULT_WINDOW),
+      initial_window(DEFAULT_WINDOW), peer_max_frame(H2_MAX_FRAME_SIZE),
+      closed(false) {}
+
+// Apply the base64url-encoded SETTINGS payload of an HTTP2-Settings header.
+bool Http2Session::ApplyUpgradeSettings(std::string_view value) {
+  std::string payload;
+  if (!base64UrlDecode(value, payload) || payload.size() % 6 != 0) {
+    return false;
+  }
+
+  for (size_t i = 0; i < payload.size(); i += 6) {
+    uint16_t id = static_cast<uint16_t>(
+        (static_cast<unsigned char>(payload[i]) << 8) |
+        static_cast<unsigned char>(payload[i + 1]));
+    if (ApplySetting(id, readUint32(payload.data() + i + 2)) != H2_NO_ERROR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Http2Session::Start(std::unique_ptr<Request> upgrade) {
+  std::string settings;
+  appendSetting(settings, SETTINGS_MAX_CONCURRENT_STREAMS,
+                H2_MAX_CONCURRENT_STREAMS);
+  appendSetting(settings, SETTINGS_INITIAL_WINDOW_SIZE, H2_STREAM_WINDOW);
+  appendSetting(settings, SETTINGS_ENABLE_PUSH, 0);
+
+  std::string increment;
+  appendUint32(increment, H2_CONNECTION_WINDOW - DEFAULT_WINDOW);
+
+  {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    WriteLocked(FRAME_SETTINGS, 0, 0, settings);
+    WriteLocked(FRAME_WINDOW_UPDATE, 0, 0, increment);
+  }
+
+  if (!upgrade) {
+    return true;
+  }
+
+  Header *settings_header = upgrade->findRequestHeader("HTTP2-Settings");
+  if (!settings_header || !ApplyUpgradeSettings(settings_header->value)) {
+    return ConnectionError(H2_PROTOCOL_ERROR);
+  }
+
+  // The upgrade request is stream 1, half-closed by the client. Its
+  // response waits for the client preface: clients may not be ready for
+  // HTTP/2 frames before they have sent it.
+  upgrade_stream = std::make_shared<Http2Stream>(shared_from_this(), 1);
+  upgrade_stream->request = std::move(upgrade);
+  last_stream = 1;
+  std::lock_guard<std::mutex> lock(state_mutex);
+  streams[1] = StreamState{upgrade_stream, initial_window, 0, true};
+  return true;
+}
+
+bool Http2Session::Receive(std::string data) {
+  size_t before = input.size();
+  socket->TakeReceived(std::move(data), input);
+  if (socket->Read(input) == -1 ||
+      (input.size() == before && socket->PeerClosed())) {
+    // Connection lost or closed by the peer.
+    std::lock_guard<std::mutex> lock(state_mutex);
+    closed = true;
+    window_changed.notify_all();
+    return false;
+  }
+
+  if (!preface_received) {
+    if (input.size() < H2_PREFACE_LEN) {
+      return isHttp2Preface(input) || ConnectionError(H2_PROTOCOL_ERROR);
+    }
+    if (input.compare(0, H2_PREFACE_LEN, H2_PREFACE) != 0) {
+      return ConnectionError(H2_PROTOCOL_ERROR);
+    }
+    input.erase(0, H2_PREFACE_LEN);
+    preface_received = true;
+    if (upgrade_stream) {
+      dispatch(std::move(upgrade_stream));
+    }
+  }
+
+  size_t pos = 0;
+  while (input.size() - pos >= FRAME_HEADER_SIZE) {
+    const char *p = input.data() + pos;
+    Frame frame;
+    frame.length = readUint32(p) >> 8;
+    frame.type = static_cast<uint8_t>(p[3]);
+    frame.flags = static_cast<uint8_t>(p[4]);
+    frame.stream = readUint32(p + 5) & 0x7fffffff;
+
+    if (frame.length > H2_MAX_FRAME_SIZE) {
+      return ConnectionError(H2_FRAME_SIZE_ERROR);
+    }
+    if (input.size() - pos < FRAME_HEADER_SIZE + frame.length) {
+      break;
+    }
+
+    frame.payload = std::string_view(p + FRAME_HEADER_SIZE, frame.length);
+    pos += FRAME_HEADER_SIZE + frame.length;
+    if (!ProcessFrame(frame)) {
+      return false;
+    }
+  }
+
+  input.erase(0, pos);
+  return true;
+}
+
+bool Http2Session::ProcessFrame(const Frame &frame) {
+  // A header block must not be interleaved with other frames.
+  if (continuation_stream && (frame.type != FRAME_CONTINUATION ||
+                              frame.stream != continuation_stream)) {
+    return ConnectionError(H2_PROTOCOL_ERROR);
+  }
+
+  switch (frame.type) {
+  case FRAME_DATA:
+    return OnData(frame);
+  case FRAME_HEADERS:
+    return OnHeaders(frame);
+  case FRAME_PRIORITY:
+    // Streams are served as they arrive; priorities are ignored.
+    return frame.length == 5 || ConnectionError(H2_FRAME_SIZE_ERROR);
+  case FRAME_RST_STREAM:
+    return OnRstStream(frame);
+  case FRAME_SETTINGS:
+    return OnSettings(frame);
+  case FRAME_PUSH_PROMISE:
+    return ConnectionError(H2_PROTOCOL_ERROR);
+  case FRAME_PING:
+    if (frame.stream != 0 || frame.length != 8) {
+      return ConnectionError(H2_PROTOCOL_ERROR);
+    }
+    return (frame.flags & FLAG_ACK) ||
+           WriteFrame(FRAME_PING, FLAG_ACK, 0, frame.payload);
+  case FRAME_GOAWAY:
+    // Stop reading; streams already received are still answered.
+    goaway = true;
+    return false;
+  case FRAME_WINDOW_UPDATE:
+    return OnWindowUpdate(frame);
+  case FRAME_CONTINUATION:
+    if (!continuation_stream) {
+      return ConnectionError(H2_PROTOCOL_ERROR);
+    }
+    header_block.append(frame.payload);
+    if (header_block.size() > H2_MAX_HEADER_BLOCK) {
+      return ConnectionError(H2_PROTOCOL_ERROR);
+    }
+    if (frame.flags & FLAG_END_HEADERS) {
+      uint32_t id = continuation_stream;
+      continuation_stream = 0;
+      return OnHeaderBlock(id, continuation_end_stream);
+    }
+    return true;
+  default:
+    // Unknown frame types are ignored.
+    return true;
+  }
+}
+
+// Strip the padding of a DATA or HEADERS frame. Returns false if invalid.
+static bool removePadding(uint8_t flags, std::string_view &payload) {
+  if (!(flags & FLAG_PADDED)) {
+    return true;
+  }
+  if (payload.empty()) {
+    return false;
+  }
+  size_t pad = static_cast<unsigned char>(payload[0]);
+  payload.remove_prefix(1);
+  if (pad > payload.size()) {
+    return false;
+  }
+  payload.remove_suffix(pad);
+  return true;
+}
+
+bool Http2Session::OnHeaders(const Frame &frame) {
+  if (frame.stream == 0 || frame.stream % 2 == 0) {
+    return ConnectionError(H2_PROTOCOL_ERROR);
+  }
+
+  std::string_view payload = frame.payload;
+  if (!removePadding(frame.flags, payload)) {
+    return ConnectionError(H2_PROTOCOL_ERROR);
+  }
+  if (frame.flags & FLAG_PRIORITY) {
+    if (payload.size() < 5) {
+      return ConnectionError(H2_FRAME_SIZE_ERROR);
+    }
+    payload.remove_prefix(5);
+  }
+
+  header_block.assign(payload);
+  bool end_stream = frame.flags & FLAG_END_STREAM;
+  if (frame.flags & FLAG_END_HEADERS) {
+    return OnHeaderBlock(frame.stream, end_stream);
+  }
+
+  continuation_stream = frame.stream;
+  continuation_end_stream = end_stream;
+  return true;
+}
+
+bool Http2Session::OnHeaderBlock(uint32_t id, bool end_stream) {
+  // The block must be decoded even if the stream is refused, to keep the
+  // dynamic table in sync.
+  std::vector<HeaderField> fields;
+  bool ok = decoder.Decode(header_block, fields);
+  header_block.clear();
+  if (!ok) {
+    return ConnectionError(H2_COMPRESSION_ERROR);
+  }
+
+  std::shared_ptr<Http2Stream> stream;
+  uint32_t error = H2_NO_ERROR;
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    auto it = streams.find(id);
+    if (it != streams.end()) {
+      // Trailers; they must end the request.
+      if (it->second.remote_closed || !end_stream) {
+        error = H2_PROTOCOL_ERROR;
+      } else {
+        it->second.remote_closed = true;
+        stream = it->second.stream;
+      }
+    } else if (id <= last_stream) {
+      error = H2_STREAM_CLOSED;
+    } else {
+      last_stream = id;
+      if (streams.size() < H2_MAX_CONCURRENT_STREAMS) {
+        stream = std::make_shared<Http2Stream>(shared_from_this(), id);
+        stream->request_headers = std::move(fields);
+        streams[id] = StreamState{stream, initial_window, 0, end_stream};
+      }
+    }
+  }
+
+  if (error != H2_NO_ERROR) {
+    return ConnectionError(error);
+  }
+  if (!stream) {
+    ResetStream(id, H2_REFUSED_STREAM);
+    return true;
+  }
+  if (end_stream) {
+    Dispatch(stream);
+  }
+  return true;
+}
+
+bool Http2Session::OnData(const Frame &frame) {
+  if (frame.stream == 0) {
+    return ConnectionError(H2_PROTOCOL_ERROR);
+  }
+
+  // Padding counts towards flow control too.
+  recv_unacked += frame.length;
+  if (recv_unacked > H2_CONNECTION_WINDOW) {
+    return ConnectionError(H2_FLOW_CONTROL_ERROR);
+  }
+  if (recv_unacked >= H2_CONNECTION_WINDOW / 2) {
+    std::string increment;
+    appendUint32(increment, recv_unacked);
+    recv_unacked = 0;
+    if (!WriteFrame(FRAME_WINDOW_UPDATE, 0, 0, increment)) {
+      return false;
+    }
+  }
+
+  std::string_view payload = frame.payload;
+  if (!removePadding(frame.flags, payload)) {
+    return ConnectionError(H2_PROTOCOL_ERROR);
+  }
+
+  bool end_stream = frame.flags & FLAG_END_STREAM;
+  std::shared_ptr<Http2Stream> stream;
+  uint32_t stream_increment = 0;
+  uint32_t error = H2_NO_ERROR;
+  bool too_large = false;
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    auto it = streams.find(frame.stream);
+    if (it != streams.end() && !it->second.remote_closed) {
+      StreamState &state = it->second;
+      std::string &body = state.stream->request_body;
+      state.recv_unacked += frame.length;
+      if (state.recv_unacked > H2_STREAM_WINDOW) {
+        error = H2_FLOW_CONTROL_ERROR;
+      } else if (payload.size() > MAX_REQUEST_BODY_SIZE - body.size()) {
+        too_large = true;
+      } else {
+        body.append(payload);
+        if (end_stream) {
+          state.remote_closed = true;
+          stream = state.stream;
+        } else if (state.recv_unacked >= H2_STREAM_WINDOW / 2) {
+          stream_increment = state.recv_unacked;
+          state.recv_unacked = 0;
+        }
+      }
+    } else if (frame.stream > last_stream) {
+      error = H2_PROTOCOL_ERROR;
+    } else if (it != streams.end()) {
+      error = H2_STREAM_CLOSED;
+    }
+    // Otherwise the data is for a stream we already reset or answered.
+  }
+
+  if (error != H2_NO_ERROR) {
+    return ConnectionError(error);
+  }
+  if (too_large) {
+    // Later DATA frames for the stream are dropped as for any reset one.
+    ResetStream(frame.stream, H2_CANCEL);
+    return true;
+  }
+  if (stream_increment) {
+    std::string increment;
+    appendUint32(increment, stream_increment);
+    WriteFrame(FRAME_WINDOW_UPDATE, 0, frame.stream, increment);
+  }
+  if (stream) {
+    Dispatch(stream);
+  }
+  return true;
+}
+
+uint32_t Http2Session::ApplySetting(uint16_t id, uint32_t value) {
+  switch (id) {
+  case SETTINGS_HEADER_TABLE_SIZE: {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    encoder.SetMaxTableSize(value);
+    break;
+  }
+  case SETTINGS_ENABLE_PUSH:
+    if (value > 1) {
+      return H2_PROTOCOL_ERROR;
+    }
+    break;
+  case SETTINGS_INITIAL_WINDOW_SIZE: {
+    if (value > MAX_WINDOW) {
+      return H2_FLOW_CONTROL_ERROR;
+    }
+    // The change applies to the windows of all open streams.
+    std::lock_guard<std::mutex> lock(state_mutex);
+    int64_t delta = static_cast<int64_t>(value) - initial_window;
+    initial_window = value;
+    for (auto &entry : streams) {
+      entry.second.send_window += delta;
+    }
+    window_changed.notify_all();
+    break;
+  }
+  case SETTINGS_MAX_FRAME_SIZE: {
+    if (value < H2_MAX_FRAME_SIZE || value > 0xffffff) {
+      return H2_PROTOCOL_ERROR;
+    }
+    std::lock_guard<std::mutex> lock(state_mutex);
+    peer_max_frame = value;
+    break;
+  }
+  default:
+    // Unknown settings are ignored.
+    break;
+  }
+  return H2_NO_ERROR;
+}
+
+bool Http2Session::OnSettings(const Frame &frame) {
+  if (frame.stream != 0) {
+    return ConnectionError(H2_PROTOCOL_ERROR);
+  }
+  if (frame.flags & FLAG_ACK) {
+    return frame.length == 0 || ConnectionError(H2_FRAME_SIZE_ERROR);
+  }
+  if (frame.length % 6 != 0) {
+    return ConnectionError(H2_FRAME_SIZE_ERROR);
+  }
+
+  const char *p = frame.payload.data();
+  for (size_t i = 0; i < frame.length; i += 6) {
+    uint16_t id = static_cast<uint16_t>(
+        (static_cast<unsigned char>(p[i]) << 8) |
+        static_cast<unsigned char>(p[i + 1]));
+    uint32_t error = ApplySetting(id, readUint32(p + i + 2));
+    if (error != H2_NO_ERROR) {
+      return ConnectionError(error);
+    }
+  }
+  return WriteFrame(FRAME_SETTINGS, FLAG_ACK, 0, std::string_view());
+}
+
+bool Http2Session::OnWindowUpdate(const Frame &frame) {
+  if (frame.length != 4) {
+    return ConnectionError(H2_FRAME_SIZE_ERROR);
+  }
+
+  uint32_t increment = readUint32(frame.payload.data()) & 0x7fffffff;
+  if (increment == 0) {
+    if (frame.stream == 0) {
+      return ConnectionError(H2_PROTOCOL_ERROR);
+    }
+    ResetStream(frame.stream, H2_PROTOCOL_ERROR);
+    return true;
+  }
+
+  bool overflow = false;
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    if (frame.stream == 0) {
+      send_window += increment;
+      overflow = send_window > MAX_WINDOW;
+    } else {
+      auto it = streams.find(frame.stream);
+      if (it != streams.end()) {
+        it->second.send_window += increment;
+        overflow = it->second.send_window > MAX_WINDOW;
+      }
+    }
+    window_changed.notify_all();
+  }
+
+  if (overflow && frame.stream == 0) {
+    return ConnectionError(H2_FLOW_CONTROL_ERROR);
+  }
+  if (overflow) {
+    ResetStream(frame.stream, H2_FLOW_CONTROL_ERROR);
+  }
+  return true;
+}
+
+bool Http2Session::OnRstStream(const Frame &frame) {
+  if (frame.stream == 0) {
+    return ConnectionError(H2_PROTOCOL_ERROR);
+  }
+  if (frame.length != 4) {
+    return ConnectionError(H2_FRAME_SIZE_ERROR);
+  }
+
+  // Writes for the stream fail from now on.
+  CloseStream(frame.stream);
+  return true;
+}
+
+// Whether field can be written into an HTTP/1 request. Names must be
+// lowercase tokens (a pseudo-header starts with ':'), and values must not
+// hold NUL, CR or LF; anything else is malformed (RFC 9113 8.2.1).
+static bool validField(const HeaderField &field) {
+  if (field.name.empty()) {
+    return false;
+  }
+  for (size_t i = 0; i < field.name.size(); i++) {
+    unsigned char c = static_cast<unsigned char>(field.name[i]);
+    if (c <= ' ' || c >= 0x7f || (c >= 'A' && c <= 'Z') ||
+        (c == ':' && i > 0)) {
+      return false;
+    }
+  }
+  return field.value.find_first_of(std::string_view("\0\r\n", 3)) ==
+         std::string::npos;
+}
+
+// Turn the stream's header fields and body into a Request and hand it to
+// the server. The request is rebuilt as HTTP/1.1 text so that it goes
+// through the same parser as requests on HTTP/1 connections.
+void Http2Session::Dispatch(std::shared_ptr<Http2Stream> stream) {
+  std::string method, path, authority, cookies, headers;
+  for (const HeaderField &field : stream->request_headers) {
+    if (!validField(field)) {
+      ResetStream(stream->id, H2_PROTOCOL_ERROR);
+      return;
+    }
+    if (field.name == ":method") {
+      method = field.value;
+    } else if (field.name == ":path") {
+      path = field.value;
+    } else if (field.name == ":authority") {
+      authority = field.value;
+    } else if (field.name == "cookie") {
+      // Cookies may be split into several fields (RFC 9113 8.2.3).
+      cookies += (cookies.empty() ? "" : "; ") + field.value;
+    } else if (field.name == "host") {
+      if (authority.empty()) {
+        authority = field.value;
+      }
+    } else if (field.name[0] != ':' && field.name != "content-length") {
+      headers += field.name + ": " + field.value + "\r\n";
+    }
+  }
+
+  // Both go into the request line, which blanks would split.
+  if (method.empty() || path.empty() ||
+      method.find_first_of(" \t") != std::string::npos ||
+      path.find_first_of(" \t") != std::string::npos) {
+    ResetStream(stream->id, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  std::string raw = method + " " + path + " HTTP/2\r\n";
+  if (!authority.empty()) {
+    raw += "host: " + authority + "\r\n";
+  }
+  if (!cookies.empty()) {
+    raw += "cookie: " + cookies + "\r\n";
+  }
+  raw += headers;
+  raw += "content-length: " + std::to_string(stream->request_body.size());
+  raw += "\r\n\r\n";
+  raw += stream->request_body;
+
+  stream->request_headers.clear();
+  stream->request_body.clear();
+
+  stream->request = std::make_unique<Request>();
+  try {
+    stream->request->ParseHttp(raw);
+  } catch (const std::exception &e) {
+    // A malformed request is a stream error (RFC 9113 8.1.1). A 400 body
+    // could wait for flow control window, which this thread has to read.
+    std::cerr << "Exception caught: " << e.what() << std::endl;
+    ResetStream(stream->id, H2_PROTOCOL_ERROR);
+    return;
+  }
+  dispatch(stream);
+}
+
+void Http2Session::GoAway() {
+  std::string payload;
+  appendUint32(payload, 0x7fffffff);
+  appendUint32(payload, H2_NO_ERROR);
+  WriteFrame(FRAME_GOAWAY, 0, 0, payload);
+}
+
+bool Http2Session::ConnectionError(uint32_t code) {
+  std::string payload;
+  appendUint32(payload, last_stream);
+  appendUint32(payload, code);
+  WriteFrame(FRAME_GOAWAY, 0, 0, payload);
+
+  goaway = true;
+  std::lock_guard<std::mutex> lock(state_mutex);
+  closed = true;
+  window_changed.notify_all();
+  return false;
+}
+
+bool Http2Session::WriteLocked(uint8_t type, uint8_t flags, uint32_t stream,
+                               std::string_view payload) {
+  std::string frame;
+  frame.reserve(FRAME_HEADER_SIZE + payload.size());
+  appendUint32(frame, static_cast<uint32_t>(payload.size()) << 8 | type);
+  frame.push_back(static_cast<char>(flags));
+  appendUint32(frame, stream);
+  frame.append(payload);
+
+  if (socket->Send(frame) == -1) {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    closed = true;
+    window_changed.notify_all();
+    return false;
+  }
+  return true;
+}
+
+bool Http2Session::WriteFrame(uint8_t type, uint8_t flags, uint32_t stream,
+                              std::string_view payload) {
+  std::lock_guard<std::mutex> lock(write_mutex);
+  return WriteLocked(type, flags, stream, payload);
+}
+
+bool Http2Session::WriteHeaders(uint32_t stream,
+                                const std::vector<HeaderField> &headers,
+                                bool end_stream) {
+  size_t max_frame;
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    if (closed || streams.find(stream) == streams.end()) {
+      return false;
+    }
+    max_frame = peer_max_frame;
+  }
+
+  // Encoding and sending must happen in the same order for all streams,
+  // since both ends update their dynamic tables as blocks go by.
+  std::lock_guard<std::mutex> lock(write_mutex);
+  std::string block;
+  encoder.Encode(headers, block);
+
+  std::string_view rest(block);
+  uint8_t type = FRAME_HEADERS;
+  uint8_t flags = end_stream ? FLAG_END_STREAM : 0;
+  do {
+    std::string_view fragment = rest.substr(0, max_frame);
+    rest.remove_prefix(fragment.size());
+    if (rest.empty()) {
+      flags |= FLAG_END_HEADERS;
+    }
+    if (!WriteLocked(type, flags, stream, fragment)) {
+      return false;
+    }
+    type = FRAME_CONTINUATION;
+    flags = 0;
+  } while (!rest.empty());
+  return true;
+}
+
+bool Http2Session::WriteData(uint32_t stream, std::string_view data,
+                             bool end_stream) {
+  do {
+    size_t n = 0;
+    {
+      std::unique_lock<std::mutex> lock(state_mutex);
+      while (true) {
+        auto it = streams.find(stream);
+        if (closed || it == streams.end()) {
+          return false;
+        }
+        if (data.empty()) {
+          break;
+        }
+
+        int64_t window = std::min(send_window, it->second.send_window);
+        if (window > 0) {
+          n = std::min({data.size(), static_cast<size_t>(window),
+                        static_cast<size_t>(peer_max_frame)});
+          send_window -= static_cast<int64_t>(n);
+          it->second.send_window -= static_cast<int64_t>(n);
+          break;
+        }
+
+        // Wait for WINDOW_UPDATE from the peer.
+        if (window_changed.wait_for(
+                lock, std::chrono::milliseconds(SEND_TIMEOUT_MS)) ==
+            std::cv_status::timeout) {
+          lock.unlock();
+          ResetStream(stream, H2_CANCEL);
+          return false;
+        }
+      }
+    }
+
+    bool last = end_stream && n == data.size();
+    if (!WriteFrame(FRAME_DATA, last ? FLAG_END_STREAM : 0, stream,
+                    data.substr(0, n))) {
+      return false;
+    }
+    data.remove_prefix(n);
+  } while (!data.empty());
+  return true;
+}
+
+void Http2Session::ResetStream(uint32_t stream, uint32_t code) {
+  std::string payload;
+  appendUint32(payload, code);
+  WriteFrame(FRAME_RST_STREAM, 0, stream, payload);
+  CloseStream(stream);
+}
+
+void Http2Session::CloseStream(uint32_t stream) {
+  std::lock_guard<std::mutex> lock(state_mutex);
+  streams.erase(stream);
+  window_changed.notify_all();
+}
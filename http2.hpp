@@ -0,0 +1,206 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "client.hpp"
+#include "hpack.hpp"
+#include "request.hpp"
+#include "upgrade.hpp"
+
+// Client connection preface (RFC 9113 section 3.4).
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+// Streams a client may have open at once (SETTINGS_MAX_CONCURRENT_STREAMS).
+#define H2_MAX_CONCURRENT_STREAMS 100
+
+// Receive windows we advertise for each stream and for the connection.
+#define H2_STREAM_WINDOW (1 << 20)
+#define H2_CONNECTION_WINDOW (16 << 20)
+
+// Largest frame payload we accept (the protocol default).
+#define H2_MAX_FRAME_SIZE 16384
+
+// Largest header block a client may send, across CONTINUATION frames.
+#define H2_MAX_HEADER_BLOCK (64 * 1024)
+
+// Returns true if data is, or starts with, the client connection preface.
+// A shorter data that is a prefix of it also matches once it has at least
+// the 3 bytes that tell it apart from an HTTP/1 method.
+bool isHttp2Preface(std::string_view data);
+
+class Http2Session;
+
+// One HTTP/2 request/response exchange.
+//
+// A stream is a Client for the Response that answers it: Response writes
+// HTTP/1.1 as usual, and the stream translates the status line and headers
+// to a HEADERS frame and the body (de-chunked if needed) to DATA frames,
+// within the peer's flow control windows.
+class Http2Stream : public cppserver::Client {
+public:
+  Http2Stream(std::shared_ptr<Http2Session> session, uint32_t id);
+
+  uint32_t Id() const { return id; }
+
+  // The request received on the stream, set before it is dispatched.
+  std::unique_ptr<Request> &getRequest() { return request; }
+
+  ssize_t Send(std::string_view data, int flags = 0) override;
+  ssize_t SendFile(int file_fd, off_t offset, size_t count) override;
+  std::string PeerAddress() override;
+
+  // End the response. Resets the stream if the handler sent nothing.
+  void Finish();
+
+private:
+  friend class Http2Session;
+
+  // Send the buffered status line and headers as a HEADERS frame.
+  bool SendHead();
+
+  // Send response body bytes as DATA frames. Return false on errors.
+  bool SendBody(std::string_view data);
+  bool SendChunked(std::string_view data);
+
+  std::shared_ptr<Http2Session> session;
+  uint32_t id;
+  std::unique_ptr<Request> request;
+
+  // Request side, filled in by the session.
+  std::vector<HeaderField> request_headers;
+  std::string request_body;
+
+  // Response side.
+  std::string head;  // HTTP/1.1 status line and headers until complete.
+  bool head_sent;    // HEADERS frame sent.
+  bool end_stream;   // END_STREAM sent or the stream was reset.
+  bool chunked;      // Body uses chunked transfer coding.
+  int64_t remaining; // Body bytes still to come, -1 if unknown.
+  std::string chunk; // Partial chunk-size line or trailer.
+  size_t chunk_left; // Data bytes left in the current chunk.
+  int chunk_state;   // Where the chunked decoder is, see SendChunked.
+};
+
+// Called with a stream whose request is complete. The callee must answer
+// it (on any thread) and call Finish.
+using Http2Dispatch = std::function<void(std::shared_ptr<Http2Stream>)>;
+
+// An HTTP/2 connection (RFC 9113) over cleartext TCP (h2c).
+//
+// Input is processed by Receive, one call at a time, on whichever thread the
+// server hands the connection's input to. Responses are written by the
+// threads serving the streams; writes are serialized with a mutex, and DATA
+// waits for flow control window (the socket is never written to out of
+// order or in parts of frames).
+class Http2Session : public UpgradedConnection,
+                     public std::enable_shared_from_this<Http2Session> {
+public:
+  Http2Session(std::unique_ptr<cppserver::Client> socket,
+               Http2Dispatch dispatch);
+
+  Http2Session(const Http2Session &) = delete;
+  Http2Session &operator=(const Http2Session &) = delete;
+
+  int fd() override { return socket->fd(); }
+
+  // Send our SETTINGS. upgrade is the request of an h2c upgrade: its
+  // HTTP2-Settings header holds the client's settings, and it becomes
+  // stream 1, which is dispatched once the client preface arrives.
+  // Returns false (after GOAWAY) if the upgrade settings are invalid.
+  bool Start(std::unique_ptr<Request> upgrade = nullptr);
+
+  // Process received bytes, then whatever else the socket has to read.
+  // Returns false when the connection is done: the peer closed it or sent
+  // GOAWAY, or a connection error was sent. Streams being served still
+  // finish; the socket is closed when the session is destroyed.
+  bool Receive(std::string data) override;
+  void Feed(std::string data) override { input.append(data); }
+
+  // Send GOAWAY without a last stream yet (RFC 9113 6.8): the client
+  // opens no new streams and closes the connection once its streams are
+  // answered.
+  void GoAway() override;
+
+private:
+  friend class Http2Stream;
+
+  struct Frame {
+    uint32_t length;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream;
+    std::string_view payload;
+  };
+
+  struct StreamState {
+    std::shared_ptr<Http2Stream> stream;
+    int64_t send_window;   // Bytes we may still send.
+    uint32_t recv_unacked; // Bytes received since the last WINDOW_UPDATE.
+    bool remote_closed;    // Peer sent END_STREAM.
+  };
+
+  // Input handling, on the thread running Receive.
+  bool ProcessFrame(const Frame &frame);
+  bool OnHeaders(const Frame &frame);
+  bool OnHeaderBlock(uint32_t id, bool end_stream);
+  bool OnData(const Frame &frame);
+  bool OnSettings(const Frame &frame);
+  bool OnWindowUpdate(const Frame &frame);
+  bool OnRstStream(const Frame &frame);
+  uint32_t ApplySetting(uint16_t id, uint32_t value); // Error code or 0.
+  bool ApplyUpgradeSettings(std::string_view value);
+  void Dispatch(std::shared_ptr<Http2Stream> stream);
+  bool ConnectionError(uint32_t code);
+
+  // Output, on any thread.
+  bool WriteFrame(uint8_t type, uint8_t flags, uint32_t stream,
+                  std::string_view payload);
+  bool WriteLocked(uint8_t type, uint8_t flags, uint32_t stream,
+                   std::string_view payload); // With write_mutex held.
+  bool WriteHeaders(uint32_t stream, const std::vector<HeaderField> &headers,
+                    bool end_stream);
+  bool WriteData(uint32_t stream, std::string_view data, bool end_stream);
+  void ResetStream(uint32_t stream, uint32_t code);
+  void CloseStream(uint32_t stream);
+
+  std::unique_ptr<cppserver::Client> socket;
+  Http2Dispatch dispatch;
+  std::string input;     // Received bytes not yet processed.
+  bool preface_received; // Client connection preface seen.
+  uint32_t last_stream;  // Highest client stream id seen.
+  bool goaway;           // GOAWAY sent or received.
+  std::shared_ptr<Http2Stream> upgrade_stream; // Stream 1 until the preface.
+  HpackDecoder decoder;
+
+  // Header block being received in HEADERS + CONTINUATION frames.
+  uint32_t continuation_stream;
+  bool continuation_end_stream;
+  std::string header_block;
+
+  uint32_t recv_unacked; // Connection bytes received since WINDOW_UPDATE.
+
+  // Streams and send windows; guarded by state_mutex.
+  std::mutex state_mutex;
+  std::condition_variable window_changed;
+  std::unordered_map<uint32_t, StreamState> streams;
+  int64_t send_window;     // Connection send window.
+  int64_t initial_window;  // Peer's SETTINGS_INITIAL_WINDOW_SIZE.
+  uint32_t peer_max_frame; // Peer's SETTINGS_MAX_FRAME_SIZE.
+  bool closed;             // No more output is possible.
+
+  // Serializes writes and the encoder's dynamic table.
+  std::mutex write_mutex;
+  HpackEncoder encoder;
+};
+
+#endif /* HTTP2_H */
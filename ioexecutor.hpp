@@ -0,0 +1,82 @@
+#ifndef IOEXECUTOR_H
+#define IOEXECUTOR_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Bounded thread pool for blocking file I/O (open, stat, read, sendfile).
+// Keeps slow disks from tying up the request workers. Unlike ThreadPool,
+// the queue has a fixed depth and Submit fails instead of growing it.
+class IoExecutor {
+public:
+  IoExecutor(size_t num_workers, size_t queue_depth);
+  ~IoExecutor();
+
+  IoExecutor(const IoExecutor &) = delete;
+  IoExecutor &operator=(const IoExecutor &) = delete;
+
+  // Queue job to run on an I/O worker.
+  // Returns false without queueing if the queue is full or stopped.
+  bool Submit(std::function<void()> job);
+
+  // Finish queued jobs and join the workers.
+  void Stop();
+
+  size_t Workers() const { return threads.size(); }
+  size_t QueueDepth() const { return queue_depth; }
+
+private:
+  void ThreadLoop();
+
+  size_t queue_depth;
+  bool should_terminate;
+  std::mutex queue_mutex;
+  std::condition_variable queue_condition;
+  std::deque<std::function<void()>> jobs;
+  std::vector<std::thread> threads;
+};
+
+// Default executor sizes for mounts that do not configure their own.
+#define IO_DEFAULT_WORKERS 4
+#define IO_DEFAULT_QUEUE_DEPTH 1024
+
+// Executor shared by every static mount without its own workers.
+IoExecutor *defaultIoExecutor();
+
+// Callbacks posted from other threads to run on the event loop thread.
+// fd() is an eventfd that becomes readable when callbacks are pending;
+// the event loop calls Drain when it does.
+class CompletionQueue {
+public:
+  CompletionQueue();
+  ~CompletionQueue();
+
+  CompletionQueue(const CompletionQueue &) = delete;
+  CompletionQueue &operator=(const CompletionQueue &) = delete;
+
+  int fd() const { return event_fd; }
+
+  // Queue fn for the event loop. Once the queue is closed fn is destroyed
+  // without running, so callbacks must release what they hold (e.g. a
+  // connection) through their captures.
+  void Post(std::function<void()> fn);
+
+  // Run pending callbacks. Called by the event loop.
+  void Drain();
+
+  // Drop pending callbacks and stop queueing new ones.
+  void Close();
+
+private:
+  int event_fd;
+  bool closed;
+  std::mutex mutex;
+  std::vector<std::function<void()>> pending;
+};
+
+#endif /* IOEXECUTOR_H */
@@ -0,0 +1,428 @@
+#include "listener.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void listenerFatal(const std::string &address, const char *what) {
+  fprintf(stderr, "%s: %s: %s\n", address.c_str(), what, strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+typedef std::vector<std::pair<std::string, int>> OptionList;
+
+// Parse CPPSERVER_LISTEN_OPTIONS ("key=value,..."; a bare key means 1).
+static OptionList parseEnvironment() {
+  OptionList list;
+  const char *value = getenv("CPPSERVER_LISTEN_OPTIONS");
+  std::string text = value ? value : "";
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t end = text.find(',', pos);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    std::string item = text.substr(pos, end - pos);
+    pos = end + 1;
+
+    size_t equals = item.find('=');
+    int number =
+        equals == std::string::npos ? 1 : atoi(item.c_str() + equals + 1);
+    list.emplace_back(item.substr(0, equals), number);
+  }
+  return list;
+}
+
+// Apply CPPSERVER_LISTEN_OPTIONS to options.
+static void applyEnvironment(ListenOptions &options) {
+  static const OptionList overrides = parseEnvironment();
+  static bool warned = false;
+
+  for (const auto &entry : overrides) {
+    const std::string &key = entry.first;
+    int number = entry.second;
+    if (key == "backlog") {
+      options.backlog = number;
+    } else if (key == "reuse_port") {
+      options.reuse_port = number != 0;
+    } else if (key == "nodelay") {
+      options.nodelay = number != 0;
+    } else if (key == "defer_accept") {
+      options.defer_accept = number;
+    } else if (key == "fastopen") {
+      options.fastopen = number;
+    } else if (key == "rcvbuf") {
+      options.rcvbuf = number;
+    } else if (key == "sndbuf") {
+      options.sndbuf = number;
+    } else if (key == "busy_poll") {
+      options.busy_poll = number;
+    } else if (key == "notsent_lowat") {
+      options.notsent_lowat = number;
+    } else if (key == "incoming_cpu") {
+      options.incoming_cpu = number;
+    } else if (!key.empty() && !warned) {
+      fprintf(stderr, "CPPSERVER_LISTEN_OPTIONS: unknown option %s\n",
+              key.c_str());
+    }
+  }
+  warned = true;
+}
+
+// Set an int socket option, warning if the kernel refuses it.
+static void tune(const Listener &listener, int level, int name,
+                 const char *label, int value) {
+  if (setsockopt(listener.fd, level, name, &value, sizeof(value)) == -1) {
+    fprintf(stderr, "%s: %s: %s\n", listener.address.c_str(), label,
+            strerror(errno));
+  }
+}
+
+// Apply the tuning in listener.options before listen(2).
+static void tuneListener(const Listener &listener, int family) {
+  const ListenOptions &o = listener.options;
+  if (o.rcvbuf > 0) {
+    tune(listener, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", o.rcvbuf);
+  }
+  if (o.sndbuf > 0) {
+    tune(listener, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", o.sndbuf);
+  }
+  if (family == AF_UNIX) {
+    return;
+  }
+
+  if (o.nodelay) {
+    tune(listener, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+  }
+  if (o.defer_accept > 0) {
+    tune(listener, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT",
+         o.defer_accept);
+  }
+  if (o.fastopen > 0) {
+    tune(listener, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", o.fastopen);
+  }
+  if (o.busy_poll > 0) {
+    tune(listener, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", o.busy_poll);
+  }
+  if (o.notsent_lowat > 0) {
+    tune(listener, IPPROTO_TCP, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT",
+         o.notsent_lowat);
+  }
+  if (o.incoming_cpu >= 0) {
+    tune(listener, SOL_SOCKET, SO_INCOMING_CPU, "SO_INCOMING_CPU",
+         o.incoming_cpu);
+  }
+}
+
+// Parse "host:port" or "[host]:port" with a numeric host.
+static bool parseInet(const std::string &address,
+                      struct sockaddr_storage &addr, socklen_t &len) {
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    return false;
+  }
+  std::string host = address.substr(0, colon);
+  std::string port = address.substr(colon + 1);
+
+  char *end;
+  long number = strtol(port.c_str(), &end, 10);
+  if (port.empty() || *end != '\0' || number < 0 || number > 65535) {
+    return false;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(static_cast<uint16_t>(number));
+    len = sizeof(*in6);
+    return inet_pton(AF_INET6, host.substr(1, host.size() - 2).c_str(),
+                     &in6->sin6_addr) == 1;
+  }
+
+  struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+  in->sin_family = AF_INET;
+  in->sin_port = htons(static_cast<uint16_t>(number));
+  len = sizeof(*in);
+  if (host.empty() || host == "*") {
+    in->sin_addr.s_addr = htonl(INADDR_ANY);
+    return true;
+  }
+  return inet_pton(AF_INET, host.c_str(), &in->sin_addr) == 1;
+}
+
+// Parse the part after "unix:": a path, or @name for an abstract socket.
+static bool parseUnix(const std::string &name, struct sockaddr_storage &addr,
+                      socklen_t &len) {
+  struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+  memset(&addr, 0, sizeof(addr));
+  un->sun_family = AF_UNIX;
+  if (name.empty() || name.size() >= sizeof(un->sun_path)) {
+    return false;
+  }
+
+  memcpy(un->sun_path, name.data(), name.size());
+  len = offsetof(struct sockaddr_un, sun_path) + name.size();
+  if (name[0] == '@') {
+    un->sun_path[0] = '\0'; // Abstract names are not NUL-terminated.
+  } else {
+    len++;
+  }
+  return true;
+}
+
+// True if addr is a socket file nobody accepts connections on, e.g. left
+// behind by a server that crashed.
+static bool staleSocket(const struct sockaddr_un *addr, socklen_t len) {
+  struct stat st;
+  if (stat(addr->sun_path, &st) == -1 || !S_ISSOCK(st.st_mode)) {
+    return false;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return false;
+  }
+  bool stale = connect(fd, (const struct sockaddr *)addr, len) == -1 &&
+               errno == ECONNREFUSED;
+  close(fd);
+  return stale;
+}
+
+typedef std::map<std::string, int> InheritedMap;
+
+// Parse CPPSERVER_LISTEN_FDS ("fd=address;...") into address -> fd, and
+// remove it from the environment so that it is not passed on by mistake.
+static InheritedMap parseInherited() {
+  InheritedMap inherited;
+  const char *value = getenv("CPPSERVER_LISTEN_FDS");
+  std::string text = value ? value : "";
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t end = text.find(';', pos);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    std::string item = text.substr(pos, end - pos);
+    pos = end + 1;
+
+    size_t equals = item.find('=');
+    if (equals != std::string::npos) {
+      inherited[item.substr(equals + 1)] = atoi(item.c_str());
+    }
+  }
+  unsetenv("CPPSERVER_LISTEN_FDS");
+  return inherited;
+}
+
+static InheritedMap &inheritedListeners() {
+  static InheritedMap inherited = parseInherited();
+  return inherited;
+}
+
+// Take over the listening socket fd passed down for listener.address.
+static void adoptListener(Listener &listener, int fd) {
+  const std::string &address = listener.address;
+  int listening = 0;
+  socklen_t len = sizeof(listening);
+  if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1) {
+    listenerFatal(address, "inherited socket");
+  }
+  if (!listening) {
+    errno = EINVAL;
+    listenerFatal(address, "inherited socket is not listening");
+  }
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+      fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+    listenerFatal(address, "fcntl");
+  }
+  listener.fd = fd;
+  listener.shared = true;
+
+  struct sockaddr_storage addr;
+  len = sizeof(addr);
+  if (getsockname(fd, (struct sockaddr *)&addr, &len) == -1) {
+    listenerFatal(address, "getsockname");
+  }
+  if (address.compare(0, 6, "unix:/") == 0) {
+    listener.unix_path = address.substr(5);
+  }
+
+  // listen(2) again applies a changed backlog.
+  tuneListener(listener, addr.ss_family);
+  if (listen(fd, listener.options.backlog) == -1) {
+    listenerFatal(address, "listen");
+  }
+}
+
+Listener openListener(const std::string &address,
+                      const ListenOptions &options) {
+  Listener listener;
+  listener.address = address;
+  listener.options = options;
+  applyEnvironment(listener.options);
+
+  InheritedMap &inherited = inheritedListeners();
+  auto it = inherited.find(address);
+  if (it != inherited.end()) {
+    int fd = it->second;
+    inherited.erase(it);
+    adoptListener(listener, fd);
+    return listener;
+  }
+
+  struct sockaddr_storage addr;
+  socklen_t len = 0;
+  bool is_unix = address.compare(0, 5, "unix:") == 0;
+  if (!(is_unix ? parseUnix(address.substr(5), addr, len)
+                : parseInet(address, addr, len))) {
+    errno = EINVAL;
+    listenerFatal(address, "bad listen address");
+  }
+
+  int family = addr.ss_family;
+  int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    listenerFatal(address, "socket");
+  }
+  listener.fd = fd;
+  const ListenOptions &o = listener.options;
+
+  int enable = 1;
+  if (family != AF_UNIX &&
+      (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) ==
+           -1 ||
+       (o.reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable,
+                                   sizeof(enable)) == -1))) {
+    listenerFatal(address, "setsockopt");
+  }
+  int v6_only = o.v6_only;
+  if (family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+                                       &v6_only, sizeof(v6_only)) == -1) {
+    listenerFatal(address, "setsockopt");
+  }
+
+  const struct sockaddr_un *un = (const struct sockaddr_un *)&addr;
+  bool unix_file = is_unix && un->sun_path[0] != '\0';
+  if (bind(fd, (struct sockaddr *)&addr, len) == -1) {
+    int error = errno;
+    if (unix_file && error == EADDRINUSE && staleSocket(un, len) &&
+        unlink(un->sun_path) == 0) {
+      error = bind(fd, (struct sockaddr *)&addr, len) == -1 ? errno : 0;
+    }
+    if (error != 0) {
+      errno = error;
+      listenerFatal(address, "bind");
+    }
+  }
+
+  if (unix_file) {
+    listener.unix_path = un->sun_path;
+    if (o.unix_mode != 0 && chmod(un->sun_path, o.unix_mode) == -1) {
+      listenerFatal(address, "chmod");
+    }
+  }
+
+  tuneListener(listener, family);
+  if (listen(fd, o.backlog) == -1) {
+    listenerFatal(address, "listen");
+  }
+  return listener;
+}
+
+// Read back an int socket option; -1 if unavailable.
+static int current(int fd, int level, int name) {
+  int value = 0;
+  socklen_t len = sizeof(value);
+  return getsockopt(fd, level, name, &value, &len) == -1 ? -1 : value;
+}
+
+std::string describeListener(const Listener &listener) {
+  const ListenOptions &o = listener.options;
+  int fd = listener.fd;
+  std::string out = "backlog " + std::to_string(o.backlog);
+
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  bool tcp = getsockname(fd, (struct sockaddr *)&addr, &len) == 0 &&
+             addr.ss_family != AF_UNIX;
+  if (tcp) {
+    if (current(fd, IPPROTO_TCP, TCP_NODELAY) > 0) {
+      out += ", nodelay";
+    }
+    int value = current(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT);
+    if (value > 0) {
+      out += ", defer_accept " + std::to_string(value) + "s";
+    }
+    value = current(fd, IPPROTO_TCP, TCP_FASTOPEN);
+    if (value > 0) {
+      out += ", fastopen " + std::to_string(value);
+    }
+    value = current(fd, SOL_SOCKET, SO_BUSY_POLL);
+    if (value > 0) {
+      out += ", busy_poll " + std::to_string(value) + "us";
+    }
+    value = current(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT);
+    if (value > 0 && value != INT_MAX) {
+      out += ", notsent_lowat " + std::to_string(value);
+    }
+    value = current(fd, SOL_SOCKET, SO_INCOMING_CPU);
+    if (value >= 0 && o.incoming_cpu >= 0) {
+      out += ", incoming_cpu " + std::to_string(value);
+    }
+  }
+  out += ", rcvbuf " + std::to_string(current(fd, SOL_SOCKET, SO_RCVBUF));
+  out += ", sndbuf " + std::to_string(current(fd, SOL_SOCKET, SO_SNDBUF));
+  return out;
+}
+
+void closeListener(Listener &listener) {
+  if (listener.fd == -1) {
+    return;
+  }
+  // Shutting down a listening socket stops it in every process.
+  if (!listener.shared) {
+    shutdown(listener.fd, SHUT_RDWR);
+  }
+  close(listener.fd);
+  listener.fd = -1;
+  if (!listener.unix_path.empty()) {
+    unlink(listener.unix_path.c_str());
+  }
+}
+
+std::string inheritableListeners(std::vector<Listener> &listeners) {
+  std::string out;
+  for (Listener &listener : listeners) {
+    listener.shared = true;
+    if (fcntl(listener.fd, F_SETFD, 0) == -1) {
+      listenerFatal(listener.address, "fcntl");
+    }
+    out += (out.empty() ? "" : ";") + std::to_string(listener.fd) + "=" +
+           listener.address;
+  }
+  return out;
+}
+
+void closeInheritedListeners() {
+  InheritedMap &inherited = inheritedListeners();
+  for (const auto &entry : inherited) {
+    close(entry.second);
+  }
+  inherited.clear();
+}
@@ -0,0 +1,110 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// Settings of one listening socket.
+struct ListenOptions {
+  // Connections the kernel queues until they are accepted (listen(2)).
+  int backlog = SOMAXCONN;
+
+  // Let other sockets bind the same TCP address, with the kernel
+  // spreading connections across them (SO_REUSEPORT).
+  bool reuse_port = false;
+
+  // IPv6 listeners only: refuse IPv4 clients instead of serving both
+  // families on one socket (IPV6_V6ONLY).
+  bool v6_only = false;
+
+  // Unix path listeners: permissions of the socket file, e.g. 0660
+  // (0 keeps what the umask gives).
+  mode_t unix_mode = 0;
+
+  // Terminate TLS here if the server has a TLS context (see
+  // TCPServer::EnableTls). Local Unix sockets usually turn it off.
+  bool tls = true;
+
+  // Socket tuning, set on the listening socket and inherited by accepted
+  // connections. 0 keeps the kernel default. Unix sockets only use the
+  // buffer sizes. Options the kernel refuses are reported and skipped.
+
+  // Send small writes at once (TCP_NODELAY). Responses are batched before
+  // they are written, so Nagle's algorithm only delays them.
+  bool nodelay = true;
+
+  // Wake the accepting loop only once a request has arrived, waiting up
+  // to this many seconds (TCP_DEFER_ACCEPT).
+  int defer_accept = 0;
+
+  // Accept data in the SYN of repeat clients, with up to this many
+  // pending fast opens (TCP_FASTOPEN).
+  int fastopen = 0;
+
+  // Socket buffer sizes in bytes (SO_RCVBUF, SO_SNDBUF).
+  int rcvbuf = 0;
+  int sndbuf = 0;
+
+  // Busy-poll the device queue for this many microseconds on blocking
+  // reads and polls (SO_BUSY_POLL; raising it needs CAP_NET_ADMIN).
+  int busy_poll = 0;
+
+  // Report the socket writable only once fewer than this many bytes are
+  // waiting to be sent (TCP_NOTSENT_LOWAT), which keeps queues short.
+  int notsent_lowat = 0;
+
+  // TCP listeners sharing a port through reuse_port: prefer this socket
+  // for connections whose packets arrive on this CPU (SO_INCOMING_CPU).
+  // With one server per core, each pinned to the core that handles its
+  // NIC queue (see CpuAffinity), a connection stays on one core from
+  // interrupt to response. -1 leaves the choice to the port hash.
+  int incoming_cpu = -1;
+};
+
+// A bound, listening, non-blocking socket.
+struct Listener {
+  int fd;
+  std::string address;   // As given, e.g "[::]:8080".
+  std::string unix_path; // Socket file to remove on close, if any.
+  ListenOptions options;
+  bool shared = false; // Other processes have it too; only close it.
+};
+
+// Bind and listen on address, which is one of
+//   "0.0.0.0:8080", "127.0.0.1:8080"  IPv4 (a numeric host)
+//   "*:8080", ":8080"                 every IPv4 address
+//   "[::]:8080", "[::1]:8080"         IPv6, with IPv4 too unless v6_only
+//   "unix:/run/app.sock"              a Unix socket file
+//   "unix:@app"                       a Linux abstract Unix socket
+// A stale socket file nobody listens on is replaced. Exits on errors.
+//
+// CPPSERVER_LISTEN_OPTIONS overrides options of every listener, e.g.
+// "nodelay=0,defer_accept=1,fastopen=256,rcvbuf=262144" (keys as in
+// ListenOptions; see also backlog, reuse_port, incoming_cpu), so that
+// benchmarks can sweep them without rebuilding.
+//
+// If CPPSERVER_LISTEN_FDS (see inheritableListeners) lists address, the
+// socket passed down under it is taken over instead: options are applied
+// to it again and nothing is bound, so no connection is refused.
+Listener openListener(const std::string &address,
+                      const ListenOptions &options = ListenOptions());
+
+// The values in effect on listener, as the kernel reports them, e.g.
+// "backlog 4096, nodelay, defer_accept 1s, rcvbuf 131072".
+std::string describeListener(const Listener &listener);
+
+// Close listener and remove its socket file.
+void closeListener(Listener &listener);
+
+// Keep listeners open across exec and describe them for
+// CPPSERVER_LISTEN_FDS, as "fd=address;fd=address".
+std::string inheritableListeners(std::vector<Listener> &listeners);
+
+// Close the sockets from CPPSERVER_LISTEN_FDS that no openListener call
+// took over, e.g. addresses the new program no longer listens on.
+void closeInheritedListeners();
+
+#endif /* LISTENER_H */
@@ -7,6 +7,7 @@ int main(void) {
   cppserver::TCPServer server(8080);
   Router router;
   router.GET("/", homePage);
+  router.METRICS("/metrics");
   server.Listen();
   return 0;
 }
@@ -0,0 +1,462 @@
+#include "master.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+typedef std::chrono::steady_clock Clock;
+
+// Signals the master handles, written to this pipe by onSignal.
+static int signal_pipe[2] = {-1, -1};
+
+static void onSignal(int signal) {
+  int saved = errno;
+  unsigned char byte = static_cast<unsigned char>(signal);
+  ssize_t n = write(signal_pipe[1], &byte, 1);
+  (void)n;
+  errno = saved;
+}
+
+// Write end of the pipe from CPPSERVER_READY_FD, or -1. It is marked
+// close-on-exec so that the processes this one starts do not hold it.
+static int parentReadyFd() {
+  static int fd = -1;
+  static bool parsed = false;
+  if (!parsed) {
+    parsed = true;
+    const char *value = getenv("CPPSERVER_READY_FD");
+    if (value) {
+      fd = atoi(value);
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      unsetenv("CPPSERVER_READY_FD");
+    }
+  }
+  return fd;
+}
+
+bool isWorkerProcess() { return getenv("CPPSERVER_WORKER") != nullptr; }
+
+void reportReady() {
+  int fd = parentReadyFd();
+  if (fd == -1) {
+    return;
+  }
+  char byte = 1;
+  if (write(fd, &byte, 1) == -1) {
+    perror("CPPSERVER_READY_FD");
+  }
+  close(fd);
+}
+
+// The path and arguments this program was started with.
+struct Program {
+  std::string path;
+  std::vector<std::string> args;
+};
+
+static Program currentProgram() {
+  Program program;
+  char path[PATH_MAX];
+  ssize_t n = readlink("/proc/self/exe", path, sizeof(path));
+  if (n == -1 || n == sizeof(path)) {
+    perror("/proc/self/exe");
+    exit(EXIT_FAILURE);
+  }
+  program.path.assign(path, static_cast<size_t>(n));
+  const std::string deleted = " (deleted)";
+  if (program.path.size() > deleted.size() &&
+      program.path.compare(program.path.size() - deleted.size(),
+                           deleted.size(), deleted) == 0) {
+    program.path.resize(program.path.size() - deleted.size());
+  }
+
+  int fd = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+  std::string cmdline;
+  char buffer[4096];
+  while (fd != -1 && (n = read(fd, buffer, sizeof(buffer))) > 0) {
+    cmdline.append(buffer, static_cast<size_t>(n));
+  }
+  if (fd == -1 || n == -1) {
+    perror("/proc/self/cmdline");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+
+  for (size_t pos = 0; pos < cmdline.size();) {
+    size_t end = cmdline.find('\0', pos);
+    if (end == std::string::npos) {
+      end = cmdline.size();
+    }
+    program.args.push_back(cmdline.substr(pos, end - pos));
+    pos = end + 1;
+  }
+  return program;
+}
+
+// True for the environment variables the master sets itself.
+static bool masterVariable(const char *var) {
+  static const char *const names[] = {"CPPSERVER_WORKER=",
+                                      "CPPSERVER_LISTEN_FDS=",
+                                      "CPPSERVER_READY_FD="};
+  for (const char *name : names) {
+    if (strncmp(var, name, strlen(name)) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Start program with vars added to its environment, leaving ready_fd (the
+// write end of a pipe) open for its reportReady. A worker gets SIGTERM if
+// the master dies. Returns the pid, or -1.
+static pid_t spawn(const Program &program, std::vector<std::string> vars,
+                   int ready_fd, bool worker) {
+  vars.push_back("CPPSERVER_READY_FD=" + std::to_string(ready_fd));
+  for (char **var = environ; *var; var++) {
+    if (!masterVariable(*var)) {
+      vars.push_back(*var);
+    }
+  }
+
+  std::vector<char *> argv, envp;
+  for (const std::string &arg : program.args) {
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+  for (const std::string &var : vars) {
+    envp.push_back(const_cast<char *>(var.c_str()));
+  }
+  envp.push_back(nullptr);
+
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Other threads may have held locks at the fork: only system calls
+    // until exec.
+    if (worker &&
+        (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1 || getppid() != parent)) {
+      _exit(127);
+    }
+    if (fcntl(ready_fd, F_SETFD, 0) == -1) {
+      _exit(127);
+    }
+    execve(program.path.c_str(), argv.data(), envp.data());
+    _exit(127);
+  }
+  if (pid == -1) {
+    perror("fork");
+  }
+  return pid;
+}
+
+// How a child ended, e.g. "exited with status 1".
+static std::string describeExit(int status) {
+  if (WIFSIGNALED(status)) {
+    return "was killed by signal " + std::to_string(WTERMSIG(status)) + " (" +
+           strsignal(WTERMSIG(status)) + ")";
+  }
+  return "exited with status " + std::to_string(WEXITSTATUS(status));
+}
+
+// A worker process.
+struct Worker {
+  pid_t pid;     // -1 while waiting to be restarted.
+  int ready_fd;  // Read end of its ready pipe, or -1.
+  bool ready;    // It reported that it is serving.
+  Clock::time_point since;  // Start time, or restart time if pid is -1.
+};
+
+class Master {
+public:
+  Master(std::vector<Listener> &listeners, int count)
+      : listeners(listeners), workers(static_cast<size_t>(count)),
+        program(currentProgram()), inherited(inheritableListeners(listeners)),
+        upgrade_pid(-1), upgrade_fd(-1), reported(false), stopping(false),
+        handed_over(false) {
+    for (Worker &worker : workers) {
+      worker = Worker{-1, -1, false, Clock::now()};
+    }
+  }
+
+  [[noreturn]] void Run() {
+    while (true) {
+      Clock::time_point now = Clock::now();
+      for (size_t i = 0; i < workers.size() && !stopping; i++) {
+        if (workers[i].pid == -1 && now >= workers[i].since) {
+          StartWorker(i);
+        }
+      }
+      if (upgrade_fd != -1 && now >= upgrade_deadline) {
+        fprintf(stderr, "upgrade: pid %d not serving after %d ms; stopping\n",
+                upgrade_pid, UPGRADE_TIMEOUT_MS);
+        kill(upgrade_pid, SIGTERM);
+        close(upgrade_fd);
+        upgrade_fd = -1;
+      }
+      if (stopping && !Alive()) {
+        for (Listener &listener : listeners) {
+          closeListener(listener);
+        }
+        exit(EXIT_SUCCESS);
+      }
+
+      std::vector<struct pollfd> fds;
+      fds.push_back({signal_pipe[0], POLLIN, 0});
+      for (const Worker &worker : workers) {
+        if (worker.ready_fd != -1) {
+          fds.push_back({worker.ready_fd, POLLIN, 0});
+        }
+      }
+      if (upgrade_fd != -1) {
+        fds.push_back({upgrade_fd, POLLIN, 0});
+      }
+
+      // Wake up now and then while a restart or an upgrade is due.
+      int timeout = upgrade_fd != -1 || Waiting() ? 100 : -1;
+      if (poll(fds.data(), fds.size(), timeout) == -1 && errno != EINTR) {
+        perror("poll");
+        exit(EXIT_FAILURE);
+      }
+      for (const struct pollfd &fd : fds) {
+        if (fd.revents == 0) {
+          continue;
+        }
+        if (fd.fd == signal_pipe[0]) {
+          HandleSignals();
+        } else {
+          HandleReady(fd.fd);
+        }
+      }
+    }
+  }
+
+private:
+  void StartWorker(size_t index) {
+    Worker &worker = workers[index];
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+      perror("pipe2");
+      worker.since = Clock::now() + restartDelay();
+      return;
+    }
+    worker.pid = spawn(program,
+                       {"CPPSERVER_WORKER=" + std::to_string(index),
+                        "CPPSERVER_LISTEN_FDS=" + inherited},
+                       fds[1], true);
+    close(fds[1]);
+    worker.since = Clock::now();
+    worker.ready = false;
+    worker.ready_fd = fds[0];
+    if (worker.pid == -1) {
+      close(fds[0]);
+      worker.ready_fd = -1;
+      worker.since += restartDelay();
+    }
+  }
+
+  void HandleSignals() {
+    unsigned char signals[64];
+    ssize_t n;
+    while ((n = read(signal_pipe[0], signals, sizeof(signals))) > 0) {
+      for (ssize_t i = 0; i < n; i++) {
+        switch (signals[i]) {
+        case SIGCHLD:
+          Reap();
+          break;
+        case SIGHUP:
+        case SIGUSR2:
+          StartUpgrade();
+          break;
+        default:
+          Stop(signals[i]);
+          break;
+        }
+      }
+    }
+  }
+
+  // A process reported that it is serving, or closed its pipe without.
+  void HandleReady(int fd) {
+    char byte;
+    ssize_t n = read(fd, &byte, 1);
+    if (n == -1 && errno == EAGAIN) {
+      return; // fd was closed and reused since poll.
+    }
+
+    if (fd == upgrade_fd) {
+      close(upgrade_fd);
+      upgrade_fd = -1;
+      if (n == 1) {
+        HandOver();
+      }
+      return;
+    }
+
+    for (Worker &worker : workers) {
+      if (worker.ready_fd == fd) {
+        close(fd);
+        worker.ready_fd = -1;
+        worker.ready = n == 1;
+      }
+    }
+    bool all = true;
+    for (const Worker &worker : workers) {
+      all = all && worker.ready;
+    }
+    if (all && !reported) {
+      reported = true;
+      reportReady();
+    }
+  }
+
+  void Reap() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      if (pid == upgrade_pid) {
+        upgrade_pid = -1;
+        if (!handed_over) {
+          fprintf(stderr, "upgrade: pid %d %s; still serving\n", pid,
+                  describeExit(status).c_str());
+          if (upgrade_fd != -1) {
+            close(upgrade_fd);
+            upgrade_fd = -1;
+          }
+        }
+        continue;
+      }
+
+      for (Worker &worker : workers) {
+        if (worker.pid != pid) {
+          continue;
+        }
+        Clock::time_point now = Clock::now();
+        if (!stopping) {
+          fprintf(stderr, "worker %d %s; restarting\n", pid,
+                  describeExit(status).c_str());
+        }
+        if (worker.ready_fd != -1) {
+          close(worker.ready_fd);
+          worker.ready_fd = -1;
+        }
+        worker.pid = -1;
+        worker.ready = false;
+        worker.since = now - worker.since < restartDelay()
+                           ? now + restartDelay()
+                           : now;
+      }
+    }
+  }
+
+  void StartUpgrade() {
+    if (stopping || upgrade_pid != -1) {
+      return;
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+      perror("pipe2");
+      return;
+    }
+    upgrade_pid =
+        spawn(program, {"CPPSERVER_LISTEN_FDS=" + inherited}, fds[1], false);
+    close(fds[1]);
+    if (upgrade_pid == -1) {
+      close(fds[0]);
+      return;
+    }
+    upgrade_fd = fds[0];
+    upgrade_deadline =
+        Clock::now() + std::chrono::milliseconds(UPGRADE_TIMEOUT_MS);
+    fprintf(stderr, "upgrade: started %s as pid %d\n", program.path.c_str(),
+            upgrade_pid);
+  }
+
+  // The new master is serving: let it have the sockets.
+  void HandOver() {
+    fprintf(stderr, "upgrade: pid %d is serving; stopping pid %d\n",
+            upgrade_pid, getpid());
+    handed_over = true;
+    for (Listener &listener : listeners) {
+      listener.unix_path.clear(); // The socket file is the new master's.
+    }
+    Stop(SIGQUIT);
+  }
+
+  void Stop(int signal) {
+    stopping = true;
+    for (const Worker &worker : workers) {
+      if (worker.pid != -1) {
+        kill(worker.pid, signal);
+      }
+    }
+    if (upgrade_pid != -1 && !handed_over) {
+      kill(upgrade_pid, SIGTERM);
+    }
+  }
+
+  bool Alive() const {
+    for (const Worker &worker : workers) {
+      if (worker.pid != -1) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // True if a worker waits to be restarted.
+  bool Waiting() const {
+    for (const Worker &worker : workers) {
+      if (worker.pid == -1 && !stopping) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static Clock::duration restartDelay() {
+    return std::chrono::milliseconds(WORKER_RESTART_DELAY_MS);
+  }
+
+  std::vector<Listener> &listeners;
+  std::vector<Worker> workers;
+  Program program;
+  std::string inherited; // CPPSERVER_LISTEN_FDS for started processes.
+  pid_t upgrade_pid;     // New master of an upgrade, or -1.
+  int upgrade_fd;        // Its ready pipe, or -1 once it answered.
+  Clock::time_point upgrade_deadline;
+  bool reported;    // This master reported that it is serving.
+  bool stopping;    // Workers were told to stop; none are restarted.
+  bool handed_over; // An upgrade took over the sockets.
+};
+
+void runMaster(std::vector<Listener> &listeners, int workers) {
+  parentReadyFd();
+  if (pipe2(signal_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+    perror("pipe2");
+    exit(EXIT_FAILURE);
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = onSignal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  for (int signal : {SIGCHLD, SIGHUP, SIGUSR2, SIGINT, SIGTERM, SIGQUIT}) {
+    sigaction(signal, &sa, NULL);
+  }
+
+  Master master(listeners, workers);
+  master.Run();
+}
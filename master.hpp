@@ -0,0 +1,45 @@
+#ifndef MASTER_H
+#define MASTER_H
+
+#include <vector>
+
+#include "listener.hpp"
+
+// Prefork mode. A master process owns the listening sockets and runs
+// worker processes that serve them. Each worker is the program started
+// again with CPPSERVER_WORKER set, so it builds its own threads and event
+// loop. The sockets are passed down in CPPSERVER_LISTEN_FDS (see
+// openListener). The master
+//   - restarts workers that die, waiting WORKER_RESTART_DELAY_MS first if
+//     one died right after starting;
+//   - on SIGHUP or SIGUSR2, upgrades: it starts the program again from the
+//     same path, so a new binary installed there is picked up, as a new
+//     master with the same sockets. Once the new master's workers are
+//     serving, the old workers finish (SIGQUIT) and the old master exits.
+//     If the new master fails first, the old one keeps serving;
+//   - on SIGINT, SIGTERM or SIGQUIT, passes the signal on to the workers
+//     and exits once they have.
+// Processes started this way say they are serving through the pipe in
+// CPPSERVER_READY_FD (see reportReady), so that neither a restart nor an
+// upgrade leaves the sockets without a process accepting on them.
+
+// A worker that dies sooner than this after it started is restarted only
+// after this long (milliseconds), so a crashing program is not forked in a
+// tight loop.
+#define WORKER_RESTART_DELAY_MS 1000
+
+// How long a new master may take to get its workers serving before the
+// upgrade is abandoned (milliseconds).
+#define UPGRADE_TIMEOUT_MS 30000
+
+// True if this process was started by a master as one of its workers.
+bool isWorkerProcess();
+
+// Become the master of workers worker processes serving listeners.
+// Never returns.
+[[noreturn]] void runMaster(std::vector<Listener> &listeners, int workers);
+
+// Tell the process that started this one, if any, that it is serving.
+void reportReady();
+
+#endif /* MASTER_H */
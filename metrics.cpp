@@ -0,0 +1,327 @@
+#include "metrics.hpp"
+
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+enum MetricType { CounterMetric, GaugeMetric, HistogramMetric };
+
+// Slots a series of type takes.
+static size_t slotsOf(MetricType type) {
+  return type == HistogramMetric ? HISTOGRAM_BUCKETS + 1 : 1;
+}
+
+// One thread's values. Only that thread writes them; scrapes read them.
+struct MetricsShard {
+  std::atomic<uint64_t> values[METRICS_MAX_SLOTS];
+
+  MetricsShard() {
+    for (std::atomic<uint64_t> &value : values) {
+      value.store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+struct MetricSeries {
+  std::string labels;
+  size_t slot;
+};
+
+struct MetricFamily {
+  std::string name;
+  std::string help;
+  MetricType type;
+  std::vector<MetricSeries> series;
+};
+
+struct MetricsRegistry {
+  std::mutex mutex;
+  std::vector<MetricFamily> families;
+
+  // Slots from 0 to a histogram's width take what does not fit, and are
+  // never exported.
+  size_t next_slot = HISTOGRAM_BUCKETS + 1;
+
+  std::vector<MetricsShard *> shards;  // Of running threads.
+  MetricsShard retired;                // Sums of threads that exited.
+};
+
+// Never destroyed: threads may still record while the program exits.
+static MetricsRegistry &registry() {
+  static MetricsRegistry *metrics = new MetricsRegistry;
+  return *metrics;
+}
+
+// Returns the first slot of the series, registering it if needed.
+static size_t registerSeries(const std::string &name, const std::string &help,
+                             MetricType type, const std::string &labels) {
+  MetricsRegistry &metrics = registry();
+  std::lock_guard<std::mutex> lock(metrics.mutex);
+
+  MetricFamily *family = nullptr;
+  for (MetricFamily &existing : metrics.families) {
+    if (existing.name == name) {
+      family = &existing;
+      break;
+    }
+  }
+  if (!family) {
+    metrics.families.push_back({name, help, type, {}});
+    family = &metrics.families.back();
+  } else if (family->type != type) {
+    fprintf(stderr, "metrics: %s registered with another type\n",
+            name.c_str());
+    return 0;
+  }
+
+  for (const MetricSeries &series : family->series) {
+    if (series.labels == labels) {
+      return series.slot;
+    }
+  }
+
+  size_t width = slotsOf(type);
+  if (metrics.next_slot + width > METRICS_MAX_SLOTS) {
+    fprintf(stderr, "metrics: no room for %s{%s}\n", name.c_str(),
+            labels.c_str());
+    return 0;
+  }
+  size_t slot = metrics.next_slot;
+  metrics.next_slot += width;
+  family->series.push_back({labels, slot});
+  return slot;
+}
+
+static thread_local MetricsShard *local_shard = nullptr;
+
+// Adds the calling thread's shard to the registry on first use, and its
+// values to the retired totals when the thread exits.
+struct ShardOwner {
+  MetricsShard *shard = nullptr;
+
+  ~ShardOwner() {
+    if (!shard) {
+      return;
+    }
+    MetricsRegistry &metrics = registry();
+    std::lock_guard<std::mutex> lock(metrics.mutex);
+    for (size_t i = 0; i < METRICS_MAX_SLOTS; i++) {
+      metrics.retired.values[i].fetch_add(
+          shard->values[i].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < metrics.shards.size(); i++) {
+      if (metrics.shards[i] == shard) {
+        metrics.shards.erase(metrics.shards.begin() + i);
+        break;
+      }
+    }
+    delete shard;
+    local_shard = nullptr;
+  }
+};
+
+static thread_local ShardOwner shard_owner;
+
+static MetricsShard *attachShard() {
+  MetricsShard *shard = new MetricsShard;
+  shard_owner.shard = shard;
+  MetricsRegistry &metrics = registry();
+  std::lock_guard<std::mutex> lock(metrics.mutex);
+  metrics.shards.push_back(shard);
+  local_shard = shard;
+  return shard;
+}
+
+// Add n to slot of the calling thread's shard. The owner is the only
+// writer, so a load and a store suffice.
+static inline void bump(size_t slot, uint64_t n) {
+  MetricsShard *shard = local_shard;
+  if (__builtin_expect(shard == nullptr, 0)) {
+    shard = attachShard();
+  }
+  std::atomic<uint64_t> &value = shard->values[slot];
+  value.store(value.load(std::memory_order_relaxed) + n,
+              std::memory_order_relaxed);
+}
+
+// Bucket of a duration. Buckets include their upper bound, as Prometheus'
+// le does, hence the - 1.
+static inline size_t bucketOf(uint64_t nanoseconds) {
+  uint64_t v = nanoseconds == 0 ? 0 : nanoseconds - 1;
+  if (v < (UINT64_C(1) << HISTOGRAM_MIN_SHIFT)) {
+    return 0;
+  }
+  unsigned shift = 63 - __builtin_clzll(v);
+  if (shift >= HISTOGRAM_MAX_SHIFT) {
+    return HISTOGRAM_BUCKETS - 1;
+  }
+  size_t sub = (v >> (shift - HISTOGRAM_SUB_BITS)) &
+               ((1u << HISTOGRAM_SUB_BITS) - 1);
+  return 1 + ((shift - HISTOGRAM_MIN_SHIFT) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+// Upper bound of a finite bucket, in nanoseconds.
+static uint64_t bucketBound(size_t bucket) {
+  if (bucket == 0) {
+    return UINT64_C(1) << HISTOGRAM_MIN_SHIFT;
+  }
+  size_t k = bucket - 1;
+  unsigned shift = HISTOGRAM_MIN_SHIFT + (k >> HISTOGRAM_SUB_BITS);
+  uint64_t sub = (k & ((1u << HISTOGRAM_SUB_BITS) - 1)) + 1;
+  return (UINT64_C(1) << shift) + (sub << (shift - HISTOGRAM_SUB_BITS));
+}
+
+std::string metricLabel(const std::string &name, const std::string &value) {
+  std::string label = name + "=\"";
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      label += '\\';
+      label += c;
+    } else if (c == '\n') {
+      label += "\\n";
+    } else {
+      label += c;
+    }
+  }
+  return label + "\"";
+}
+
+Counter::Counter(const std::string &name, const std::string &help,
+                 const std::string &labels)
+    : slot(registerSeries(name, help, CounterMetric, labels)) {}
+
+void Counter::Add(uint64_t n) const { bump(slot, n); }
+
+Gauge::Gauge(const std::string &name, const std::string &help,
+             const std::string &labels)
+    : slot(registerSeries(name, help, GaugeMetric, labels)) {}
+
+// Shards hold the changes made by their thread; they wrap around and sum
+// to the value.
+void Gauge::Add(int64_t delta) const {
+  bump(slot, static_cast<uint64_t>(delta));
+}
+
+Histogram::Histogram(const std::string &name, const std::string &help,
+                     const std::string &labels)
+    : slot(registerSeries(name, help, HistogramMetric, labels)) {}
+
+void Histogram::Record(uint64_t nanoseconds) const {
+  bump(slot + bucketOf(nanoseconds), 1);
+  bump(slot + HISTOGRAM_BUCKETS, nanoseconds);
+}
+
+// Not registered yet.
+#define UNKNOWN_SLOT SIZE_MAX
+
+RequestCounter::RequestCounter(const std::string &labels) : labels(labels) {
+  for (std::atomic<size_t> &slot : slots) {
+    slot.store(UNKNOWN_SLOT, std::memory_order_relaxed);
+  }
+}
+
+void RequestCounter::Add(int status) {
+  if (status < 100 || status >= 100 + METRICS_STATUS_CODES) {
+    return;
+  }
+  std::atomic<size_t> &known = slots[status - 100];
+  size_t slot = known.load(std::memory_order_relaxed);
+  if (__builtin_expect(slot == UNKNOWN_SLOT, 0)) {
+    std::string code = metricLabel("code", std::to_string(status));
+    slot = registerSeries("cppserver_requests_total",
+                          "Requests answered, by route and status code.",
+                          CounterMetric,
+                          labels.empty() ? code : labels + "," + code);
+    known.store(slot, std::memory_order_relaxed);
+  }
+  bump(slot, 1);
+}
+
+RequestCounter &unroutedRequests() {
+  static RequestCounter *requests = new RequestCounter("");
+  return *requests;
+}
+
+static thread_local int response_status = 0;
+
+void noteResponseStatus(int status) { response_status = status; }
+
+int takeResponseStatus() {
+  int status = response_status;
+  response_status = 0;
+  return status;
+}
+
+// Value of slot summed over the threads. Called with the registry locked.
+static uint64_t total(const MetricsRegistry &metrics, size_t slot) {
+  uint64_t sum = metrics.retired.values[slot].load(std::memory_order_relaxed);
+  for (const MetricsShard *shard : metrics.shards) {
+    sum += shard->values[slot].load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+// name{labels} value, with extra appended to the labels.
+static void appendSample(std::string &out, const std::string &name,
+                         const std::string &labels, const std::string &extra,
+                         const char *value) {
+  out += name;
+  if (!labels.empty() || !extra.empty()) {
+    out += "{" + labels;
+    out += labels.empty() || extra.empty() ? "" : ",";
+    out += extra + "}";
+  }
+  out += " ";
+  out += value;
+  out += "\n";
+}
+
+std::string formatMetrics() {
+  static const char *types[] = {"counter", "gauge", "histogram"};
+  MetricsRegistry &metrics = registry();
+  std::lock_guard<std::mutex> lock(metrics.mutex);
+
+  std::string out;
+  char value[32];
+  for (const MetricFamily &family : metrics.families) {
+    out += "# HELP " + family.name + " " + family.help + "\n";
+    out += "# TYPE " + family.name + " " + types[family.type] + "\n";
+
+    for (const MetricSeries &series : family.series) {
+      if (family.type == CounterMetric) {
+        snprintf(value, sizeof(value), "%" PRIu64,
+                 total(metrics, series.slot));
+        appendSample(out, family.name, series.labels, "", value);
+        continue;
+      }
+      if (family.type == GaugeMetric) {
+        snprintf(value, sizeof(value), "%" PRId64,
+                 static_cast<int64_t>(total(metrics, series.slot)));
+        appendSample(out, family.name, series.labels, "", value);
+        continue;
+      }
+
+      uint64_t count = 0;
+      for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        count += total(metrics, series.slot + bucket);
+        char bound[32];
+        if (bucket == HISTOGRAM_BUCKETS - 1) {
+          snprintf(bound, sizeof(bound), "+Inf");
+        } else {
+          snprintf(bound, sizeof(bound), "%.6g", bucketBound(bucket) / 1e9);
+        }
+        snprintf(value, sizeof(value), "%" PRIu64, count);
+        appendSample(out, family.name + "_bucket", series.labels,
+                     metricLabel("le", bound), value);
+      }
+      snprintf(value, sizeof(value), "%.9f",
+               total(metrics, series.slot + HISTOGRAM_BUCKETS) / 1e9);
+      appendSample(out, family.name + "_sum", series.labels, "", value);
+      snprintf(value, sizeof(value), "%" PRIu64, count);
+      appendSample(out, family.name + "_count", series.labels, "", value);
+    }
+  }
+  return out;
+}
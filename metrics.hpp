@@ -0,0 +1,107 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Server metrics, in the Prometheus text format (see formatMetrics and
+// Router::METRICS). Every thread records into its own shard of values with
+// plain loads and stores, so recording takes no lock and no atomic
+// read-modify-write and costs a few nanoseconds. A scrape sums the shards;
+// the shards of threads that exit are added to a shared total first. Each
+// process has its own metrics: with worker processes, a scrape sees the
+// worker that accepted it.
+
+// Values of all series in a shard. Series registered once the slots are
+// used up are not recorded.
+#define METRICS_MAX_SLOTS 8192
+
+// Histogram buckets are log-linear, like HDR histograms: the first ends at
+// 2^HISTOGRAM_MIN_SHIFT ns (1 µs), then each doubling up to
+// 2^HISTOGRAM_MAX_SHIFT ns (69 s) is split into 2^HISTOGRAM_SUB_BITS
+// buckets, so a bucket is at most 25% wide; the last bucket is +Inf.
+#define HISTOGRAM_MIN_SHIFT 10
+#define HISTOGRAM_MAX_SHIFT 36
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_BUCKETS                                                    \
+  (2 + ((HISTOGRAM_MAX_SHIFT - HISTOGRAM_MIN_SHIFT) << HISTOGRAM_SUB_BITS))
+
+// Status codes counted separately by RequestCounter (100-599).
+#define METRICS_STATUS_CODES 500
+
+// Monotonic time in nanoseconds, for durations.
+inline uint64_t metricsNow() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// name="value", with value escaped, for the labels arguments below.
+std::string metricLabel(const std::string &name, const std::string &value);
+
+// A count that only goes up. Series are identified by name and labels (a
+// comma-separated list of metricLabel); constructing one that exists
+// records into it too.
+class Counter {
+  size_t slot;
+
+ public:
+  Counter(const std::string &name, const std::string &help,
+          const std::string &labels = "");
+  void Add(uint64_t n = 1) const;
+};
+
+// A value that goes up and down, e.g. open connections.
+class Gauge {
+  size_t slot;
+
+ public:
+  Gauge(const std::string &name, const std::string &help,
+        const std::string &labels = "");
+  void Add(int64_t delta) const;
+};
+
+// A distribution of durations, exported in seconds.
+class Histogram {
+  size_t slot;  // First bucket; the sum follows the buckets.
+
+ public:
+  Histogram(const std::string &name, const std::string &help,
+            const std::string &labels = "");
+  void Record(uint64_t nanoseconds) const;
+
+  // Record the time since start (from metricsNow).
+  void RecordSince(uint64_t start) const { Record(metricsNow() - start); }
+};
+
+// Requests answered with the given labels (e.g. of a route), counted by
+// status code in cppserver_requests_total. A code's series is registered
+// when it is first counted.
+class RequestCounter {
+  std::string labels;
+  std::atomic<size_t> slots[METRICS_STATUS_CODES];  // Per code, once known.
+
+ public:
+  explicit RequestCounter(const std::string &labels);
+  RequestCounter(const RequestCounter &) = delete;
+  RequestCounter &operator=(const RequestCounter &) = delete;
+
+  void Add(int status);
+};
+
+// Requests answered before a route was found (bad requests, 404).
+RequestCounter &unroutedRequests();
+
+// Remember the status of the response head the calling thread writes, so
+// that the request can be counted once its handler returns.
+void noteResponseStatus(int status);
+
+// The status noted since the last call, or 0 if none.
+int takeResponseStatus();
+
+// All series in the Prometheus text exposition format (version 0.0.4).
+std::string formatMetrics();
+
+#endif /* METRICS_H */
@@ -1,11 +1,21 @@
 #include "mime.hpp"
-#include <cstring>
-#include <iostream>
-#include <unordered_map>
-
-typedef std::unordered_map<std::string, std::string> mimeMap;
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+struct MimeEntry {
+  std::string_view extension;
+  std::string_view type;
+};
 
-static mimeMap contextTypes = {
+// Built-in extension to content-type table. Extensions must be lowercase and
+// unique; both are checked at compile time below.
+constexpr MimeEntry mimeTypes[] = {
     {"html", "text/html"},
     {"htm", "text/html"},
     {"xhtml", "application/xhtml+xml"},
@@ -17,7 +27,6 @@ static mimeMap contextTypes = {
     {"css", "text/css"},
     {"js", "application/javascript"},
     {"txt", "text/plain"},
-    {"xml", "application/xml"},
     {"json", "application/json"},
     {"csv", "text/csv"},
     {"md", "text/markdown"},
@@ -101,8 +110,6 @@ static mimeMap contextTypes = {
     {"xz", "application/x-xz"},
 
     // Spreadsheets
-    {"ods", "application/vnd.oasis.opendocument.spreadsheet"},
-    {"csv", "text/csv"},
     {"tsv", "text/tab-separated-values"},
 
     // Applications
@@ -162,7 +169,6 @@ static mimeMap contextTypes = {
     {"bat", "application/x-msdownload"},
     {"com", "application/x-msdownload"},
     {"dll", "application/x-msdownload"},
-    {"exe", "application/x-msdownload"},
     {"msi", "application/x-msdownload"},
     {"m13", "application/x-msmediaview"},
     {"m14", "application/x-msmediaview"},
@@ -184,7 +190,6 @@ static mimeMap contextTypes = {
     // Mathematical Data
     {"m", "text/x-matlab"},
     {"r", "application/R"},
-    {"csv", "text/csv"},
 
     // Chemical Data
     {"mol", "chemical/x-mdl-molfile"},
@@ -194,7 +199,6 @@ static mimeMap contextTypes = {
 
     // Configuration Files
     {"yml", "application/x-yaml"},
-    {"yaml", "application/x-yaml"},
     {"jsonld", "application/ld+json"},
 
     // Scientific Data
@@ -202,24 +206,269 @@ static mimeMap contextTypes = {
     {"fits", "application/fits"},
 };
 
-std::string getContentType(std::string filename) {
-  // Get the file extension
-  // Could use c++ 17 filesystem.
-  char *ptr, *start = filename.data(), *last = NULL;
-  while ((ptr = strstr(start, "."))) {
-    last = ptr;
-    start++;
+constexpr size_t numMimeTypes = sizeof(mimeTypes) / sizeof(mimeTypes[0]);
+
+// Perfect hash parameters. The table is kept at less than half load so that
+// a displacement seed is found quickly for every bucket.
+constexpr size_t hashTableSize = 512; // must be a power of 2
+constexpr size_t hashBuckets = 64;    // must be a power of 2
+constexpr size_t maxBucketSize = 16;
+
+constexpr char asciiLower(char c) {
+  return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+constexpr bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    if (asciiLower(a[i]) != asciiLower(b[i])) {
+      return false;
+    }
   }
+  return true;
+}
 
-  // No extension.
-  if (last == NULL) {
-    return "application/octet-stream";
+// Case-insensitive FNV-1a, salted with seed and finalized with a murmur-style
+// mix so that nearby seeds give unrelated slots.
+constexpr uint32_t hashExtension(std::string_view ext, uint32_t seed) {
+  uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+  for (char c : ext) {
+    h ^= static_cast<unsigned char>(asciiLower(c));
+    h *= 16777619u;
   }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
 
-  const std::string extension = last + 1; // skip "."
-  for (const auto &[key, value] : contextTypes)
-    if (key == extension)
-      return value;
+// Hash-and-displace perfect hash: keys are grouped into buckets by their
+// unseeded hash, then each bucket (largest first) searches for a seed that
+// places all of its keys into free slots.
+struct PerfectHash {
+  std::array<uint16_t, hashBuckets> seeds{};
+  std::array<int16_t, hashTableSize> slots{};
+  bool ok = false;
+};
 
-  return "application/octet-stream";
+constexpr size_t bucketOf(std::string_view ext) {
+  return hashExtension(ext, 0) & (hashBuckets - 1);
+}
+
+constexpr size_t slotOf(std::string_view ext, uint32_t seed) {
+  return hashExtension(ext, seed) & (hashTableSize - 1);
+}
+
+constexpr bool validateMimeTypes() {
+  for (size_t i = 0; i < numMimeTypes; i++) {
+    for (char c : mimeTypes[i].extension) {
+      if (c != asciiLower(c)) {
+        return false;
+      }
+    }
+    for (size_t j = i + 1; j < numMimeTypes; j++) {
+      if (equalsIgnoreCase(mimeTypes[i].extension, mimeTypes[j].extension)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+constexpr PerfectHash buildPerfectHash() {
+  PerfectHash ph{};
+  for (auto &slot : ph.slots) {
+    slot = -1;
+  }
+
+  std::array<size_t, hashBuckets> sizes{};
+  for (size_t i = 0; i < numMimeTypes; i++) {
+    sizes[bucketOf(mimeTypes[i].extension)]++;
+  }
+
+  // Order buckets by decreasing size (selection sort; tiny array).
+  std::array<size_t, hashBuckets> order{};
+  for (size_t i = 0; i < hashBuckets; i++) {
+    order[i] = i;
+  }
+  for (size_t i = 0; i < hashBuckets; i++) {
+    size_t best = i;
+    for (size_t j = i + 1; j < hashBuckets; j++) {
+      if (sizes[order[j]] > sizes[order[best]]) {
+        best = j;
+      }
+    }
+    size_t tmp = order[i];
+    order[i] = order[best];
+    order[best] = tmp;
+  }
+
+  for (size_t b : order) {
+    if (sizes[b] == 0) {
+      break;
+    }
+    if (sizes[b] > maxBucketSize) {
+      return ph;
+    }
+
+    bool placed = false;
+    for (uint32_t seed = 1; seed < 0xffff && !placed; seed++) {
+      std::array<size_t, maxBucketSize> keys{};
+      std::array<size_t, maxBucketSize> targets{};
+      size_t n = 0;
+      bool fits = true;
+
+      for (size_t i = 0; i < numMimeTypes && fits; i++) {
+        if (bucketOf(mimeTypes[i].extension) != b) {
+          continue;
+        }
+        size_t slot = slotOf(mimeTypes[i].extension, seed);
+        if (ph.slots[slot] != -1) {
+          fits = false;
+        }
+        for (size_t k = 0; k < n && fits; k++) {
+          if (targets[k] == slot) {
+            fits = false;
+          }
+        }
+        keys[n] = i;
+        targets[n] = slot;
+        n++;
+      }
+
+      if (fits) {
+        for (size_t k = 0; k < n; k++) {
+          ph.slots[targets[k]] = static_cast<int16_t>(keys[k]);
+        }
+        ph.seeds[b] = static_cast<uint16_t>(seed);
+        placed = true;
+      }
+    }
+
+    if (!placed) {
+      return ph;
+    }
+  }
+
+  ph.ok = true;
+  return ph;
+}
+
+static_assert(validateMimeTypes(),
+              "mime extensions must be lowercase and unique");
+
+constexpr PerfectHash mimeHash = buildPerfectHash();
+static_assert(mimeHash.ok, "failed to build perfect hash for mime types");
+
+// Types added with registerContentType, sorted by lowercase extension.
+std::vector<std::pair<std::string, std::string>> extraTypes;
+
+bool extensionLess(std::string_view a, std::string_view b) {
+  size_t n = std::min(a.size(), b.size());
+  for (size_t i = 0; i < n; i++) {
+    char ca = asciiLower(a[i]);
+    char cb = asciiLower(b[i]);
+    if (ca != cb) {
+      return ca < cb;
+    }
+  }
+  return a.size() < b.size();
+}
+
+} // namespace
+
+void registerContentType(std::string_view extension, std::string_view type) {
+  if (!extension.empty() && extension.front() == '.') {
+    extension.remove_prefix(1);
+  }
+
+  std::string ext(extension);
+  std::transform(ext.begin(), ext.end(), ext.begin(), asciiLower);
+
+  auto it = std::lower_bound(
+      extraTypes.begin(), extraTypes.end(), ext,
+      [](const auto &entry, const std::string &key) {
+        return extensionLess(entry.first, key);
+      });
+
+  if (it != extraTypes.end() && it->first == ext) {
+    it->second = type;
+  } else {
+    extraTypes.emplace(it, std::move(ext), std::string(type));
+  }
+}
+
+std::string_view getContentType(std::string_view filename) {
+  // Get the file extension, ignoring dots in directory components.
+  size_t dot = filename.rfind('.');
+  if (dot == std::string_view::npos) {
+    return defaultContentType;
+  }
+
+  size_t slash = filename.rfind('/');
+  if (slash != std::string_view::npos && slash > dot) {
+    return defaultContentType;
+  }
+
+  std::string_view extension = filename.substr(dot + 1);
+
+  if (!extraTypes.empty()) {
+    auto it = std::lower_bound(
+        extraTypes.begin(), extraTypes.end(), extension,
+        [](const auto &entry, std::string_view key) {
+          return extensionLess(entry.first, key);
+        });
+    if (it != extraTypes.end() && equalsIgnoreCase(it->first, extension)) {
+      return it->second;
+    }
+  }
+
+  size_t bucket = bucketOf(extension);
+  int16_t index = mimeHash.slots[slotOf(extension, mimeHash.seeds[bucket])];
+  if (index >= 0 && equalsIgnoreCase(mimeTypes[index].extension, extension)) {
+    return mimeTypes[index].type;
+  }
+
+  return defaultContentType;
+}
+
+bool isCompressibleType(std::string_view type) {
+  // Ignore parameters such as "; charset=utf-8".
+  size_t semicolon = type.find(';');
+  if (semicolon != std::string_view::npos) {
+    type = type.substr(0, semicolon);
+  }
+
+  static constexpr std::string_view compressible[] = {
+      "application/javascript", "application/json",
+      "application/xml",        "application/wasm",
+      "application/x-yaml",     "application/sql",
+      "application/rss+xml",    "application/xhtml+xml",
+      "application/x-latex",    "image/svg+xml",
+      "image/bmp",              "font/ttf",
+      "font/otf",               "model/obj",
+      "model/stl",
+  };
+
+  if (type.size() > 5 && equalsIgnoreCase(type.substr(0, 5), "text/")) {
+    return true;
+  }
+
+  for (std::string_view suffix : {"+json", "+xml"}) {
+    if (type.size() > suffix.size() &&
+        equalsIgnoreCase(type.substr(type.size() - suffix.size()), suffix)) {
+      return true;
+    }
+  }
+
+  for (std::string_view candidate : compressible) {
+    if (equalsIgnoreCase(type, candidate)) {
+      return true;
+    }
+  }
+  return false;
 }
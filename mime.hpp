@@ -1,7 +1,21 @@
 #ifndef CONTENT_TYPE_H
 #define CONTENT_TYPE_H
-#include <string>
+#include <string_view>
 
-std::string getContentType(std::string filename);
+// Content-Type used when the extension is missing or unknown.
+constexpr std::string_view defaultContentType = "application/octet-stream";
+
+// Returns the content type for filename based on its extension.
+// Lookup is case-insensitive and does not allocate. The returned view points
+// to static storage (or to a type added with registerContentType).
+std::string_view getContentType(std::string_view filename);
+
+// Register an extra extension (with or without the leading '.') or override
+// a built-in one. Must be called at startup, before the server is listening.
+void registerContentType(std::string_view extension, std::string_view type);
+
+// Returns true for content types that usually shrink when compressed
+// (text, JavaScript, JSON, XML, SVG, uncompressed fonts, ...).
+bool isCompressibleType(std::string_view type);
 
 #endif /* CONTENT_TYPE_H */
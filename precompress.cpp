@@ -0,0 +1,200 @@
+#include "precompress.hpp"
+
+#include <filesystem>
+
+#include "compression.hpp"
+#include "fileinfo.hpp"
+#include "mime.hpp"
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/stat.h>
+}
+
+namespace fs = std::filesystem;
+
+static std::string stripTrailingSlash(std::string path) {
+  while (path.size() > 1 && path.back() == '/') {
+    path.pop_back();
+  }
+  return path;
+}
+
+PrecompressedCache::PrecompressedCache(const std::string &root,
+                                       const PrecompressOptions &options)
+    : root(stripTrailingSlash(root)), options(options), stop(false),
+      rescan_requested(false) {
+  if (this->options.cache_dir.empty()) {
+    this->options.cache_dir = this->root + "/.precompressed";
+  }
+  this->options.cache_dir = stripTrailingSlash(this->options.cache_dir);
+
+  std::error_code ec;
+  fs::create_directories(this->options.cache_dir, ec);
+  if (ec) {
+    std::cerr << "precompress: cannot create " << this->options.cache_dir
+              << ": " << ec.message() << std::endl;
+  }
+
+  Scan();
+  scanner = std::thread(&PrecompressedCache::ScanLoop, this);
+}
+
+PrecompressedCache::~PrecompressedCache() {
+  {
+    std::lock_guard<std::mutex> lock(scan_mutex);
+    stop = true;
+  }
+  scan_condition.notify_all();
+  if (scanner.joinable()) {
+    scanner.join();
+  }
+}
+
+std::string PrecompressedCache::VariantPath(const std::string &relpath,
+                                            std::string_view encoding) const {
+  return options.cache_dir + relpath + std::string(encodingSuffix(encoding));
+}
+
+bool PrecompressedCache::IsCachePath(std::string_view path) const {
+  const std::string &dir = options.cache_dir;
+  return path.compare(0, dir.size(), dir) == 0 &&
+         (path.size() == dir.size() || path[dir.size()] == '/');
+}
+
+void PrecompressedCache::Scan() {
+  std::unordered_map<std::string, Entry> found;
+  std::error_code ec;
+  auto it = fs::recursive_directory_iterator(
+      root, fs::directory_options::skip_permission_denied, ec);
+
+  for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    std::string path = it->path().string();
+
+    if (IsCachePath(path)) {
+      it.disable_recursion_pending();
+      continue;
+    }
+
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    if (st.st_size < options.min_size || st.st_size > options.max_size ||
+        !isCompressibleType(getContentType(path))) {
+      continue;
+    }
+
+    std::string relpath = path.substr(root.size());
+    Entry entry{st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size, {}};
+
+    for (std::string_view encoding : supportedEncodings) {
+      std::string variant = VariantPath(relpath, encoding);
+
+      // Variants carry their source's mtime, so equal mtimes mean fresh.
+      struct stat vst;
+      bool fresh = stat(variant.c_str(), &vst) == 0 &&
+                   vst.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+                   vst.st_mtim.tv_nsec == st.st_mtim.tv_nsec;
+
+      if (!fresh) {
+        int level = encoding == "zstd" ? options.zstd_level : options.gzip_level;
+        fs::create_directories(fs::path(variant).parent_path(), ec);
+        ec.clear();
+
+        if (!compressFile(encoding, path, variant, level)) {
+          std::cerr << "precompress: failed to compress " << path << std::endl;
+          continue;
+        }
+
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        utimensat(AT_FDCWD, variant.c_str(), times, 0);
+        if (stat(variant.c_str(), &vst) == -1) {
+          continue;
+        }
+      }
+
+      // Only keep variants that are actually smaller.
+      if (vst.st_size < st.st_size) {
+        entry.encodings.push_back(encoding);
+      }
+    }
+
+    if (!entry.encodings.empty()) {
+      found.emplace(std::move(relpath), std::move(entry));
+    }
+  }
+
+  std::unique_lock<std::shared_mutex> lock(entries_mutex);
+  entries.swap(found);
+}
+
+bool PrecompressedCache::Select(const std::string &path,
+                                std::string_view accept_encoding,
+                                PrecompressedVariant &variant) {
+  if (path.compare(0, root.size(), root) != 0) {
+    return false;
+  }
+  std::string relpath = path.substr(root.size());
+
+  Entry entry;
+  {
+    std::shared_lock<std::shared_mutex> lock(entries_mutex);
+    auto it = entries.find(relpath);
+    if (it == entries.end()) {
+      return false;
+    }
+    entry = it->second;
+  }
+
+  std::string_view encoding =
+      negotiateEncoding(accept_encoding, entry.encodings);
+  if (encoding.empty()) {
+    return false;
+  }
+
+  // The source changed since the variant was built: serve it as is and let
+  // the scanner rebuild.
+  std::shared_ptr<const FileInfo> info = lookupFileInfo(path);
+  if (!info || info->size != entry.size || info->mtime != entry.mtime ||
+      info->mtime_nsec != entry.mtime_nsec) {
+    RequestRescan();
+    return false;
+  }
+
+  variant.path = VariantPath(relpath, encoding);
+  variant.encoding = encoding;
+  return true;
+}
+
+void PrecompressedCache::RequestRescan() {
+  {
+    std::lock_guard<std::mutex> lock(scan_mutex);
+    rescan_requested = true;
+  }
+  scan_condition.notify_one();
+}
+
+void PrecompressedCache::ScanLoop() {
+  std::unique_lock<std::mutex> lock(scan_mutex);
+  auto wake = [this] { return stop || rescan_requested; };
+
+  while (!stop) {
+    if (options.rescan_interval > 0) {
+      scan_condition.wait_for(
+          lock, std::chrono::seconds(options.rescan_interval), wake);
+    } else {
+      scan_condition.wait(lock, wake);
+    }
+
+    if (stop) {
+      break;
+    }
+    rescan_requested = false;
+
+    lock.unlock();
+    Scan();
+    lock.lock();
+  }
+}
@@ -0,0 +1,89 @@
+#ifndef PRECOMPRESS_H
+#define PRECOMPRESS_H
+
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <condition_variable>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Options for building precompressed variants of a static directory.
+struct PrecompressOptions {
+  std::string cache_dir;         // Sidecar directory ("<dir>/.precompressed"
+                                 // if empty). Never served directly.
+  off64_t min_size = 256;        // Smaller files are served as is.
+  off64_t max_size = 64ll << 20; // Larger files are served as is.
+  int gzip_level = 9;
+  int zstd_level = 19;
+  unsigned rescan_interval = 60; // Seconds between rescans (0 = startup only).
+};
+
+// A compressed variant chosen for a request.
+struct PrecompressedVariant {
+  std::string path;          // Path of the compressed file.
+  std::string_view encoding; // Content-Encoding value.
+};
+
+// Builds and tracks precompressed (.gz, .zst) copies of the compressible
+// files under a static directory.
+//
+// The directory is scanned at construction and then by a background thread
+// every rescan_interval seconds, or sooner when Select notices that a source
+// file changed. Variants are only used while their source file still has
+// the size and mtime they were built from.
+class PrecompressedCache {
+ public:
+  PrecompressedCache(const std::string &root, const PrecompressOptions &options);
+  ~PrecompressedCache();
+
+  PrecompressedCache(const PrecompressedCache &) = delete;
+  PrecompressedCache &operator=(const PrecompressedCache &) = delete;
+
+  // Choose a variant of the file at path (under root) for an
+  // Accept-Encoding value. Returns false if the file should be served as is.
+  bool Select(const std::string &path, std::string_view accept_encoding,
+              PrecompressedVariant &variant);
+
+  // Returns true if path lies inside the sidecar cache directory.
+  bool IsCachePath(std::string_view path) const;
+
+  // Scan the directory and rebuild stale or missing variants.
+  void Scan();
+
+ private:
+  struct Entry {
+    time_t mtime;                          // Source mtime when built.
+    long mtime_nsec;                       // Nanoseconds of source mtime.
+    off64_t size;                          // Source size when built.
+    std::vector<std::string_view> encodings; // Variants that exist.
+  };
+
+  std::string root;
+  PrecompressOptions options;
+  std::shared_mutex entries_mutex;
+  std::unordered_map<std::string, Entry> entries; // Keyed by relpath.
+
+  std::mutex scan_mutex;
+  std::condition_variable scan_condition;
+  bool stop;
+  bool rescan_requested;
+  std::thread scanner;
+
+  void ScanLoop();
+  void RequestRescan();
+  std::string VariantPath(const std::string &relpath,
+                          std::string_view encoding) const;
+};
+
+#endif /* PRECOMPRESS_H */
@@ -0,0 +1,153 @@
+#include "range.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+
+static void trimSpace(std::string_view &s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+}
+
+// Parse a non-empty string of digits. Returns false on overflow or if s
+// contains anything else.
+static bool parsePosition(std::string_view s, off64_t &value) {
+  if (s.empty()) {
+    return false;
+  }
+
+  value = 0;
+  for (char c : s) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    if (value > (INT64_MAX - (c - '0')) / 10) {
+      return false;
+    }
+    value = value * 10 + (c - '0');
+  }
+  return true;
+}
+
+static bool startsWithBytesUnit(std::string_view s) {
+  static constexpr std::string_view unit = "bytes=";
+  if (s.size() < unit.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < unit.size(); i++) {
+    if (std::tolower(static_cast<unsigned char>(s[i])) != unit[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+RangeResult parseRangeHeader(std::string_view header, off64_t size,
+                             std::vector<ByteRange> &ranges,
+                             off64_t coalesce_gap) {
+  ranges.clear();
+  trimSpace(header);
+  if (!startsWithBytesUnit(header)) {
+    return RangeResult::Ignored;
+  }
+  header.remove_prefix(6);
+
+  size_t count = 0;
+  size_t pos = 0;
+  while (pos <= header.size()) {
+    size_t comma = header.find(',', pos);
+    if (comma == std::string_view::npos) {
+      comma = header.size();
+    }
+
+    std::string_view spec = header.substr(pos, comma - pos);
+    pos = comma + 1;
+    trimSpace(spec);
+
+    // Empty list elements are allowed by the #rule syntax.
+    if (spec.empty()) {
+      continue;
+    }
+
+    if (++count > MAX_BYTE_RANGES) {
+      ranges.clear();
+      return RangeResult::Ignored;
+    }
+
+    size_t dash = spec.find('-');
+    if (dash == std::string_view::npos) {
+      ranges.clear();
+      return RangeResult::Ignored;
+    }
+
+    std::string_view first = spec.substr(0, dash);
+    std::string_view last = spec.substr(dash + 1);
+    off64_t start, end;
+    bool open_ended = false;
+
+    if (first.empty()) {
+      // Suffix range: the last N bytes.
+      off64_t suffix;
+      if (!parsePosition(last, suffix)) {
+        ranges.clear();
+        return RangeResult::Ignored;
+      }
+      if (suffix == 0 || size == 0) {
+        continue;
+      }
+      start = suffix >= size ? 0 : size - suffix;
+      end = size - 1;
+    } else {
+      if (!parsePosition(first, start)) {
+        ranges.clear();
+        return RangeResult::Ignored;
+      }
+
+      if (last.empty()) {
+        end = size - 1;
+        open_ended = true;
+      } else if (!parsePosition(last, end) || end < start) {
+        ranges.clear();
+        return RangeResult::Ignored;
+      }
+
+      if (start >= size) {
+        continue;
+      }
+      end = std::min(end, size - 1);
+    }
+
+    ranges.push_back(ByteRange{start, end, open_ended});
+  }
+
+  if (count == 0) {
+    return RangeResult::Ignored;
+  }
+
+  if (ranges.empty()) {
+    return RangeResult::Unsatisfiable;
+  }
+
+  // Coalesce overlapping and nearby ranges.
+  std::sort(ranges.begin(), ranges.end(),
+            [](const ByteRange &a, const ByteRange &b) {
+              return a.start < b.start;
+            });
+
+  size_t out = 0;
+  for (size_t i = 1; i < ranges.size(); i++) {
+    if (ranges[i].start <= ranges[out].end + 1 + coalesce_gap) {
+      ranges[out].end = std::max(ranges[out].end, ranges[i].end);
+      ranges[out].open_ended = ranges[out].open_ended || ranges[i].open_ended;
+    } else {
+      ranges[++out] = ranges[i];
+    }
+  }
+  ranges.resize(out + 1);
+
+  return RangeResult::Satisfiable;
+}
@@ -0,0 +1,43 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+
+// Maximum number of ranges accepted in a single Range header. Requests with
+// more are served in full, as allowed by RFC 7233 section 3.1.
+#define MAX_BYTE_RANGES 64
+
+// Ranges closer than this many bytes are merged into one part, since the
+// multipart headers between them would cost about as much as the gap.
+#define RANGE_COALESCE_GAP 80
+
+// An inclusive byte range within a representation.
+struct ByteRange {
+  off64_t start; // First byte position.
+  off64_t end;   // Last byte position (inclusive).
+  bool open_ended = false; // Client asked for "start-" (to the end).
+
+  off64_t length() const { return end - start + 1; }
+};
+
+enum class RangeResult {
+  Ignored,       // No usable Range header; send the full representation.
+  Satisfiable,   // At least one range overlaps the representation.
+  Unsatisfiable, // Valid header, but no range overlaps; send 416.
+};
+
+// Parse a Range header value (e.g. "bytes=0-99,500-,-200") against a
+// representation of the given size. Satisfiable ranges are clamped, sorted
+// and coalesced into ranges (RFC 7233 sections 2.1 and 4.1).
+RangeResult parseRangeHeader(std::string_view header, off64_t size,
+                             std::vector<ByteRange> &ranges,
+                             off64_t coalesce_gap = RANGE_COALESCE_GAP);
+
+#endif /* RANGE_H */
@@ -1,6 +1,9 @@
 #include "request.hpp"
+#include <algorithm>
+#include <cstdint>
 #include <sstream>
 #include <string>
+#include <string_view>
 
 const std::string LF = "\r\n";
 const std::string DOUBLE_LF = "\r\n\r\n";
@@ -10,17 +13,119 @@ Request::Request() {
   body = "";
   headers.reserve(20);
   method = HttpMethod::INVALID;
+  header_start_pos = 0;
+  header_end_pos = 0;
+  content_length = 0;
 }
 
-void Request::ParseHttp(const std::string &req_data) {
+size_t Request::ParseHttp(const std::string &req_data, size_t start) {
   try {
-    ParseMethodAndPath(req_data);
-    ParseHeaders(req_data);
+    ParseMethodAndPath(req_data, start);
+    ParseHeaders(req_data, start);
     headers.shrink_to_fit();
     ParseBody(req_data);
   } catch (...) {
     throw;
   }
+  return header_end_pos + DOUBLE_LF.size() + content_length - start;
+}
+
+// Parses a Content-Length value: digits between optional blanks, without
+// sign and without overflow. Returns false for anything else.
+static bool parseContentLength(std::string_view value, size_t &length) {
+  while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+    value.remove_prefix(1);
+  }
+  while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+    value.remove_suffix(1);
+  }
+  if (value.empty()) {
+    return false;
+  }
+
+  size_t n = 0;
+  for (char c : value) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    size_t digit = static_cast<size_t>(c - '0');
+    if (n > (SIZE_MAX - digit) / 10) {
+      return false;
+    }
+    n = n * 10 + digit;
+  }
+  length = n;
+  return true;
+}
+
+// Sets length to the value of a Content-Length header, checking that it
+// agrees with the ones seen before (found says whether there were any).
+static void addContentLength(std::string_view value, bool &found,
+                             size_t &length) {
+  size_t n;
+  if (!parseContentLength(value, n)) {
+    throw RequestError(StatusBadRequest, "Invalid Content-Length");
+  }
+  if (found && n != length) {
+    throw RequestError(StatusBadRequest, "Conflicting Content-Length");
+  }
+  found = true;
+  length = n;
+}
+
+// Returns the value of line if it is a header called name (lower case).
+static bool headerValue(std::string_view line, std::string_view name,
+                        std::string_view &value) {
+  if (line.size() <= name.size() || line[name.size()] != ':') {
+    return false;
+  }
+  for (size_t i = 0; i < name.size(); i++) {
+    if (std::tolower(static_cast<unsigned char>(line[i])) != name[i]) {
+      return false;
+    }
+  }
+  value = line.substr(name.size() + 1);
+  return true;
+}
+
+size_t completeRequestLength(const std::string &data, size_t start) {
+  size_t header_end = data.find(DOUBLE_LF, start);
+  if (header_end == std::string::npos ||
+      header_end - start > MAX_REQUEST_HEADER_SIZE) {
+    if (data.size() - start > MAX_REQUEST_HEADER_SIZE) {
+      throw RequestError(StatusRequestHeaderFieldsTooLarge,
+                         "Request header too large");
+    }
+    return 0;
+  }
+
+  // The body is framed by Content-Length, so that is checked strictly:
+  // a length read differently here and by the parser would let a request
+  // hide another in its body. Chunked bodies are not decoded, so requests
+  // with a Transfer-Encoding are refused rather than misread.
+  bool found = false;
+  size_t content_length = 0;
+  size_t line = data.find(LF, start);
+  while (line != std::string::npos && line < header_end) {
+    line += LF.size();
+    size_t end = data.find(LF, line);
+    std::string_view value;
+    if (headerValue(std::string_view(data).substr(line, end - line),
+                    "content-length", value)) {
+      addContentLength(value, found, content_length);
+    } else if (headerValue(std::string_view(data).substr(line, end - line),
+                           "transfer-encoding", value)) {
+      throw RequestError(StatusNotImplemented,
+                         "Transfer-Encoding not supported");
+    }
+    line = end;
+  }
+
+  if (content_length > MAX_REQUEST_BODY_SIZE) {
+    throw RequestError(StatusRequestEntityTooLarge, "Request body too large");
+  }
+  size_t length = header_end + DOUBLE_LF.size() + content_length - start;
+  return start + length <= data.size() ? length : 0;
 }
 
 bool Request::caseInsensitiveStringCompare(const std::string &str1,
@@ -49,6 +154,23 @@ Header *Request::findRequestHeader(const std::string &name) {
 std::vector<Header> Request::getHeaders() { return headers; }
 
 HttpMethod Request::getMethod() const { return method; }
+const std::string &Request::getPath() const { return path; }
+const std::string &Request::getVersion() const { return version; }
+
+bool Request::KeepAlive() {
+  Header *connection = findRequestHeader("Connection");
+  if (connection) {
+    std::string value = connection->value;
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+    if (value.find("close") != std::string::npos) {
+      return false;
+    }
+    if (value.find("keep-alive") != std::string::npos) {
+      return true;
+    }
+  }
+  return version == "HTTP/1.1";
+}
 const std::string &Request::Body() const { return body; };
 std::unique_ptr<URL> &Request::getURL() { return url; }
 
@@ -64,16 +186,14 @@ std::string *Request::Query(const std::string &key,
   return const_cast<std::string *>(&defaultValue);
 }
 
-void Request::ParseMethodAndPath(const std::string &req_data) {
+void Request::ParseMethodAndPath(const std::string &req_data, size_t start) {
   std::string method_string;
-  std::string version;
-
-  std::istringstream requestStream(req_data);
-  std::string requestLine;
 
   // Read the first line of the HTTP request
-  if (std::getline(requestStream, requestLine)) {
-    std::istringstream lineStream(requestLine);
+  size_t line_end = req_data.find('\n', start);
+  if (start < req_data.size()) {
+    std::istringstream lineStream(req_data.substr(
+        start, line_end == std::string::npos ? line_end : line_end - start));
 
     // Extract method, path, and version
     lineStream >> method_string >> path >> version;
@@ -81,8 +201,6 @@ void Request::ParseMethodAndPath(const std::string &req_data) {
     throw std::runtime_error("Invalid Http request");
   }
 
-  std::cout << method_string << " " << path << " " << version << std::endl;
-
   // SET http method member
   method = method_fromstring(method_string);
   if (method == HttpMethod::INVALID) {
@@ -90,35 +208,39 @@ void Request::ParseMethodAndPath(const std::string &req_data) {
   }
 }
 
-void Request::ParseHeaders(const std::string &req_data) {
+void Request::ParseHeaders(const std::string &req_data, size_t start) {
   // Parse headers from the request
-  const char *header_start = strstr(req_data.data(), LF.data());
-  if (!header_start) {
+  size_t header_start = req_data.find(LF, start);
+  if (header_start == std::string::npos) {
     throw std::runtime_error("cannot parse header end: Invalid HTTP format");
   }
 
   // Set header start member
-  header_start_pos = (header_start - req_data.data()) + 2; // skip LF
-  const char *header_end = strstr(req_data.data(), DOUBLE_LF.data());
-  if (!header_end) {
+  header_start_pos = header_start + 2; // skip LF
+  // The line break ending the request line starts the blank line when
+  // there are no header lines, so search from it.
+  size_t header_end = req_data.find(DOUBLE_LF, header_start);
+  if (header_end == std::string::npos) {
     throw std::runtime_error("cannot parse header end: Invalid HTTP format");
   }
 
   // Set header end pos
-  header_end_pos = header_end - req_data.data();
-  size_t header_length = header_end_pos - header_start_pos;
+  header_end_pos = header_end;
 
-  // Copy headers from request data.
-  std::string header_content(req_data.substr(header_start_pos, header_length));
-  header_content.push_back('\0');
+  // Copy headers from request data, none if the blank line follows the
+  // request line.
+  std::string header_content;
+  if (header_end > header_start) {
+    header_content =
+        req_data.substr(header_start_pos, header_end - header_start_pos);
+  }
 
-  // parse a line and create a Header object and append it to headers
+  // parse a line and create a Header object and append it to headers.
+  // Lines that are not headers are dropped.
   auto parseLine = [this](const std::string &line) {
     size_t pos = line.find(": ");
     if (pos != std::string::npos) {
       headers.push_back(Header{line.substr(0, pos), line.substr(pos + 2)});
-    } else {
-      throw std::runtime_error("Invalid header format: " + line);
     }
   };
 
@@ -130,24 +252,20 @@ void Request::ParseHeaders(const std::string &req_data) {
     header_content.erase(0, pos + 2); // Move past the "\r\n"
   }
   // Add the last header line (or the only line if there's only one)
-  header_lines.push_back(header_content);
+  if (!header_content.empty()) {
+    header_lines.push_back(header_content);
+  }
 
   for (const auto &header : header_lines) {
-    try {
-      parseLine(header);
-    } catch (const std::runtime_error &e) {
-      std::cerr << "Error: " << e.what() << std::endl;
-    }
+    parseLine(header);
   }
 
-  // Get content length from headers
-  if (!isSafeMethod(method)) {
-    for (auto &header : headers) {
-      if (caseInsensitiveStringCompare(header.name, "Content-Length")) {
-        // Update content length member
-        content_length = std::atoi(header.value.data());
-        break;
-      }
+  // Get content length from headers. Bodies of safe methods are skipped
+  // but still counted so that pipelined requests stay in step.
+  bool found = false;
+  for (auto &header : headers) {
+    if (caseInsensitiveStringCompare(header.name, "Content-Length")) {
+      addContentLength(header.value, found, content_length);
     }
   }
 
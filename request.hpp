@@ -1,6 +1,7 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 
+#include "status.hpp"
 #include "url.hpp"
 #include <cstdio>
 #include <cstring>
@@ -10,6 +11,11 @@
 #include <unordered_map>
 #include <vector>
 
+// Most bytes of request line and headers, and of a body, that a request
+// may have; the rest of a request is buffered until it has all arrived.
+#define MAX_REQUEST_HEADER_SIZE (64 * 1024)
+#define MAX_REQUEST_BODY_SIZE (16 * 1024 * 1024)
+
 // default scheme is "http"
 extern const std::string SCHEME;
 
@@ -66,6 +72,7 @@ class Request {
 private:
   HttpMethod method;           // enum for the request method.
   std::string path;            // Pathname
+  std::string version;         // Protocol version, e.g "HTTP/1.1"
   std::unique_ptr<URL> url;    // URL for this request
   std::vector<Header> headers; // vector of request headers
   std::string body;            // Body of request;
@@ -75,8 +82,8 @@ private:
 
   std::unordered_map<std::string, std::string> queries; // Query params
 
-  void ParseMethodAndPath(const std::string &req_data);
-  void ParseHeaders(const std::string &req_data);
+  void ParseMethodAndPath(const std::string &req_data, size_t start);
+  void ParseHeaders(const std::string &req_data, size_t start);
   void ParseBody(const std::string &req_data);
 
   bool caseInsensitiveStringCompare(const std::string &str1,
@@ -89,8 +96,10 @@ public:
   // destructor
   ~Request() = default;
 
-  // Parse http request from client
-  void ParseHttp(const std::string &req_data);
+  // Parse the http request starting at offset start of req_data.
+  // Returns the length of the request, so pipelined requests can be parsed
+  // back to back from the same buffer.
+  size_t ParseHttp(const std::string &req_data, size_t start = 0);
 
   Header *findRequestHeader(const std::string &name);
 
@@ -98,6 +107,12 @@ public:
   std::vector<Header> getHeaders();
 
   HttpMethod getMethod() const;
+  const std::string &getPath() const; // Request target as received.
+  const std::string &getVersion() const;
+
+  // Returns true if the client wants the connection kept open after the
+  // response (HTTP/1.1 default, or Connection: keep-alive).
+  bool KeepAlive();
   const std::string &Body() const;
   std::unique_ptr<URL> &getURL();
 
@@ -105,4 +120,21 @@ public:
                      const std::string &defaultValue = "");
 };
 
+// A request whose framing cannot be trusted. It is answered with status and
+// the connection closed, as what follows it cannot be told apart.
+class RequestError : public std::runtime_error {
+public:
+  HttpStatus status;
+
+  RequestError(HttpStatus status, const std::string &message)
+      : std::runtime_error(message), status(status) {}
+};
+
+// Returns the length of the request starting at offset start of data if
+// all of its headers and body have been received, or 0 if more is needed.
+// Throws RequestError if its Content-Length is not a plain number, if
+// several disagree, if it has a Transfer-Encoding (not supported), or if it
+// is larger than the limits above.
+size_t completeRequestLength(const std::string &data, size_t start = 0);
+
 #endif /* REQUEST_H */
@@ -1,5 +1,17 @@
 #include "response.hpp"
+#include "compression.hpp"
+#include "fileinfo.hpp"
+#include "metrics.hpp"
 #include "mime.hpp"
+#include "range.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <random>
+
+extern "C" {
+#include <fcntl.h>
+}
 
 static bool caseInsensitiveStringCompare(const std::string &str1,
                                          const std::string &str2) {
@@ -13,15 +25,39 @@ static bool caseInsensitiveStringCompare(const std::string &str1,
                     });
 }
 
+// True if the comma-separated list (e.g. a Vary value) contains token, or
+// is "*".
+static bool listsToken(const std::string &list, const std::string &token) {
+  size_t pos = 0;
+  while (pos <= list.size()) {
+    size_t comma = list.find(',', pos);
+    if (comma == std::string::npos) {
+      comma = list.size();
+    }
+    size_t begin = list.find_first_not_of(" \t", pos);
+    size_t end = list.find_last_not_of(" \t", comma - 1);
+    if (begin < comma && end != std::string::npos && end >= begin) {
+      std::string item = list.substr(begin, end - begin + 1);
+      if (item == "*" || caseInsensitiveStringCompare(item, token)) {
+        return true;
+      }
+    }
+    pos = comma + 1;
+  }
+  return false;
+}
+
 Response::Response(cppserver::Client *client, std::unique_ptr<Request> &request)
     : chunked(false), stream_complete(false), status(HttpStatus::StatusOK),
-      headers_sent(false), body_sent(false), client(client), request(request) {}
+      headers_sent(false), body_sent(false), client(client), request(request),
+      stream_compressor(nullptr) {}
 
 // Getters
 bool Response::isChunked() const { return chunked; }
 bool Response::isStreamComplete() const { return stream_complete; }
 HttpStatus Response::getStatus() const { return status; }
 const std::vector<Header> &Response::getHeaders() const { return headers; }
+bool Response::isHeadersSent() const { return headers_sent; }
 cppserver::Client *Response::getClient() const { return client; }
 std::unique_ptr<Request> &Response::getRequest() const { return request; }
 
@@ -35,6 +71,17 @@ Header *Response::findResponseHeader(const std::string &name) {
   return nullptr;
 }
 
+// Removes every response header called name.
+void Response::removeResponseHeader(const std::string &name) {
+  size_t kept = 0;
+  for (size_t i = 0; i < headers.size(); i++) {
+    if (!caseInsensitiveStringCompare(headers[i].name, name)) {
+      headers[kept++] = std::move(headers[i]);
+    }
+  }
+  headers.resize(kept);
+}
+
 // Setters
 void Response::setChunked(bool value) { chunked = value; }
 void Response::setStreamComplete(bool value) { stream_complete = value; }
@@ -43,10 +90,20 @@ void Response::setHeader(const std::string &name, const std::string &value) {
   headers.push_back({name, value});
 }
 
-void Response::writeHeaders() {
+static std::atomic<bool> closing_connections(false);
+
+void setClosingConnections(bool closing) { closing_connections = closing; }
+
+bool closingConnections() { return closing_connections; }
+
+void Response::writeHeaders(std::string_view raw_headers) {
   if (headers_sent)
     return;
 
+  if (closing_connections && !findResponseHeader("Connection")) {
+    setHeader("Connection", "close");
+  }
+
   // Set default status code if none exists
   if (status == 0) {
     status = HttpStatus::StatusOK;
@@ -63,16 +120,65 @@ void Response::writeHeaders() {
     }
   }
 
+  // Pre-serialized header lines (e.g. from an embedded file).
+  headerData.append(raw_headers);
+
   // Add an additional line break before the body
   headerData += "\r\n";
 
   // Send the response headers
-  int bytes_sent = client->Send(headerData);
+  ssize_t bytes_sent = client->Send(headerData);
   if (bytes_sent == -1) {
     perror("send");
     throw std::runtime_error("failed to send HTTP headers to client");
   }
+  client->CountHead(headerData.size());
   headers_sent = true;
+  noteResponseStatus(status);
+}
+
+// Pick a compressor for a body of size bytes, or of unknown length if
+// chunked, according to the compression options and Accept-Encoding.
+// Sets Content-Encoding and Vary when compression is used.
+Compressor *Response::negotiateCompression(size_t size, bool chunked) {
+  const CompressionOptions &options = getCompressionOptions();
+  if (!options.enabled || (!chunked && size < options.min_size) ||
+      status == StatusNoContent || status == StatusNotModified ||
+      findResponseHeader("Content-Encoding")) {
+    return nullptr;
+  }
+
+  Header *contentType = findResponseHeader("Content-Type");
+  if (!contentType || !isCompressibleType(contentType->value)) {
+    return nullptr;
+  }
+
+  // The response varies by Accept-Encoding whether or not it is compressed.
+  Header *vary = findResponseHeader("Vary");
+  if (!vary) {
+    setHeader("Vary", "Accept-Encoding");
+  } else if (!listsToken(vary->value, "Accept-Encoding")) {
+    vary->value += vary->value.empty() ? "" : ", ";
+    vary->value += "Accept-Encoding";
+  }
+
+  Header *accept = request->findRequestHeader("Accept-Encoding");
+  if (!accept) {
+    return nullptr;
+  }
+
+  std::vector<std::string_view> offered(options.encodings.begin(),
+                                        options.encodings.end());
+  std::string_view encoding = negotiateEncoding(accept->value, offered);
+  if (encoding.empty()) {
+    return nullptr;
+  }
+
+  Compressor *compressor = threadCompressor(encoding, options.level);
+  if (compressor) {
+    setHeader("Content-Encoding", std::string(encoding));
+  }
+  return compressor;
 }
 
 // Sending data
@@ -82,15 +188,31 @@ int Response::Send(const std::string &data) {
   }
 
   // Assume user set all neccessary headers
-  setHeader("Content-Length", std::to_string(data.size()));
   Header *contentType = findResponseHeader("Content-Type");
   if (!contentType) {
     setHeader("Content-Type", "text/html");
   }
 
+  // Compressed output reuses a per-thread buffer.
+  thread_local std::string compressed;
+  const std::string *body = &data;
+
+  Compressor *compressor = negotiateCompression(data.size(), false);
+  if (compressor) {
+    compressed.clear();
+    if (compressor->Compress(data, FlushMode::Finish, compressed)) {
+      body = &compressed;
+    } else {
+      // Fall back to the identity coding.
+      removeResponseHeader("Content-Encoding");
+    }
+  }
+
+  setHeader("Content-Length", std::to_string(body->size()));
+
   try {
     writeHeaders();
-    int n = client->Send(data);
+    ssize_t n = client->Send(*body);
     if (n == -1) {
       throw std::runtime_error("error sending data");
     }
@@ -102,188 +224,344 @@ int Response::Send(const std::string &data) {
   }
 }
 
-static void write_range_headers(Response *res, ssize_t start, ssize_t end,
-                                off64_t file_size) {
-  std::string content_len = std::to_string(end - start + 1);
-  res->setHeader("Accept-Ranges", "bytes");
-  res->setHeader("Content-Length", content_len);
-  res->setHeader("Content-Range", "bytes " + std::to_string(start) + "-" +
-                                      std::to_string(end) + "/" +
-                                      std::to_string(file_size));
-
-  // Set the appropriate status code for partial content
-  res->setStatus(StatusPartialContent);
+// Write data as one chunk of a chunked body. Empty data writes nothing.
+bool Response::writeChunk(std::string_view data) {
+  if (data.empty()) {
+    return true;
+  }
+
+  char size_line[32];
+  int len = snprintf(size_line, sizeof(size_line), "%zx\r\n", data.size());
+
+  std::string chunk;
+  chunk.reserve(len + data.size() + 2);
+  chunk.append(size_line, len);
+  chunk.append(data);
+  chunk.append("\r\n");
+  return client->Send(chunk) != -1;
+}
+
+int Response::SendChunk(const std::string &data) {
+  if (body_sent || stream_complete) {
+    throw std::runtime_error("body already sent");
+  }
+
+  if (!headers_sent) {
+    if (!findResponseHeader("Content-Type")) {
+      setHeader("Content-Type", "text/html");
+    }
+    stream_compressor = negotiateCompression(0, true);
+    setChunked(true);
+    setHeader("Transfer-Encoding", "chunked");
+    writeHeaders();
+  }
+
+  std::string_view out = data;
+  if (stream_compressor) {
+    // Sync flush so the client can decode each chunk as it arrives.
+    thread_local std::string compressed;
+    compressed.clear();
+    if (!stream_compressor->Compress(data, FlushMode::Sync, compressed)) {
+      return -1;
+    }
+    out = compressed;
+  }
+
+  return writeChunk(out) ? static_cast<int>(data.size()) : -1;
+}
+
+int Response::EndChunks() {
+  if (stream_complete) {
+    return 0;
+  }
+  if (!headers_sent) {
+    // No chunks were written; send an empty chunked body.
+    SendChunk("");
+  }
+
+  if (stream_compressor) {
+    thread_local std::string compressed;
+    compressed.clear();
+    if (!stream_compressor->Compress("", FlushMode::Finish, compressed) ||
+        !writeChunk(compressed)) {
+      return -1;
+    }
+    stream_compressor = nullptr;
+  }
+
+  setStreamComplete(true);
+  body_sent = true;
+  return client->Send("0\r\n\r\n") == -1 ? -1 : 0;
 }
 
-int Response::SendFile(const std::string &fname) {
+int Response::SendEmbedded(const EmbeddedFile &file) {
   if (body_sent) {
     throw std::runtime_error("body already sent");
   }
 
-  Header *contentType = findResponseHeader("Content-Type");
+  Header *h = request->findRequestHeader("If-None-Match");
+  if (h && etagListMatches(h->value, file.etag)) {
+    setStatus(StatusNotModified);
+    setHeader("ETag", file.etag);
+    writeHeaders();
+    body_sent = true;
+    return 0;
+  }
+
+  // Headers and body come from read-only memory; no filesystem access.
+  writeHeaders(std::string_view(file.headers, file.headers_size));
+  ssize_t n = client->Send(
+      std::string_view(reinterpret_cast<const char *>(file.data), file.size));
+  body_sent = true;
+  return n;
+}
+
+static std::string contentRange(const ByteRange &range, off64_t file_size) {
+  return "bytes " + std::to_string(range.start) + "-" +
+         std::to_string(range.end) + "/" + std::to_string(file_size);
+}
+
+// Random boundary for multipart/byteranges responses.
+static std::string multipartBoundary() {
+  thread_local std::mt19937_64 rng(std::random_device{}());
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%016llx",
+           static_cast<unsigned long long>(rng()));
+  return buf;
+}
+
+// Evaluate If-None-Match and If-Modified-Since (RFC 7232 section 6).
+// Returns true if the client's cached copy is still valid.
+static bool isNotModified(Request *req, const FileInfo &info) {
+  Header *h = req->findRequestHeader("If-None-Match");
+  if (h) {
+    // If-Modified-Since is ignored when If-None-Match is present.
+    return etagListMatches(h->value, info.etag);
+  }
+
+  h = req->findRequestHeader("If-Modified-Since");
+  if (h) {
+    time_t since = parseHttpDate(h->value);
+    return since != -1 && info.mtime <= since;
+  }
+  return false;
+}
+
+// Evaluate If-Range. Returns true if the Range header should be honoured.
+static bool ifRangeMatches(Request *req, const FileInfo &info) {
+  Header *h = req->findRequestHeader("If-Range");
+  if (!h) {
+    return true;
+  }
+
+  const std::string &value = h->value;
+  if (!value.empty() &&
+      (value.front() == '"' || value.compare(0, 2, "W/") == 0)) {
+    return etagStrongMatches(value, info.etag);
+  }
+
+  // A date validator must match exactly.
+  time_t date = parseHttpDate(value);
+  return date != -1 && date == info.mtime;
+}
+
+// Send length bytes of fd starting at offset. Without a profile this is a
+// single sendfile loop. With one, the file is sent in profile->segment
+// pieces, prefetching ahead of each piece and, for very large files,
+// dropping the pages behind it.
+static ssize_t sendFileData(cppserver::Client *client, int fd, off64_t offset,
+                            off64_t length, off64_t file_size,
+                            const StreamingProfile *profile) {
+  if (!profile) {
+    return client->SendFile(fd, offset, length);
+  }
+
+  bool drop_behind = file_size >= profile->dontneed_threshold;
+  off64_t end = offset + length;
+  off64_t pos = offset;
+
+  while (pos < end) {
+    off64_t segment = std::min(profile->segment, end - pos);
+    off64_t ahead = std::min(profile->readahead, end - pos);
+    posix_fadvise(fd, pos, ahead, POSIX_FADV_WILLNEED);
 
-  // Decode filename
-  std::string filename;
-  filename.reserve(fname.size() + 1);
-  urldecode(filename.data(), fname.size() + 1, fname.c_str());
+    ssize_t n = client->SendFile(fd, pos, segment);
+    if (n == -1) {
+      return -1;
+    }
+
+    if (drop_behind) {
+      posix_fadvise(fd, pos, n, POSIX_FADV_DONTNEED);
+    }
+
+    pos += n;
+    if (n < segment) {
+      break;
+    }
+  }
+  return pos - offset;
+}
+
+// Closes a file descriptor when it goes out of scope.
+struct FdGuard {
+  int &fd;
+  ~FdGuard() {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+};
+
+int Response::SendFile(const std::string &filename,
+                       const StreamingProfile *profile) {
+  return sendFile(-1, filename, profile);
+}
+
+int Response::SendFile(int fd, const std::string &filename,
+                       const StreamingProfile *profile) {
+  return sendFile(fd, filename, profile);
+}
+
+int Response::sendFile(int fd, const std::string &filename,
+                       const StreamingProfile *profile) {
+  FdGuard guard{fd};
+  if (body_sent) {
+    throw std::runtime_error("body already sent");
+  }
+
+  Header *contentType = findResponseHeader("Content-Type");
 
   // If content-type not already set by user, guess it from our mapped content
   // types.
   if (!contentType) {
-    setHeader("Content-Type", getContentType(filename));
+    setHeader("Content-Type", std::string(getContentType(filename)));
   }
 
-  ssize_t start, end;
-  const char *range_header = NULL;
-  bool valid_range = false;
-  bool has_end_range = false;
+  // Validators come from cached metadata, so conditional requests are
+  // answered without opening the file.
+  std::shared_ptr<const FileInfo> info =
+      fd == -1 ? lookupFileInfo(filename) : lookupFileInfo(fd, filename);
+  if (!info || info->is_directory) {
+    setStatus(StatusNotFound);
+    setHeader("Content-Length", "0");
+    writeHeaders();
+    return -1;
+  }
+
+  setHeader("Accept-Ranges", "bytes");
+  setHeader("ETag", info->etag);
+  setHeader("Last-Modified", info->last_modified);
+
+  if (isNotModified(request.get(), *info)) {
+    setStatus(StatusNotModified);
+    writeHeaders();
+    body_sent = true;
+    return 0;
+  }
+
+  off64_t file_size = info->size;
+  std::vector<ByteRange> ranges;
+  RangeResult range_result = RangeResult::Ignored;
 
   Header *h = request->findRequestHeader("Range");
-  if (h) {
-    range_header = h->value.c_str();
-
-    if (strstr(range_header, "bytes=") != NULL) {
-      if (sscanf(range_header, "bytes=%ld-%ld", &start, &end) == 2) {
-        valid_range = true;
-        has_end_range = true;
-      } else if (sscanf(range_header, "bytes=%ld-", &start) == 1) {
-        valid_range = true;
-        has_end_range = false;
-      };
-    }
+  if (h && ifRangeMatches(request.get(), *info)) {
+    range_result = parseRangeHeader(h->value, file_size, ranges);
   }
 
-  // Open the file with ftello64 for large file support
-  FILE *file = fopen64(filename.c_str(), "rb");
-  if (file == NULL) {
-    fprintf(stderr, "Unable to open the file\n");
-    perror("fopen64");
-    setStatus(StatusInternalServerError);
+  if (range_result == RangeResult::Unsatisfiable) {
+    setStatus(StatusRequestedRangeNotSatisfiable);
+    setHeader("Content-Range", "bytes */" + std::to_string(file_size));
+    setHeader("Content-Length", "0");
     writeHeaders();
     return -1;
   }
 
-  // determine file size.
-  fseeko64(file, 0, SEEK_END);
-  off64_t file_size = ftello64(file);
-  fseeko64(file, 0, SEEK_SET);
-
-  // Set appropriate headers for partial content
-  if (valid_range) {
-    if (start >= file_size) {
-      printf("The requested range is outside of the file size");
-      setStatus(StatusRequestedRangeNotSatisfiable);
-      writeHeaders();
-      return -1;
-    }
+  if (fd == -1) {
+    fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  }
+  if (fd == -1) {
+    perror("open");
+    setStatus(StatusInternalServerError);
+    setHeader("Content-Length", "0");
+    writeHeaders();
+    return -1;
+  }
 
-    ssize_t range_chunk_size = (4 * 1024 * 1024) - 1; // send 4MB
-    if (!has_end_range && start >= 0) {
-      if (start == 0) {
-        end = file_size - 1;
-      } else {
-        end = start + range_chunk_size;
-        if (end >= file_size) {
-          end = file_size - 1; // End of range
-        }
-      }
-    } else if (start < 0) {
-      start = file_size + start; // filesize - start(from end of file)
-      end = start + range_chunk_size;
-      if (end >= file_size) {
-        end = file_size - 1; // End of range
-      }
-    } else if (end < 0) {
-      end = file_size + end;
-      if (end >= file_size) {
-        end = file_size - 1; // End of range
-      }
-    }
+  std::string peer;
+  if (profile) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    peer = client->PeerAddress();
 
-    // Sanity checks
-    if (start < 0 || end < 0 || end >= file_size) {
-      printf("The requested range is outside of the file size\n");
-      setStatus(StatusRequestedRangeNotSatisfiable);
-      writeHeaders();
-      return -1;
+    // Size open-ended ranges from the client's measured throughput.
+    if (ranges.size() == 1 && ranges[0].open_ended) {
+      off64_t window = streamingWindow(*profile, peer);
+      ranges[0].end = std::min(ranges[0].end, ranges[0].start + window - 1);
     }
+  }
 
-    write_range_headers(this, start, end, file_size);
+  auto started = std::chrono::steady_clock::now();
+  ssize_t total_bytes_sent = 0;
+  ssize_t n;
 
-    // Move file position to the start of the requested range
-    if (fseeko64(file, start, SEEK_SET) != 0) {
-      setStatus(StatusRequestedRangeNotSatisfiable);
-      writeHeaders();
-      perror("fseeko64");
-      fclose(file);
-      return -1;
-    }
+  if (range_result == RangeResult::Ignored) {
+    setHeader("Content-Length", std::to_string(file_size));
+    writeHeaders();
+    total_bytes_sent =
+        sendFileData(client, fd, 0, file_size, file_size, profile);
+  } else if (ranges.size() == 1) {
+    setStatus(StatusPartialContent);
+    setHeader("Content-Length", std::to_string(ranges[0].length()));
+    setHeader("Content-Range", contentRange(ranges[0], file_size));
+    writeHeaders();
+    total_bytes_sent = sendFileData(client, fd, ranges[0].start,
+                                    ranges[0].length(), file_size, profile);
   } else {
-    // Normal NON-RANGE REQUESTS
-    std::string content_length = std::to_string(file_size);
-    setHeader("Content-Length", content_length);
-  }
+    // multipart/byteranges: part headers are written with MSG_MORE so they
+    // coalesce with the sendfile segment that follows.
+    std::string part_type = findResponseHeader("Content-Type")->value;
+    std::string boundary = multipartBoundary();
+
+    std::vector<std::string> part_headers;
+    part_headers.reserve(ranges.size());
+    off64_t content_length = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+      std::string part = i == 0 ? "--" : "\r\n--";
+      part += boundary + "\r\n";
+      part += "Content-Type: " + part_type + "\r\n";
+      part += "Content-Range: " + contentRange(ranges[i], file_size) + "\r\n";
+      part += "\r\n";
+      content_length += part.size() + ranges[i].length();
+      part_headers.push_back(std::move(part));
+    }
+    std::string trailer = "\r\n--" + boundary + "--\r\n";
+    content_length += trailer.size();
 
-  setHeader("Connection", "close");
-  writeHeaders();
+    setStatus(StatusPartialContent);
+    findResponseHeader("Content-Type")->value =
+        "multipart/byteranges; boundary=" + boundary;
+    setHeader("Content-Length", std::to_string(content_length));
+    writeHeaders();
 
-  // Read and send the file in chunks
-  ssize_t total_bytes_sent = 0;
-  char buffer[BUFSIZ];
-  ssize_t chunk_size;
-  ssize_t buffer_size = sizeof(buffer);
-
-  // If it's a valid range request, adjust the buffer size
-  if (valid_range) {
-    // Ensure the buffer size doesn't exceed the remaining bytes in the
-    // requested range
-    off64_t remaining_bytes = (end - start + 1);
-    buffer_size = remaining_bytes < (off64_t)sizeof(buffer)
-                      ? remaining_bytes
-                      : (off64_t)sizeof(buffer);
-  }
-
-  while ((chunk_size = fread(buffer, 1, buffer_size, file)) > 0) {
-    ssize_t body_bytes_sent; // total body bytes
-    ssize_t sent = 0;        // total_bytes for this chunk
-
-    while (sent < chunk_size) {
-      body_bytes_sent = send(client->fd(), buffer + sent, chunk_size - sent, 0);
-      if (body_bytes_sent == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          // Handle non-blocking case, e.g., retry the send later
-          continue;
-        } else {
-          perror("send");
-          fclose(file);
-          return -1;
-        }
-      } else if (body_bytes_sent == 0) {
-        // Connection closed by peer
-        fclose(file);
-        return total_bytes_sent;
-      } else {
-        sent += body_bytes_sent;
-        total_bytes_sent += body_bytes_sent;
+    for (size_t i = 0; i < ranges.size(); i++) {
+      if (client->Send(part_headers[i], MSG_MORE) == -1 ||
+          (n = sendFileData(client, fd, ranges[i].start, ranges[i].length(),
+                            file_size, profile)) == -1) {
+        total_bytes_sent = -1;
+        break;
       }
+      total_bytes_sent += n;
     }
-
-    // If it's a range request, and we've sent the requested range, break out
-    // of the loop
-    if (valid_range && total_bytes_sent >= (end - start + 1)) {
-      break;
+    if (total_bytes_sent != -1) {
+      client->Send(trailer);
     }
+  }
 
-    // Update the remaining bytes based on the data sent to the client.
-    if (valid_range) {
-      off64_t remaining_bytes = (end - start + 1) - total_bytes_sent;
-      buffer_size = remaining_bytes < (off64_t)sizeof(buffer)
-                        ? remaining_bytes
-                        : (off64_t)sizeof(buffer);
-    }
+  if (profile && total_bytes_sent > 0) {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - started;
+    recordThroughput(peer, total_bytes_sent, elapsed.count());
   }
 
-  fclose(file);
   body_sent = true;
   return total_bytes_sent;
 }
@@ -7,7 +7,10 @@
 #endif
 
 #include "client.hpp"
+#include "compression.hpp"
+#include "embed.hpp"
 #include "request.hpp"
+#include "streaming.hpp"
 #include "url.hpp"
 #include <cstdio>
 #include <fstream>
@@ -29,8 +32,14 @@ private:
   bool body_sent;
   cppserver::Client *client;         // Http client
   std::unique_ptr<Request> &request; // Request pointer
+  Compressor *stream_compressor;     // Compressor for chunked responses.
 
-  void writeHeaders();
+  void writeHeaders(std::string_view raw_headers = std::string_view());
+  Compressor *negotiateCompression(size_t size, bool chunked);
+  void removeResponseHeader(const std::string &name);
+  bool writeChunk(std::string_view data);
+  int sendFile(int fd, const std::string &filename,
+               const StreamingProfile *profile);
 
 public:
   // Constructors
@@ -41,6 +50,7 @@ public:
   bool isChunked() const;
   bool isStreamComplete() const;
   HttpStatus getStatus() const;
+  bool isHeadersSent() const;
   const std::vector<Header> &getHeaders() const;
   Header *findResponseHeader(const std::string &name);
   cppserver::Client *getClient() const;
@@ -52,9 +62,35 @@ public:
   void setStatus(HttpStatus value);
   void setHeader(const std::string &name, const std::string &value);
 
-  // Sending responses
+  // Sending responses.
+  // Send and SendChunk compress the body when response compression is
+  // enabled (see setCompressionOptions) and the client accepts it.
   int Send(const std::string &data);
-  int SendFile(const std::string &filename);
+
+  // Stream the body with chunked transfer encoding. Headers are written on
+  // the first call; EndChunks writes the last chunk.
+  int SendChunk(const std::string &data);
+  int EndChunks();
+
+  // Send a file, honouring conditional and Range headers. filename is a
+  // filesystem path and is not URL-decoded.
+  // If profile is not null, the file is sent with the media streaming
+  // profile (prefetching, adaptive open-ended ranges, cache dropping).
+  int SendFile(const std::string &filename,
+               const StreamingProfile *profile = nullptr);
+
+  // Send an already open file. Takes ownership of fd and closes it.
+  // filename picks the Content-Type and keys the metadata cache.
+  int SendFile(int fd, const std::string &filename,
+               const StreamingProfile *profile = nullptr);
+
+  // Send a file from an embedded bundle using its pre-serialized headers.
+  int SendEmbedded(const EmbeddedFile &file);
 };
 
+// Once set, responses that have not written their headers yet add
+// Connection: close. Set by the server when it shuts down.
+void setClosingConnections(bool closing);
+bool closingConnections();
+
 #endif /* RESPONSE_H */
@@ -3,6 +3,169 @@
 // Store all registered routes. Calls to GET/POST etc append to this vector.
 static std::vector<Route> routes;
 
+// The literal start of a GET route's pattern (all of it if exact), so that
+// only the routes that may match a path are tried before a mount serves it.
+struct RoutePrefix {
+  size_t route;  // Index in routes.
+  std::string prefix;
+  bool exact;
+};
+
+static std::vector<RoutePrefix> get_routes;
+
+// Prefix tree of static and embed mounts, one node per path segment.
+struct MountNode {
+  std::vector<std::pair<std::string, std::unique_ptr<MountNode>>> children;
+  std::unique_ptr<Route> route;  // Mount at this prefix, if any.
+
+  // GET routes that may match paths under the mount, in registration order.
+  std::vector<RoutePrefix> overlapping;
+};
+
+static MountNode mounts;
+
+// Returns the literal text an anchored pattern starts with. exact is set if
+// that is all of the pattern. Patterns with alternatives have no prefix.
+static std::string literalPrefix(const std::string &pattern, bool &exact) {
+  exact = false;
+  if (pattern.find('|') != std::string::npos) {
+    return "";
+  }
+
+  std::string prefix;
+  for (size_t i = pattern.front() == '^' ? 1 : 0; i < pattern.size(); i++) {
+    char c = pattern[i];
+    if (c == '$' && i + 1 == pattern.size()) {
+      break;
+    }
+    if (strchr("\\^$.|?*+()[]{}", c)) {
+      // The last character may be optional.
+      if ((c == '?' || c == '*' || c == '{') && !prefix.empty()) {
+        prefix.pop_back();
+      }
+      return prefix;
+    }
+    prefix.push_back(c);
+  }
+  exact = true;
+  return prefix;
+}
+
+// True if route may match a path under the mount at prefix (normalized).
+static bool overlapsMount(const RoutePrefix &route, const std::string &prefix) {
+  size_t n = std::min(route.prefix.size(), prefix.size());
+  return route.prefix.compare(0, n, prefix, 0, n) == 0;
+}
+
+// Calls fn with every mount node.
+template <typename Fn> static void forEachMount(MountNode &node, Fn fn) {
+  if (node.route) {
+    fn(node);
+  }
+  for (auto &child : node.children) {
+    forEachMount(*child.second, fn);
+  }
+}
+
+static void addRoute(const Route &route) {
+  routes.push_back(route);
+  if (route.getMethod() != HttpMethod::GET) {
+    return;
+  }
+
+  RoutePrefix entry;
+  entry.route = routes.size() - 1;
+  entry.prefix = literalPrefix(route.getPattern(), entry.exact);
+  get_routes.push_back(entry);
+  forEachMount(mounts, [&entry](MountNode &node) {
+    if (overlapsMount(entry, node.route->getPattern())) {
+      node.overlapping.push_back(entry);
+    }
+  });
+}
+
+// Collapse repeated slashes and drop the trailing one: "/a//b/" -> "/a/b".
+static std::string normalizeMountPrefix(const std::string &pattern) {
+  std::string prefix = "/";
+  for (char c : pattern) {
+    if (c != '/' || prefix.back() != '/') {
+      prefix.push_back(c);
+    }
+  }
+  if (prefix.size() > 1 && prefix.back() == '/') {
+    prefix.pop_back();
+  }
+  return prefix;
+}
+
+// Calls fn with each segment of path after the leading '/'.
+// Stops early if fn returns false.
+template <typename Fn>
+static void forEachSegment(std::string_view path, Fn fn) {
+  if (path.empty() || path == "/") {
+    return;
+  }
+  size_t pos = path.front() == '/' ? 1 : 0;
+  while (pos <= path.size()) {
+    size_t slash = path.find('/', pos);
+    if (slash == std::string_view::npos) {
+      slash = path.size();
+    }
+    if (!fn(path.substr(pos, slash - pos))) {
+      return;
+    }
+    pos = slash + 1;
+  }
+}
+
+static void addMount(const Route &route) {
+  MountNode *node = &mounts;
+  forEachSegment(route.getPattern(), [&node](std::string_view segment) {
+    for (auto &child : node->children) {
+      if (child.first == segment) {
+        node = child.second.get();
+        return true;
+      }
+    }
+    node->children.emplace_back(std::string(segment),
+                                std::make_unique<MountNode>());
+    node = node->children.back().second.get();
+    return true;
+  });
+
+  if (node->route) {
+    std::cerr << "replacing mount at " << route.getPattern() << std::endl;
+  }
+  node->route = std::make_unique<Route>(route);
+
+  node->overlapping.clear();
+  for (const RoutePrefix &entry : get_routes) {
+    if (overlapsMount(entry, route.getPattern())) {
+      node->overlapping.push_back(entry);
+    }
+  }
+}
+
+// Returns the node of the mount with the longest prefix of path, or NULL.
+static MountNode *matchMount(std::string_view path) {
+  MountNode *node = &mounts;
+  MountNode *best = node->route ? node : nullptr;
+
+  forEachSegment(path, [&node, &best](std::string_view segment) {
+    for (auto &child : node->children) {
+      if (child.first == segment) {
+        node = child.second.get();
+        if (node->route) {
+          best = node;
+        }
+        return true;
+      }
+    }
+    return false;
+  });
+  return best;
+}
+
 // GETTERS
 HttpMethod Route::getMethod() const { return method; }
 const std::string &Route::getPattern() const { return pattern; }
@@ -10,10 +173,25 @@ pcre2_code_8 *Route::getCompiledPattern() const { return compiledPattern; }
 RouteHandler Route::getHandler() const { return handler; }
 RouteType Route::getType() const { return type; }
 const std::string &Route::getDirname() const { return dirname; }
+const StaticPolicy *Route::getStaticPolicy() const { return policy.get(); }
+
+const StreamingProfile *Route::getStreamingProfile() const {
+  if (!policy || !policy->streaming) {
+    return nullptr;
+  }
+  return &*policy->streaming;
+}
 
 Route::Route(HttpMethod method, const std::string &pattern,
              RouteHandler handler, RouteType type)
-    : method(method), handler(handler), type(type) {
+    : method(method),
+      handler(handler),
+      type(type),
+      bundle(nullptr),
+      hub(nullptr),
+      requests(std::make_shared<RequestCounter>(
+          metricLabel("method", method_tostring(method)) + "," +
+          metricLabel("route", pattern))) {
   if (pattern.empty()) {
     std::cerr << "pattern must be at least one character" << std::endl;
     exit(1);
@@ -22,7 +200,7 @@ Route::Route(HttpMethod method, const std::string &pattern,
   // Set transformed pattern
   std::string anchoredPattern;
 
-  if (type == NormalRoute) {
+  if (type == NormalRoute || type == WebSocketRoute || type == SseRoute) {
     if (pattern.front() != '^' && pattern.back() != '$') {
       anchoredPattern = "^" + pattern + "$";
     } else if (pattern.front() != '^') {
@@ -38,6 +216,12 @@ Route::Route(HttpMethod method, const std::string &pattern,
 
   this->pattern = anchoredPattern;
 
+  // Mounts match by prefix (see matchMount); their pattern is literal.
+  if (type == StaticRoute || type == EmbedRoute) {
+    this->compiledPattern = NULL;
+    return;
+  }
+
   // Compile the pattern
   int error_code;
   PCRE2_SIZE error_offset;
@@ -55,6 +239,48 @@ Route::Route(HttpMethod method, const std::string &pattern,
   }
 }
 
+const EmbeddedBundle *Route::getBundle() const { return bundle; }
+const std::shared_ptr<const WebSocketHandlers> &Route::getWebSocket() const {
+  return websocket;
+}
+SseHub *Route::getHub() const { return hub; }
+const SseTopic &Route::getTopic() const { return topic; }
+RequestCounter *Route::getRequests() const { return requests.get(); }
+const StaticRoot *Route::getRoot() const { return root.get(); }
+
+void Route::setStaticPolicy(const StaticPolicy &staticPolicy) {
+  if (type != StaticRoute) {
+    return;
+  }
+
+  policy = std::make_shared<const StaticPolicy>(staticPolicy);
+  try {
+    root = std::make_shared<StaticRoot>(dirname, policy->use_fd_cache);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  if (policy->precompressed) {
+    precompressed =
+        std::make_shared<PrecompressedCache>(dirname, policy->precompress);
+  }
+
+  if (policy->io_workers > 0) {
+    io = std::make_shared<IoExecutor>(policy->io_workers,
+                                      policy->io_queue_depth);
+  } else {
+    // Shared executor; never deleted through the route.
+    io = std::shared_ptr<IoExecutor>(defaultIoExecutor(), [](IoExecutor *) {});
+  }
+}
+
+IoExecutor *Route::getIoExecutor() const { return io.get(); }
+
+PrecompressedCache *Route::getPrecompressed() const {
+  return precompressed.get();
+}
+
 // Copy constructor
 Route::Route(const Route &other)
     : method(other.method),
@@ -62,95 +288,166 @@ Route::Route(const Route &other)
       compiledPattern(other.compiledPattern),
       handler(other.handler),
       type(other.type),
-      dirname(other.dirname) {
+      dirname(other.dirname),
+      root(other.root),
+      policy(other.policy),
+      precompressed(other.precompressed),
+      io(other.io),
+      bundle(other.bundle),
+      websocket(other.websocket),
+      hub(other.hub),
+      topic(other.topic),
+      requests(other.requests) {
   // If compiledPattern is a pointer, we might need to perform a deep copy
   // here. Otherwise, the default member-wise copy should be sufficient.
 }
 
 void Router::GET(const std::string &pattern, RouteHandler handler) {
   Route route(HttpMethod::GET, pattern, handler, NormalRoute);
-  routes.push_back(route);
+  addRoute(route);
 }
 
 void Router::POST(const std::string &pattern, RouteHandler handler) {
   Route route(HttpMethod::POST, pattern, handler, NormalRoute);
-  routes.push_back(route);
+  addRoute(route);
 }
 
 void Router::PUT(const std::string &pattern, RouteHandler handler) {
   Route route(HttpMethod::PUT, pattern, handler, NormalRoute);
-  routes.push_back(route);
+  addRoute(route);
 }
 
 void Router::PATCH(const std::string &pattern, RouteHandler handler) {
   Route route(HttpMethod::PATCH, pattern, handler, NormalRoute);
-  routes.push_back(route);
+  addRoute(route);
 }
 
 void Router::DELETE(const std::string &pattern, RouteHandler handler) {
   Route route(HttpMethod::DELETE, pattern, handler, NormalRoute);
-  routes.push_back(route);
+  addRoute(route);
 }
 
 void Router::OPTIONS(const std::string &pattern, RouteHandler handler) {
   Route route(HttpMethod::OPTIONS, pattern, handler, NormalRoute);
-  routes.push_back(route);
+  addRoute(route);
 }
 
 void Router::STATIC(const std::string &pattern, const std::string &dirname) {
-  Route route(HttpMethod::GET, pattern, nullptr, StaticRoute);
+  STATIC(pattern, dirname, StaticPolicy());
+}
+
+void Router::STATIC(const std::string &pattern, const std::string &dirname,
+                    const StaticPolicy &policy) {
+  Route route(HttpMethod::GET, normalizeMountPrefix(pattern), nullptr,
+              StaticRoute);
   route.setDirname(dirname);
-  routes.push_back(route);
+  route.setStaticPolicy(policy);
+  addMount(route);
 }
 
-RouteHandler Route::getRouteHandler() { return handler; }
+void Router::STATIC(const std::string &pattern, const std::string &dirname,
+                    const PrecompressOptions &precompress) {
+  StaticPolicy policy;
+  policy.precompressed = true;
+  policy.precompress = precompress;
+  STATIC(pattern, dirname, policy);
+}
 
-Route *matchBestRoute(HttpMethod method, const std::string &path) {
-  Route *bestMatch = NULL;
-  size_t bestMatchLength = 0;
-  size_t subject_length = path.size();
+void Router::STREAM(const std::string &pattern, const std::string &dirname,
+                    const StreamingProfile &profile) {
+  StaticPolicy policy;
+  policy.streaming = profile;
+  STATIC(pattern, dirname, policy);
+}
 
-  for (auto &route : routes) {
-    if (route.getType() == NormalRoute) {
-      // Use pre-compiled PCRE2 pattern
-      int rc;
-      pcre2_match_data *match_data = NULL;
-      match_data = pcre2_match_data_create_from_pattern(
-          route.getCompiledPattern(), NULL);
-
-      if (match_data == NULL) {
-        printf("Failed to create match data for pattern: %s\n",
-               route.getPattern().c_str());
-        return NULL;
-      }
+void Router::EMBED(const std::string &pattern, const EmbeddedBundle &bundle) {
+  Route route(HttpMethod::GET, normalizeMountPrefix(pattern), nullptr,
+              EmbedRoute);
+  route.setBundle(&bundle);
+  addMount(route);
+}
+
+void Router::WEBSOCKET(const std::string &pattern,
+                       const WebSocketHandlers &handlers) {
+  Route route(HttpMethod::GET, pattern, nullptr, WebSocketRoute);
+  route.setWebSocket(handlers);
+  addRoute(route);
+}
+
+void Router::SSE(const std::string &pattern, SseHub &hub,
+                 const std::string &topic) {
+  SSE(pattern, hub, [topic](Request *) { return topic; });
+}
+
+void Router::SSE(const std::string &pattern, SseHub &hub, SseTopic topic) {
+  Route route(HttpMethod::GET, pattern, nullptr, SseRoute);
+  route.setSse(&hub, std::move(topic));
+  addRoute(route);
+}
 
-      rc = pcre2_match(route.getCompiledPattern(), (PCRE2_SPTR)path.c_str(),
-                       subject_length, 0, 0, match_data, NULL);
+static void metricsHandler(Response *res) {
+  res->setHeader("Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+  res->Send(formatMetrics());
+}
 
-      if (rc >= 0 && route.getMethod() == method) {
-        size_t matchLength = pcre2_get_ovector_pointer(match_data)[1] -
-                             pcre2_get_ovector_pointer(match_data)[0];
+void Router::METRICS(const std::string &pattern) {
+  GET(pattern, metricsHandler);
+}
+
+RouteHandler Route::getRouteHandler() { return handler; }
 
-        // Ensure the match covers the entire string
-        if (matchLength == subject_length) {
-          if (matchLength > bestMatchLength) {
-            bestMatch = &route;
-            bestMatchLength = matchLength;
-          }
+// True if route's pattern matches all of path.
+static bool routeMatches(const Route &route, const std::string &path) {
+  // Use pre-compiled PCRE2 pattern
+  pcre2_match_data *match_data =
+      pcre2_match_data_create_from_pattern(route.getCompiledPattern(), NULL);
+  if (match_data == NULL) {
+    printf("Failed to create match data for pattern: %s\n",
+           route.getPattern().c_str());
+    return false;
+  }
+
+  int rc = pcre2_match(route.getCompiledPattern(), (PCRE2_SPTR)path.c_str(),
+                       path.size(), 0, 0, match_data, NULL);
+
+  // Ensure the match covers the entire string
+  bool matches = false;
+  if (rc >= 0) {
+    size_t matchLength = pcre2_get_ovector_pointer(match_data)[1] -
+                         pcre2_get_ovector_pointer(match_data)[0];
+    matches = matchLength > 0 && matchLength == path.size();
+  }
+  pcre2_match_data_free(match_data);
+  return matches;
+}
+
+Route *matchBestRoute(HttpMethod method, const std::string &path) {
+  // Under a mount, only the routes registered as overlapping it are tried,
+  // and only those whose literal start fits the path.
+  if (method == HttpMethod::GET) {
+    MountNode *mount = matchMount(path);
+    if (mount) {
+      for (const RoutePrefix &entry : mount->overlapping) {
+        bool fits = entry.exact ? path == entry.prefix
+                                : path.compare(0, entry.prefix.size(),
+                                               entry.prefix) == 0;
+        if (fits && routeMatches(routes[entry.route], path)) {
+          return &routes[entry.route];
         }
       }
+      return mount->route.get();
+    }
+  }
 
-      pcre2_match_data_free(match_data);
-    } else if (route.getType() == StaticRoute) {
-      // Match static route
-      if (route.getPattern() == path && route.getType() == StaticRoute) {
-        bestMatch = &route;
-        break;
-      }
-    } else {
+  for (auto &route : routes) {
+    if (route.getType() != NormalRoute && route.getType() != WebSocketRoute &&
+        route.getType() != SseRoute) {
       fprintf(stderr, "Unknown route type\n");
       return NULL;
     }
+    if (route.getMethod() == method && routeMatches(route, path)) {
+      return &route;
+    }
   }
-  return bestMatch;
+  return NULL;
 }
@@ -5,11 +5,59 @@
 
 #include <pcre2.h>
 
+#include <optional>
+
+#include "ioexecutor.hpp"
+#include "metrics.hpp"
+#include "precompress.hpp"
 #include "response.hpp"
+#include "sse.hpp"
+#include "staticroot.hpp"
+#include "websocket.hpp"
 
-typedef enum RouteType { NormalRoute, StaticRoute } RouteType;
+typedef enum RouteType {
+  NormalRoute,
+  StaticRoute,
+  EmbedRoute,
+  WebSocketRoute,
+  SseRoute
+} RouteType;
 typedef void (*RouteHandler)(Response *response);
 
+// Picks the SseHub topic of an event stream request. An empty topic
+// answers 404.
+typedef std::function<std::string(Request *request)> SseTopic;
+
+// Per-mount settings for a static directory.
+struct StaticPolicy {
+  // Files tried, in order, when a directory is requested.
+  std::vector<std::string> index_files = {"index.html"};
+
+  // Cache-Control header value for files from this mount (none if empty).
+  std::string cache_control;
+
+  // Files larger than this are refused with 403 (0 means no limit).
+  off64_t max_file_size = 0;
+
+  // Keep the directory open and resolve files beneath its fd. When false,
+  // files are opened by absolute path on every request.
+  bool use_fd_cache = true;
+
+  // Serve precompressed variants (see PrecompressedCache).
+  bool precompressed = false;
+  PrecompressOptions precompress;
+
+  // Media streaming profile, if any (see StreamingProfile).
+  std::optional<StreamingProfile> streaming;
+
+  // Files are opened, stat'ed and sent on an IoExecutor, not on the request
+  // workers. With io_workers == 0 the mount shares defaultIoExecutor();
+  // otherwise it gets its own executor with this many workers and queue
+  // depth. Requests beyond the queue depth get 503.
+  size_t io_workers = 0;
+  size_t io_queue_depth = IO_DEFAULT_QUEUE_DEPTH;
+};
+
 class Route {
   HttpMethod method;    // HTTP Method.
   std::string pattern;  // Pattern as a string
@@ -20,6 +68,27 @@ class Route {
   RouteHandler handler;  // Handler for the route
   RouteType type;        // Type of Route
   std::string dirname;   // Dirname for static route.
+  std::shared_ptr<StaticRoot> root;  // Directory for static route.
+
+  // Mount settings for static routes.
+  std::shared_ptr<const StaticPolicy> policy;
+
+  // Precompressed variants for static routes (null if disabled).
+  std::shared_ptr<PrecompressedCache> precompressed;
+
+  // Executor for blocking file I/O of static routes.
+  std::shared_ptr<IoExecutor> io;
+
+  const EmbeddedBundle *bundle;  // Files served by an embed route.
+
+  // Callbacks of a WebSocket route.
+  std::shared_ptr<const WebSocketHandlers> websocket;
+
+  SseHub *hub;     // Hub of an event stream route.
+  SseTopic topic;  // Topic of each request to it.
+
+  // Requests answered on the route, labelled with its method and pattern.
+  std::shared_ptr<RequestCounter> requests;
 
  public:
   // Public constructor
@@ -39,18 +108,51 @@ class Route {
   RouteHandler getHandler() const;
   RouteType getType() const;
   const std::string &getDirname() const;
+  const StaticRoot *getRoot() const;
   void setDirname(const std::string &dir) {
     if (type == StaticRoute) {
       dirname = dir;
     }
   }
+  const StaticPolicy *getStaticPolicy() const;
+  // Apply policy and open the directory. Call after setDirname.
+  void setStaticPolicy(const StaticPolicy &staticPolicy);
+  const StreamingProfile *getStreamingProfile() const;
+  PrecompressedCache *getPrecompressed() const;
+  IoExecutor *getIoExecutor() const;
+  const EmbeddedBundle *getBundle() const;
+  void setBundle(const EmbeddedBundle *files) {
+    if (type == EmbedRoute) {
+      bundle = files;
+    }
+  }
+  const std::shared_ptr<const WebSocketHandlers> &getWebSocket() const;
+  void setWebSocket(const WebSocketHandlers &handlers) {
+    if (type == WebSocketRoute) {
+      websocket = std::make_shared<const WebSocketHandlers>(handlers);
+    }
+  }
+  SseHub *getHub() const;
+  const SseTopic &getTopic() const;
+  RequestCounter *getRequests() const;
+  void setSse(SseHub *eventHub, SseTopic eventTopic) {
+    if (type == SseRoute) {
+      hub = eventHub;
+      topic = std::move(eventTopic);
+    }
+  }
 };
 
 // Function to expand the tilde (~) character in a path to
 // the user's home directory
 char *expandVar(const std::string &path);
 
-// Match the best regex pattern.
+// Match the best route for a request: the first regex pattern that matches
+// the whole path. GET requests are first looked up among the static and
+// embed mounts by longest path prefix (whole segments only), in O(path
+// length). Under a mount, the routes whose pattern may match paths there
+// (found when they are registered) are tried first, so that a mount at "/"
+// does not hide them; the mount serves the rest.
 Route *matchBestRoute(HttpMethod method, const std::string &path);
 
 // Global router;
@@ -64,9 +166,54 @@ class Router {
   void DELETE(const std::string &pattern, RouteHandler handler);
   void OPTIONS(const std::string &pattern, RouteHandler handler);
 
-  // Serve static directory at dirname.
+  // Serve static directory at dirname under the path prefix pattern.
   // e.g   STATIC("/web", "/var/www/html");
+  // Routes whose pattern matches a GET request take precedence over the
+  // mount (see matchBestRoute).
   void STATIC(const std::string &pattern, const std::string &dirname);
+
+  // Serve static directory at dirname with the given mount policy.
+  void STATIC(const std::string &pattern, const std::string &dirname,
+              const StaticPolicy &policy);
+
+  // Serve static directory at dirname with precompressed variants.
+  // Compressible files are compressed (gzip, and zstd if available) into a
+  // sidecar cache at startup and when they change, and the best variant is
+  // chosen from Accept-Encoding.
+  void STATIC(const std::string &pattern, const std::string &dirname,
+              const PrecompressOptions &precompress);
+
+  // Serve media files from dirname with the streaming profile: readahead
+  // prefetching, throughput-sized open-ended ranges and page cache dropping
+  // behind large reads.
+  // e.g   STREAM("/videos", "/srv/media");
+  void STREAM(const std::string &pattern, const std::string &dirname,
+              const StreamingProfile &profile = StreamingProfile());
+
+  // Serve files compiled into the binary with cppserver_embed_directory.
+  // The pattern is a path prefix: EMBED("/assets", bundle) serves the
+  // bundle's /app.js at /assets/app.js.
+  void EMBED(const std::string &pattern, const EmbeddedBundle &bundle);
+
+  // Accept WebSocket connections on the GET route pattern. Requests that
+  // are not a valid WebSocket handshake get 426 Upgrade Required.
+  // e.g   WEBSOCKET("/chat", {onOpen, onMessage, onClose});
+  void WEBSOCKET(const std::string &pattern,
+                 const WebSocketHandlers &handlers);
+
+  // Stream the events published to topic of hub (Server-Sent Events) on
+  // the GET route pattern. Reconnecting clients get the events they missed
+  // (Last-Event-ID) while the hub still has them.
+  // e.g   SSE("/events", hub, "news");
+  void SSE(const std::string &pattern, SseHub &hub, const std::string &topic);
+
+  // Same, with the topic chosen per request, e.g from a query parameter.
+  void SSE(const std::string &pattern, SseHub &hub, SseTopic topic);
+
+  // Serve the server's metrics (see metrics.hpp) in the Prometheus text
+  // format on the GET route pattern.
+  // e.g   METRICS("/metrics");
+  void METRICS(const std::string &pattern = "/metrics");
 };
 
 #endif /* ROUTER_H */
@@ -1,30 +1,80 @@
 #include "server.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+
+#include <sched.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "bufferpool.hpp"
 #include "client.hpp"
+#include "http2.hpp"
+#include "master.hpp"
+#include "metrics.hpp"
+#include "mime.hpp"
 #include "request.hpp"
 #include "response.hpp"
+#include "sse.hpp"
+#include "tls.hpp"
+#include "websocket.hpp"
 
 volatile sig_atomic_t should_exit = 0;
 
+static const Counter accepted_connections(
+    "cppserver_accepted_connections_total", "Connections accepted.");
+static const Counter accept_errors(
+    "cppserver_accept_errors_total",
+    "Failed accepts, e.g. for want of file descriptors.");
+static const Gauge busy_connections(
+    "cppserver_busy_connections",
+    "Connections with requests queued or being served.");
+static const Gauge upgraded_connections(
+    "cppserver_upgraded_connections",
+    "HTTP/2, WebSocket and event stream connections.");
+static const Histogram parse_seconds("cppserver_parse_seconds",
+                                     "Time taken to parse request heads.");
+static const Histogram handler_seconds(
+    "cppserver_handler_seconds",
+    "Time taken by route handlers, including the writes they make.");
+
 // Define a handler function for serving static files
 static void staticFileHandler(Response *res, Route *route);
 
-static void handle_sigint(int signal) {
-  if (signal == SIGINT || signal == SIGKILL) {
-    should_exit = 1;
-    printf("\nDetected %s (%d).\n", strsignal(signal), signal);
+// Serve a file compiled into the binary.
+static void embeddedFileHandler(Response *res, Route *route);
+
+// Eventfd the event loop waits on, written to wake it on a stop signal.
+static int stop_wake_fd = -1;
+
+// SIGINT, SIGTERM and SIGQUIT (from a prefork master) stop the server.
+static void handle_stop(int signal) {
+  int saved = errno;
+  should_exit = 1;
+  if (stop_wake_fd != -1) {
+    uint64_t one = 1;
+    ssize_t n = write(stop_wake_fd, &one, sizeof(one));
+    (void)n;
+  }
+  if (signal == SIGINT) {
+    const char message[] = "\nDetected Interrupt.\n";
+    ssize_t n = write(STDOUT_FILENO, message, sizeof(message) - 1);
+    (void)n;
   }
+  errno = saved;
 }
 
-static void install_sigint_handler() {
+static void install_signal_handlers(int wake_fd) {
+  stop_wake_fd = wake_fd;
   struct sigaction sa;
-  sa.sa_handler = handle_sigint;
+  sa.sa_handler = handle_stop;
   sigemptyset(&sa.sa_mask);
-  sa.sa_flags = 0;
+  sa.sa_flags = SA_RESTART; // Handlers' reads and writes go on.
   sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGQUIT, &sa, NULL);
 
   // Ignore SIGPIPE
   // Otherwise it will crash the program.
@@ -54,210 +104,1022 @@ void cppserver::epoll_ctl_add(int epoll_fd, int sock_fd,
   }
 }
 
-cppserver::TCPServer::TCPServer(int port) {
-  this->port = port;
-  server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd == -1) {
-    perror("socket");
+cppserver::TCPServer::TCPServer(EventBackend backend) {
+  loop = makeEventLoop(backend);
+  reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  worker_processes = 0;
+
+  // Completions posted by the I/O executors wake the loop through an eventfd.
+  completions = std::make_shared<CompletionQueue>();
+  loop->AddWake(completions->fd());
+
+  // One request worker per CPU, until SetCpuAffinity says where.
+  pool = new ThreadPool;
+}
+
+cppserver::TCPServer::TCPServer(int port, EventBackend backend)
+    : TCPServer(backend) {
+  AddListener("0.0.0.0:" + std::to_string(port));
+}
+
+void cppserver::TCPServer::AddListener(const std::string &address,
+                                       const ListenOptions &options) {
+  listeners.push_back(openListener(address, options));
+  loop->AddListener(listeners.back().fd);
+}
+
+bool cppserver::TCPServer::UsesTls(int listen_fd) const {
+  if (!tls) {
+    return false;
+  }
+  for (const Listener &listener : listeners) {
+    if (listener.fd == listen_fd) {
+      return listener.options.tls;
+    }
+  }
+  return false;
+}
+
+void cppserver::TCPServer::EnableTls(const TlsOptions &options) {
+  tls = std::make_unique<TlsContext>(options);
+}
+
+// Parse the CpuAffinity field named what, exiting if it is malformed or
+// names CPUs outside the process's affinity mask.
+static CpuList cpuListOrExit(const char *what, const std::string &text) {
+  CpuList cpus;
+  if (text.empty()) {
+    return cpus;
+  }
+  bool ok = parseCpuList(text, cpus);
+  cpu_set_t allowed;
+  if (ok && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int cpu : cpus) {
+      ok = ok && CPU_ISSET(cpu, &allowed);
+    }
+  }
+  if (!ok) {
+    fprintf(stderr, "CpuAffinity::%s: bad or unavailable CPUs \"%s\"\n",
+            what, text.c_str());
     exit(EXIT_FAILURE);
   }
-  nonblocking(server_fd);
+  return cpus;
+}
 
-  int enable = 1;
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) <
-      0) {
-    perror("setsockopt");
-    exit(1);
+void cppserver::TCPServer::SetCpuAffinity(const CpuAffinity &affinity) {
+  loop_cpus = cpuListOrExit("loop", affinity.loop);
+  CpuList workers = cpuListOrExit("workers", affinity.workers);
+  CpuList io = cpuListOrExit("io", affinity.io);
+
+  placement.clear();
+  if (!loop_cpus.empty()) {
+    placement += "loop " + formatCpuList(loop_cpus);
+  }
+  if (!workers.empty()) {
+    // No requests are queued before Listen; swap in pinned workers.
+    delete pool;
+    pool = new ThreadPool(workers);
+    placement += (placement.empty() ? "" : ", ") + std::string("workers ") +
+                 formatCpuList(workers);
   }
+  if (!io.empty()) {
+    placement += (placement.empty() ? "" : ", ") + std::string("io ") +
+                 formatCpuList(io);
+  }
+  setIoCpus(io);
+}
 
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = INADDR_ANY;
-  server_addr.sin_port = htons(port);
+void cppserver::TCPServer::SetWorkerProcesses(int count) {
+  worker_processes = count;
+}
+
+void cppserver::TCPServer::SetAccessLog(const AccessLogOptions &options) {
+  access_log = options;
+}
 
-  if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) ==
-      -1) {
-    perror("bind");
+void cppserver::TCPServer::Listen() {
+  if (listeners.empty()) {
+    fprintf(stderr, "No listeners; see TCPServer::AddListener\n");
     exit(EXIT_FAILURE);
   }
+  closeInheritedListeners();
 
-  // Listen for connections
-  if (listen(server_fd, SOMAXCONN) == -1) {
-    perror("listen");
-    exit(EXIT_FAILURE);
+  // Workers serve quietly; their master printed the banner.
+  bool worker = isWorkerProcess();
+  if (!worker) {
+    std::string addresses;
+    for (const Listener &listener : listeners) {
+      addresses += (addresses.empty() ? "" : ", ") + listener.address;
+      if (UsesTls(listener.fd)) {
+        addresses += " (TLS)";
+      }
+    }
+    printf("Server listening on %s (%s)\n", addresses.c_str(), loop->Name());
+    for (const Listener &listener : listeners) {
+      printf("  %s: %s\n", listener.address.c_str(),
+             describeListener(listener).c_str());
+    }
+    if (!placement.empty()) {
+      printf("  cpus: %s\n", placement.c_str());
+    }
+    if (worker_processes > 0) {
+      printf("  workers: %d processes, master pid %d\n", worker_processes,
+             getpid());
+      fflush(stdout);
+      runMaster(listeners, worker_processes);
+    }
+  } else {
+    for (Listener &listener : listeners) {
+      listener.unix_path.clear(); // The master removes the socket files.
+    }
   }
 
-  // Create epoll instance
-  epoll_fd = epoll_create1(0);
-  if (epoll_fd == -1) {
-    perror("epoll_create1");
-    exit(1);
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  startAccessLog(access_log);
+  install_signal_handlers(completions->fd());
+  if (!loop_cpus.empty() && !pinThread(pthread_self(), loop_cpus)) {
+    perror("pin event loop");
   }
+  reportReady();
+  RunForever();
+}
 
-  // register events with epoll
-  epoll_ctl_add(epoll_fd, server_fd, &event, EPOLLIN);
+// A connection's received requests. They are served in order by the
+// request workers, static files by their mount's IoExecutor so that slow
+// disks do not hold up the request workers.
+struct Connection {
+  explicit Connection(int fd);
+  ~Connection();
 
-  // Init thread pool with
-  pool = new ThreadPool;
+  int fd;                           // Socket, counted in serving.
+  std::unique_ptr<cppserver::Client> client;
+  std::string input;                // Bytes received, in a pooled buffer.
+  size_t next;                      // Offset of the next request in input.
+  std::chrono::steady_clock::time_point partial; // When the partial request
+                                                 // at next was put aside.
+  std::unique_ptr<Request> request; // Parsed request handed to an executor.
+  Route *route;                     // Route of request.
+  bool keep_alive;                  // Wait for more requests when done.
+  EventLoop *loop;
+  ThreadPool *pool;
+  std::shared_ptr<CompletionQueue> completions;
+};
+
+// Sockets of the connections being served, for the drain, with how many
+// Connections serve each. A socket is counted from when its request is
+// queued, so that requests still waiting for a worker are drained too,
+// until its Connection is done. The socket may by then be closed and its
+// number reused by a newly queued connection, so each Connection takes
+// back only its own count.
+static std::mutex serving_mutex;
+static std::unordered_map<int, int> serving;
+
+static void startServing(int fd) {
+  busy_connections.Add(1);
+  std::lock_guard<std::mutex> lock(serving_mutex);
+  serving[fd]++;
 }
 
-int cppserver::TCPServer::Accept() {
-  int client_fd;
-  socklen_t client_len = sizeof(server_addr);
-  client_fd = accept(server_fd, (struct sockaddr *)&server_addr, &client_len);
-  if (client_fd != -1) {
-    nonblocking(client_fd);
-    epoll_ctl_add(epoll_fd, client_fd, &event,
-                  EPOLLIN | EPOLLET | EPOLLONESHOT);
+Connection::Connection(int fd) : fd(fd) {}
+
+Connection::~Connection() {
+  // A parked connection took its input along; otherwise the buffer is no
+  // longer needed.
+  recvBufferPool().Release(std::move(input));
+  busy_connections.Add(-1);
+  std::lock_guard<std::mutex> lock(serving_mutex);
+  auto it = serving.find(fd);
+  if (it != serving.end() && --it->second == 0) {
+    serving.erase(it);
   }
-  return client_fd;
 }
 
-void cppserver::TCPServer::Listen() {
-  curl_global_init(CURL_GLOBAL_DEFAULT);
-  install_sigint_handler();
+// Upgraded connections by socket, so that their input goes to them rather
+// than to the HTTP/1 parser.
+static std::mutex upgraded_mutex;
+static std::unordered_map<int, std::shared_ptr<UpgradedConnection>> upgraded;
 
-  printf("Server listening on port %d\n", port);
-  RunForever();
+// Send the input of upgrade's socket to it from now on.
+static void registerUpgraded(std::shared_ptr<UpgradedConnection> upgrade) {
+  std::lock_guard<std::mutex> lock(upgraded_mutex);
+  if (upgraded.insert_or_assign(upgrade->fd(), upgrade).second) {
+    upgraded_connections.Add(1);
+  }
 }
 
-static void handleRequest(int client_fd, int epoll_fd) {
-  cppserver::Client client(client_fd, epoll_fd);
-  std::string request_buffer;
-  int bytes_read = client.Read(request_buffer);
+// Forget upgrade; its socket is closed once nothing else holds it.
+static void unregisterUpgraded(std::shared_ptr<UpgradedConnection> upgrade) {
+  std::lock_guard<std::mutex> lock(upgraded_mutex);
+  if (upgraded.erase(upgrade->fd()) > 0) {
+    upgraded_connections.Add(-1);
+  }
+}
 
-  if (bytes_read == -1) {
-    client.SendHttpError(HttpStatus::StatusBadRequest,
-                         "Unable to process request\n");
+// A connection waiting on the event loop for input, whose Client must
+// survive until then (see Client::Stateful), or that has received part of
+// a request.
+struct ParkedConnection {
+  std::unique_ptr<cppserver::Client> client;
+  std::string input;                             // The partial request.
+  std::chrono::steady_clock::time_point partial; // When it was put aside.
+};
+
+// Parked connections by socket.
+static std::mutex parked_mutex;
+static std::unordered_map<int, ParkedConnection> parked;
+
+static void parkClient(std::unique_ptr<cppserver::Client> client,
+                       std::string input = "",
+                       std::chrono::steady_clock::time_point partial = {}) {
+  std::lock_guard<std::mutex> lock(parked_mutex);
+  int fd = client->fd();
+  parked[fd] = {std::move(client), std::move(input), partial};
+}
+
+// Returns the parked connection of fd, with a null client if there is none.
+static ParkedConnection unparkClient(int fd) {
+  std::lock_guard<std::mutex> lock(parked_mutex);
+  auto it = parked.find(fd);
+  if (it == parked.end()) {
+    return {};
+  }
+  ParkedConnection connection = std::move(it->second);
+  parked.erase(it);
+  return connection;
+}
+
+// Shut the receiving side of connections whose partial request has waited
+// REQUEST_TIMEOUT_MS, so that the event loop reports them and they are
+// answered as incomplete. Checks once a second.
+static void expirePartialRequests() {
+  static std::chrono::steady_clock::time_point checked;
+  auto now = std::chrono::steady_clock::now();
+  if (now - checked < std::chrono::seconds(1)) {
     return;
   }
+  checked = now;
 
-  // Create a new request.
-  std::unique_ptr<Request> req = std::make_unique<Request>();
+  std::lock_guard<std::mutex> lock(parked_mutex);
+  for (const auto &entry : parked) {
+    if (!entry.second.input.empty() &&
+        now - entry.second.partial >=
+            std::chrono::milliseconds(REQUEST_TIMEOUT_MS)) {
+      shutdown(entry.first, SHUT_RD);
+    }
+  }
+}
 
-  try {
-    req->ParseHttp(request_buffer);
-  } catch (const std::exception &e) {
-    std::cerr << "Exception caught: " << e.what() << std::endl;
-    client.SendHttpError(HttpStatus::StatusBadRequest, e.what());
+// Hand the connection back to the event loop, which waits for the next
+// requests on it, or the rest of a partial one, or closes it.
+static void finishConnection(std::shared_ptr<Connection> conn) {
+  if (conn->keep_alive &&
+      (conn->client->Stateful() || !conn->input.empty()) &&
+      conn->client->Flush()) {
+    int fd = conn->client->fd();
+    EventLoop *loop = conn->loop;
+    // Only a partial request keeps its buffer while the connection waits.
+    std::string partial_input;
+    if (!conn->input.empty()) {
+      partial_input = std::move(conn->input);
+    }
+    parkClient(std::move(conn->client), std::move(partial_input),
+               conn->partial);
+    conn->completions->Post([loop, fd]() { loop->ArmClient(fd); });
     return;
   }
 
-  try {
-    Response response(&client, req);
-    Route *matchingRoute =
-        matchBestRoute(req->getMethod(), req->getURL()->path);
-    if (!matchingRoute) {
-      client.SendHttpError(HttpStatus::StatusNotFound, "Not Found");
-      return;
-    }
+  std::shared_ptr<cppserver::Client> client = std::move(conn->client);
+  if (!conn->keep_alive || !client->Flush()) {
+    conn->completions->Post([client]() {});
+    return;
+  }
+
+  EventLoop *loop = conn->loop;
+  conn->completions->Post(
+      [client, loop]() { loop->ArmClient(client->Release()); });
+}
+
+// Count a request answered with status, and log it. sent is
+// client->BodyBytesSent() before the response, start when serving began.
+static void recordRequest(RequestCounter &requests, cppserver::Client *client,
+                          Request *req, int status, uint64_t sent,
+                          uint64_t start) {
+  requests.Add(status);
+  logAccess({client, req, status, client->BodyBytesSent() - sent, start});
+}
 
-    if (matchingRoute->getType() == NormalRoute) {
-      RouteHandler handler = matchingRoute->getRouteHandler();
+// Serve one parsed request. Returns false if the connection must be closed
+// afterwards.
+static bool serveRequest(cppserver::Client *client,
+                         std::unique_ptr<Request> &req, Route *route) {
+  Response response(client, req);
+  if (!req->KeepAlive()) {
+    response.setHeader("Connection", "close");
+  }
+
+  // Record the request with the status its handler answered.
+  takeResponseStatus();
+  uint64_t start = metricsNow();
+  uint64_t sent = client->BodyBytesSent();
+  auto count = [client, &req, route, start, sent]() {
+    handler_seconds.RecordSince(start);
+    recordRequest(*route->getRequests(), client, req.get(),
+                  takeResponseStatus(), sent, start);
+  };
+
+  try {
+    if (route->getType() == NormalRoute) {
+      RouteHandler handler = route->getRouteHandler();
       handler(&response);
+    } else if (route->getType() == WebSocketRoute) {
+      // Not a (valid) handshake, or not HTTP/1.1.
+      response.setHeader("Sec-WebSocket-Version", "13");
+      response.setStatus(HttpStatus::StatusUpgradeRequired);
+      response.Send("Upgrade Required");
+    } else if (route->getType() == SseRoute) {
+      // No topic, or an HTTP/2 stream.
+      if (route->getTopic()(req.get()).empty()) {
+        client->SendHttpError(HttpStatus::StatusNotFound, "Not Found");
+      } else {
+        client->SendHttpError(HttpStatus::StatusHTTPVersionNotSupported,
+                              "Event streams need HTTP/1.1");
+      }
+    } else if (route->getType() == EmbedRoute) {
+      embeddedFileHandler(&response, route);
     } else {
-      staticFileHandler(&response, matchingRoute);
+      staticFileHandler(&response, route);
     }
-
   } catch (std::exception &e) {
+    count();
     std::cerr << "error sending response: " << e.what() << std::endl;
+    return false;
   }
+  count();
+
+  // Handlers that send nothing leave the client waiting; close instead.
+  Header *connection = response.findResponseHeader("Connection");
+  return response.isHeadersSent() &&
+         !(connection && connection->value == "close");
 }
 
-void cppserver::TCPServer::HandleClient(int client_fd) {
-  pool->QueueJob(handleRequest, client_fd, epoll_fd);
+// Answer an HTTP/2 stream like an HTTP/1 request: static files on the
+// mount's I/O executor, everything else on a request worker. Nothing is
+// written here: this runs on the session's reader, and a response may
+// have to wait for WINDOW_UPDATE frames that only the reader can receive.
+static void serveStream(std::shared_ptr<Http2Stream> stream,
+                        ThreadPool *pool) {
+  std::unique_ptr<Request> &req = stream->getRequest();
+  Route *route = matchBestRoute(req->getMethod(), req->getURL()->path);
+  uint64_t start = metricsNow();
+
+  auto job = [stream, route, start]() {
+    if (route) {
+      serveRequest(stream.get(), stream->getRequest(), route);
+    } else {
+      stream->SendHttpError(HttpStatus::StatusNotFound, "Not Found");
+      recordRequest(unroutedRequests(), stream.get(),
+                    stream->getRequest().get(), HttpStatus::StatusNotFound,
+                    0, start);
+    }
+    stream->Finish();
+  };
+
+  if (!route || route->getType() != StaticRoute) {
+    pool->QueueJob(job);
+  } else if (!route->getIoExecutor()->Submit(job)) {
+    pool->QueueJob([stream, route, start]() {
+      stream->SendHttpError(HttpStatus::StatusServiceUnavailable,
+                            "Service Unavailable");
+      recordRequest(*route->getRequests(), stream.get(),
+                    stream->getRequest().get(),
+                    HttpStatus::StatusServiceUnavailable, 0, start);
+      stream->Finish();
+    });
+  }
+}
+
+// Threads that process the input of upgraded connections. HTTP/2 stream
+// handlers may wait for flow control window on the request workers and I/O
+// executors, so the WINDOW_UPDATE frames that let them continue must be
+// read elsewhere.
+static IoExecutor &upgradeReaders() {
+  static IoExecutor readers(UPGRADE_READERS, IO_DEFAULT_QUEUE_DEPTH);
+  return readers;
+}
+
+// Process input of an upgraded connection, then wait for more or forget
+// the connection once it is done.
+static void receiveUpgraded(std::shared_ptr<UpgradedConnection> upgrade,
+                            std::string data, EventLoop *loop,
+                            std::shared_ptr<CompletionQueue> completions) {
+  if (upgrade->Receive(std::move(data))) {
+    completions->Post([upgrade, loop]() { loop->ArmClient(upgrade->fd()); });
+    return;
+  }
+
+  unregisterUpgraded(upgrade);
 }
 
-void cppserver::TCPServer::UnregisterClient(int client_fd) {
-  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
+// Hand input of an upgraded connection to the readers.
+static void submitUpgradedInput(std::shared_ptr<UpgradedConnection> upgrade,
+                                std::string data, EventLoop *loop,
+                                std::shared_ptr<CompletionQueue> completions) {
+  auto input = std::make_shared<std::string>(std::move(data));
+  if (!upgradeReaders().Submit([upgrade, input, loop, completions]() {
+        receiveUpgraded(upgrade, std::move(*input), loop, completions);
+      })) {
+    // Overloaded; drop the connection.
+    unregisterUpgraded(upgrade);
+  }
+}
+
+// Pass what conn received after the upgrade request to upgrade, or wait
+// for its first input.
+static void resumeUpgraded(std::shared_ptr<Connection> conn,
+                           std::shared_ptr<UpgradedConnection> upgrade) {
+  if (conn->next == conn->input.size()) {
+    EventLoop *loop = conn->loop;
+    conn->completions->Post(
+        [upgrade, loop]() { loop->ArmClient(upgrade->fd()); });
+    return;
+  }
+  upgrade->Feed(conn->input.substr(conn->next));
+  submitUpgradedInput(upgrade, "", conn->loop, conn->completions);
+}
+
+// Switch conn to HTTP/2. upgrade is the request that asked for h2c and
+// becomes stream 1; without it the client sent the connection preface.
+static void startHttp2(std::shared_ptr<Connection> conn,
+                       std::unique_ptr<Request> upgrade) {
+  conn->client->Flush();
+  ThreadPool *pool = conn->pool;
+  auto session = std::make_shared<Http2Session>(
+      std::move(conn->client),
+      [pool](std::shared_ptr<Http2Stream> stream) {
+        serveStream(stream, pool);
+      });
+
+  registerUpgraded(session);
+  if (!session->Start(std::move(upgrade))) {
+    unregisterUpgraded(session);
+    return;
+  }
+  resumeUpgraded(conn, session);
+}
+
+// Switch conn to the WebSocket protocol for route, after the 101 response
+// to req has been queued.
+static void startWebSocket(std::shared_ptr<Connection> conn,
+                           std::unique_ptr<Request> req, Route *route,
+                           const WebSocketDeflate &deflate) {
+  if (!conn->client->Flush()) {
+    return;
+  }
+  auto websocket = std::make_shared<WebSocket>(
+      std::move(conn->client), std::move(req), route->getWebSocket(),
+      deflate);
+
+  registerUpgraded(websocket);
+  websocket->Open();
+  resumeUpgraded(conn, websocket);
+}
+
+// Turn conn into an event stream of topic on route's hub. The subscriber
+// stays registered so that the event loop can report it writable.
+static void startEventStream(std::shared_ptr<Connection> conn,
+                             std::unique_ptr<Request> req, Route *route,
+                             const std::string &topic) {
+  if (!conn->client->Flush()) {
+    return;
+  }
+  auto subscriber = std::make_shared<SseSubscriber>(
+      std::move(conn->client), conn->loop, conn->completions,
+      [](std::shared_ptr<SseSubscriber> done) { unregisterUpgraded(done); });
+
+  registerUpgraded(subscriber);
+  Header *last_event_id = req->findRequestHeader("Last-Event-ID");
+  route->getHub()->Subscribe(topic, subscriber,
+                             last_event_id ? &last_event_id->value : nullptr);
+}
+
+// Returns true if req asks to switch to h2c. Requests with a body are
+// answered over HTTP/1.1 instead of being upgraded.
+static bool wantsH2cUpgrade(Request &req) {
+  Header *upgrade = req.findRequestHeader("Upgrade");
+  return upgrade && upgrade->value.find("h2c") != std::string::npos &&
+         req.findRequestHeader("HTTP2-Settings") && req.Body().empty();
+}
+
+// Serve the requests in conn->input in order, batching the responses.
+// Runs on a request worker, or on executor, the I/O executor of the mount
+// of the static file being served. Each request moves to where it belongs
+// before it is served.
+static void serveConnection(std::shared_ptr<Connection> conn,
+                            IoExecutor *executor) {
+  cppserver::Client *client = conn->client.get();
+  client->Cork();
+
+  while (true) {
+    std::unique_ptr<Request> req = std::move(conn->request);
+    Route *route = conn->route;
+
+    if (!req) {
+      uint64_t start = metricsNow();
+      uint64_t sent = client->BodyBytesSent();
+
+      // HTTP/2 with prior knowledge.
+      if (conn->next == 0 && isHttp2Preface(conn->input)) {
+        startHttp2(conn, nullptr);
+        return;
+      }
+
+      size_t length;
+      try {
+        length = completeRequestLength(conn->input, conn->next);
+      } catch (const RequestError &e) {
+        client->SendHttpError(e.status, e.what());
+        recordRequest(unroutedRequests(), client, nullptr, e.status, sent,
+                      start);
+        conn->keep_alive = false;
+        break;
+      }
+      if (length == 0) {
+        if (conn->next == conn->input.size()) {
+          break;
+        }
+
+        if (client->PeerClosed()) {
+          client->SendHttpError(HttpStatus::StatusBadRequest,
+                                "Incomplete request");
+          recordRequest(unroutedRequests(), client, nullptr,
+                        HttpStatus::StatusBadRequest, sent, start);
+          conn->keep_alive = false;
+          break;
+        }
+
+        // Put the partial request aside and free this thread while the
+        // event loop waits for the rest; completeRequestLength bounds how
+        // much of it is kept.
+        conn->input.erase(0, conn->next);
+        conn->next = 0;
+        if (conn->partial == std::chrono::steady_clock::time_point()) {
+          conn->partial = std::chrono::steady_clock::now();
+        }
+        finishConnection(conn);
+        return;
+      }
+
+      req = std::make_unique<Request>();
+      try {
+        req->ParseHttp(conn->input, conn->next);
+      } catch (const std::exception &e) {
+        std::cerr << "Exception caught: " << e.what() << std::endl;
+        client->SendHttpError(HttpStatus::StatusBadRequest, e.what());
+        recordRequest(unroutedRequests(), client, nullptr,
+                      HttpStatus::StatusBadRequest, sent, start);
+        conn->keep_alive = false;
+        break;
+      }
+      parse_seconds.RecordSince(start);
+      conn->next += length;
+      conn->partial = {};
+
+      if (wantsH2cUpgrade(*req)) {
+        client->Send("HTTP/1.1 101 Switching Protocols\r\n"
+                     "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+        startHttp2(conn, std::move(req));
+        return;
+      }
+
+      route = matchBestRoute(req->getMethod(), req->getURL()->path);
+      if (!route) {
+        client->SendHttpError(HttpStatus::StatusNotFound, "Not Found");
+        recordRequest(unroutedRequests(), client, req.get(),
+                      HttpStatus::StatusNotFound, sent, start);
+        if (!req->KeepAlive()) {
+          conn->keep_alive = false;
+          break;
+        }
+        continue;
+      }
+
+      std::string handshake;
+      WebSocketDeflate deflate;
+      if (route->getType() == WebSocketRoute &&
+          webSocketHandshake(*req, route->getWebSocket()->options, handshake,
+                             deflate)) {
+        client->Send(handshake);
+        client->CountHead(handshake.size());
+        recordRequest(*route->getRequests(), client, req.get(),
+                      HttpStatus::StatusSwitchingProtocols, sent, start);
+        startWebSocket(conn, std::move(req), route, deflate);
+        return;
+      }
+
+      if (route->getType() == SseRoute) {
+        std::string topic = route->getTopic()(req.get());
+        if (!topic.empty()) {
+          recordRequest(*route->getRequests(), client, req.get(),
+                        HttpStatus::StatusOK, sent, start);
+          startEventStream(conn, std::move(req), route, topic);
+          return;
+        }
+      }
+
+      // Static files are served on their mount's I/O executor, everything
+      // else on the request workers.
+      IoExecutor *target = route->getType() == StaticRoute
+                               ? route->getIoExecutor()
+                               : nullptr;
+      if (target != executor) {
+        client->Flush();
+        conn->request = std::move(req);
+        conn->route = route;
+        if (!target) {
+          conn->pool->QueueJob([conn]() { serveConnection(conn, nullptr); });
+          return;
+        }
+        if (target->Submit(
+                [conn, target]() { serveConnection(conn, target); })) {
+          return;
+        }
+
+        client->SendHttpError(HttpStatus::StatusServiceUnavailable,
+                              "Service Unavailable");
+        recordRequest(*route->getRequests(), client, conn->request.get(),
+                      HttpStatus::StatusServiceUnavailable, sent, start);
+        conn->request.reset();
+        conn->keep_alive = false;
+        break;
+      }
+    }
+
+    if (!serveRequest(client, req, route)) {
+      conn->keep_alive = false;
+      break;
+    }
+  }
+
+  // Everything received has been answered.
+  conn->input.clear();
+  conn->next = 0;
+  finishConnection(conn);
+}
+
+static void handleRequest(int client_fd, std::string received,
+                          EventLoop *loop, ThreadPool *pool,
+                          std::shared_ptr<CompletionQueue> completions) {
+  auto conn = std::make_shared<Connection>(client_fd);
+  ParkedConnection parked_connection = unparkClient(client_fd);
+  conn->client = std::move(parked_connection.client);
+  if (!conn->client) {
+    conn->client = std::make_unique<cppserver::Client>(client_fd);
+  }
+  conn->input = std::move(parked_connection.input);
+  if (conn->input.empty()) {
+    conn->input = recvBufferPool().Acquire();
+  }
+  conn->partial = parked_connection.partial;
+  conn->next = 0;
+  conn->route = nullptr;
+  conn->keep_alive = true;
+  conn->loop = loop;
+  conn->pool = pool;
+  conn->completions = completions;
+
+  // The event loop may already have received the start of the requests.
+  conn->client->TakeReceived(std::move(received), conn->input);
+
+  // A TLS handshake waits for input on the event loop, not here.
+  int handshake = conn->client->Handshake();
+  if (handshake != 1) {
+    if (handshake == 0) {
+      finishConnection(conn);
+    }
+    return;
+  }
+
+  int bytes_read = conn->client->Read(conn->input);
+  if (bytes_read == -1) {
+    conn->client->SendHttpError(HttpStatus::StatusBadRequest,
+                                "Unable to process request\n");
+    return;
+  }
+
+  // The client closed an idle connection, or sent too little to decrypt.
+  if (bytes_read == 0) {
+    if (!conn->client->PeerClosed()) {
+      finishConnection(conn);
+    }
+    return;
+  }
+
+  serveConnection(conn, nullptr);
+}
+
+void cppserver::TCPServer::HandleClient(int client_fd, std::string received) {
+  std::shared_ptr<UpgradedConnection> upgrade;
+  {
+    std::lock_guard<std::mutex> lock(upgraded_mutex);
+    auto it = upgraded.find(client_fd);
+    if (it != upgraded.end()) {
+      upgrade = it->second;
+    }
+  }
+  if (upgrade) {
+    submitUpgradedInput(upgrade, std::move(received), loop.get(),
+                        completions);
+    return;
+  }
+
+  startServing(client_fd);
+  pool->QueueJob(handleRequest, client_fd, std::move(received), loop.get(),
+                 pool, completions);
+}
+
+void cppserver::TCPServer::HandleAccept(const LoopEvent &event) {
+  if (event.fd != -1) {
+    accepted_connections.Add();
+    cppserver::Client::CountAccepted();
+    if (UsesTls(event.listener)) {
+      parkClient(std::make_unique<TlsClient>(event.fd, *tls));
+    }
+    loop->ArmClient(event.fd);
+    return;
+  }
+
+  accept_errors.Add();
+
+  // Out of descriptors, the first waiting connection would stay in the
+  // backlog and wake the loop again and again. Close it instead, using the
+  // descriptor kept in reserve for this.
+  if ((event.error == EMFILE || event.error == ENFILE) && reserve_fd != -1) {
+    close(reserve_fd);
+    int fd = accept4(event.listener, NULL, NULL, SOCK_CLOEXEC);
+    if (fd != -1) {
+      close(fd);
+    }
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+
+  // Other failures (e.g. ENOBUFS) are retried on the next wakeup. Report
+  // them at most once a second.
+  static time_t reported = 0;
+  time_t now = time(NULL);
+  if (now != reported) {
+    reported = now;
+    fprintf(stderr, "accept: %s\n", strerror(event.error));
+  }
+}
+
+void cppserver::TCPServer::HandleWritable(int client_fd) {
+  std::shared_ptr<UpgradedConnection> upgrade;
+  {
+    std::lock_guard<std::mutex> lock(upgraded_mutex);
+    auto it = upgraded.find(client_fd);
+    if (it != upgraded.end()) {
+      upgrade = it->second;
+    }
+  }
+  if (upgrade) {
+    upgrade->Writable();
+  }
+}
+
+bool cppserver::TCPServer::Dispatch(int timeout_ms) {
+  ready.clear();
+  if (loop->Wait(ready, timeout_ms) == -1) {
+    if (errno == EINTR) {
+      return true;
+    }
+    perror(loop->Name());
+    return false;
+  }
+
+  for (LoopEvent &event : ready) {
+    switch (event.type) {
+    case LoopEvent::Wake:
+      completions->Drain();
+      break;
+    case LoopEvent::Accept:
+      HandleAccept(event);
+      break;
+    case LoopEvent::Readable:
+      HandleClient(event.fd, std::move(event.data));
+      break;
+    case LoopEvent::Writable:
+      HandleWritable(event.fd);
+      break;
+    }
+  }
+  return true;
 }
 
 void cppserver::TCPServer::RunForever() {
   while (!should_exit) {
-    int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
-    if (nfds == -1) {
-      perror("epoll_wait");
-      break;
+    if (!Dispatch(1000)) {
+      return;
     }
+    expirePartialRequests();
+  }
+  Drain();
+}
 
-    for (int i = 0; i < nfds; i++) {
-      if (events[i].data.fd == server_fd) {
-        int client_fd = Accept();
-        if (client_fd == -1) {
-          perror("accept");
-          std::cout << "failed to accept new connection" << std::endl;
-          exit(1);
-        }
-      } else {
-        int client_fd = events[i].data.fd;
-        HandleClient(client_fd);
-      }
+// True while requests or upgraded connections are being served.
+static bool stillServing() {
+  {
+    std::lock_guard<std::mutex> lock(serving_mutex);
+    if (!serving.empty()) {
+      return true;
     }
   }
+  std::lock_guard<std::mutex> lock(upgraded_mutex);
+  return !upgraded.empty();
 }
 
-cppserver::TCPServer::~TCPServer() {
-  curl_global_cleanup();
+// Shut down the sockets of everything still being served, so that the
+// threads serving them fail their next read or write. Returns how many.
+static size_t shutDownServing() {
+  size_t count = 0;
+  {
+    std::lock_guard<std::mutex> lock(serving_mutex);
+    for (const auto &entry : serving) {
+      shutdown(entry.first, SHUT_RDWR);
+      count++;
+    }
+  }
+  std::lock_guard<std::mutex> lock(upgraded_mutex);
+  for (const auto &entry : upgraded) {
+    shutdown(entry.first, SHUT_RDWR);
+    count++;
+  }
+  return count;
+}
+
+void cppserver::TCPServer::Drain() {
+  setClosingConnections(true);
+  for (const Listener &listener : listeners) {
+    loop->RemoveListener(listener.fd);
+    // Refuse new connections at once, unless another process accepts them.
+    if (!listener.shared) {
+      shutdown(listener.fd, SHUT_RDWR);
+    }
+  }
 
-  pool->Wait();
-  pool->Stop();
-  delete pool;
+  std::vector<std::shared_ptr<UpgradedConnection>> upgrades;
+  {
+    std::lock_guard<std::mutex> lock(upgraded_mutex);
+    for (const auto &entry : upgraded) {
+      upgrades.push_back(entry.second);
+    }
+  }
+  for (const std::shared_ptr<UpgradedConnection> &upgrade : upgrades) {
+    upgrade->GoAway();
+  }
+  upgrades.clear();
 
-  shutdown(server_fd, SHUT_RDWR);
-  close(server_fd);
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(DRAIN_TIMEOUT_MS);
+  while (stillServing()) {
+    if (std::chrono::steady_clock::now() >= deadline) {
+      fprintf(stderr, "Drain timed out; shutting down %zu connections\n",
+              shutDownServing());
+      return;
+    }
+    if (!Dispatch(50)) {
+      return;
+    }
+  }
 }
 
-#define MAX_PATH_SIZE 256
+cppserver::TCPServer::~TCPServer() {
+  curl_global_cleanup();
+
+  // Requests that outlive the drain by another DRAIN_TIMEOUT_MS are left
+  // to fail on their shut down sockets while the process exits.
+  if (pool->WaitFor(std::chrono::milliseconds(DRAIN_TIMEOUT_MS))) {
+    pool->Stop();
+    delete pool;
+  } else {
+    fprintf(stderr, "Abandoning requests still running after the drain\n");
+    pool->Abandon();
+  }
+  stopAccessLog();
+
+  // Connections still being served are closed when they finish.
+  completions->Close();
 
-static int is_directory(const char *path) {
-  struct stat path_stat;
-  stat(path, &path_stat);
-  return S_ISDIR(path_stat.st_mode);
+  for (Listener &listener : listeners) {
+    closeListener(listener);
+  }
+  if (reserve_fd != -1) {
+    close(reserve_fd);
+  }
 }
 
 // Define a handler function for serving static files
 static void staticFileHandler(Response *res, Route *route) {
-  const char *dirname = route->getDirname().c_str();
-  const char *requestedPath = res->getRequest()->getURL()->path.c_str();
+  const std::string &requestedPath = res->getRequest()->getURL()->path;
+  const std::string &pattern = route->getPattern();
+  const StaticRoot *root = route->getRoot();
+  const StaticPolicy *policy = route->getStaticPolicy();
 
-  // trim prefix(context.route.pattern) from requested path
-  // e.g /static -> /
-  // Trim the prefix from the requested path
-  const char *trimmedPath = requestedPath + route->getPattern().size();
+  // Trim the prefix(route pattern) from the requested path, then decode and
+  // normalize the rest in one pass. e.g /static/css/../app.js -> app.js
+  std::string_view trimmedPath(requestedPath);
+  trimmedPath.remove_prefix(std::min(pattern.size(), trimmedPath.size()));
+
+  std::string relpath;
+  if (!normalizeRequestPath(trimmedPath, relpath)) {
+    res->getClient()->SendHttpError(HttpStatus::StatusNotFound, "Not Found");
+    return;
+  }
+
+  // Resolve beneath the mount's directory; directories serve the first
+  // index file that exists.
+  int fd = root->Open(relpath, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd != -1 && fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+    close(fd);
+    fd = -1;
+
+    std::string dirpath = relpath.empty() ? relpath : relpath + "/";
+    for (const std::string &index : policy->index_files) {
+      fd = root->Open(dirpath + index, O_RDONLY | O_CLOEXEC);
+      if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        relpath = dirpath + index;
+        break;
+      }
+      if (fd != -1) {
+        close(fd);
+        fd = -1;
+      }
+    }
+  }
 
-  // Build the full file path by concatenating the requested path with the
-  // directory path
-  char fullFilePath[MAX_PATH_SIZE];
-  snprintf(fullFilePath, MAX_PATH_SIZE, "%s%s", dirname, trimmedPath);
+  if (fd == -1) {
+    res->getClient()->SendHttpError(HttpStatus::StatusNotFound, "Not Found");
+    return;
+  }
 
-  char decodedPath[MAX_PATH_SIZE];
-  urldecode(decodedPath, sizeof(decodedPath), fullFilePath);
+  if (policy->max_file_size > 0 && fstat(fd, &st) == 0 &&
+      st.st_size > policy->max_file_size) {
+    close(fd);
+    res->getClient()->SendHttpError(HttpStatus::StatusForbidden, "Forbidden");
+    return;
+  }
 
-  printf("[STATIC]: %s\n", decodedPath);
+  if (!policy->cache_control.empty()) {
+    res->setHeader("Cache-Control", policy->cache_control);
+  }
 
-  // If it's a directory, append /index.html to decoded path
-  if (is_directory(decodedPath)) {
-    // temporary buffer to hold the concatenated path
-    char tempPath[MAX_PATH_SIZE + 16];
+  std::string filePath = root->path();
+  if (filePath.empty() || filePath.back() != '/') {
+    filePath += '/';
+  }
+  filePath += relpath;
 
-    if (decodedPath[strlen(decodedPath) - 1] == '/') {
-      snprintf(tempPath, sizeof(tempPath), "%sindex.html", decodedPath);
-    } else {
-      snprintf(tempPath, sizeof(tempPath), "%s/index.html", decodedPath);
+  PrecompressedCache *precompressed = route->getPrecompressed();
+  if (precompressed) {
+    if (precompressed->IsCachePath(filePath)) {
+      close(fd);
+      res->getClient()->SendHttpError(HttpStatus::StatusNotFound, "Not Found");
+      return;
     }
 
-    // Check if the resulting path is within bounds
-    if (strlen(tempPath) < MAX_PATH_SIZE) {
-      strcpy(decodedPath, tempPath);
-    } else {
-      // Handle the case where the concatenated path exceeds the buffer size
-      std::cerr << "Error: Concatenated path exceeds buffer size" << std::endl;
+    // Serve a precompressed variant if the client accepts one. Range
+    // requests always get the identity representation.
+    std::string_view type = getContentType(relpath);
+    if (isCompressibleType(type)) {
+      res->setHeader("Vary", "Accept-Encoding");
 
-      res->getClient()->SendHttpError(
-          HttpStatus::StatusBadRequest,
-          "url is too long to fit in 256 characters");
+      Header *accept = res->getRequest()->findRequestHeader("Accept-Encoding");
+      Header *range = res->getRequest()->findRequestHeader("Range");
+      PrecompressedVariant variant;
+      if (accept && !range &&
+          precompressed->Select(filePath, accept->value, variant)) {
+        close(fd);
+        res->setHeader("Content-Type", std::string(type));
+        res->setHeader("Content-Encoding", std::string(variant.encoding));
+        res->SendFile(variant.path, route->getStreamingProfile());
+        return;
+      }
     }
   }
 
-  res->SendFile(decodedPath);
+  res->SendFile(fd, filePath, route->getStreamingProfile());
+}
+
+static void embeddedFileHandler(Response *res, Route *route) {
+  const std::string &path = res->getRequest()->getURL()->path;
+  const std::string &prefix = route->getPattern();
+  size_t prefixLength = prefix == "/" ? 0 : prefix.size();
+
+  const EmbeddedFile *file = findEmbeddedFile(
+      *route->getBundle(), std::string_view(path).substr(prefixLength));
+  if (!file) {
+    res->getClient()->SendHttpError(HttpStatus::StatusNotFound, "Not Found");
+    return;
+  }
+  res->SendEmbedded(*file);
 }
@@ -14,13 +14,32 @@ extern "C" {
 }
 
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
+#include "accesslog.hpp"
+#include "affinity.hpp"
+#include "eventloop.hpp"
+#include "ioexecutor.hpp"
+#include "listener.hpp"
 #include "threadpool.hpp"
+#include "tls.hpp"
 
 #define MAX_EVENTS 100
-#define POOL_SIZE 5
+
+// How long to wait for the rest of a partially received request
+// (milliseconds); it is answered as incomplete within a second after.
+#define REQUEST_TIMEOUT_MS 30000
+
+// How long a stopping server waits for the requests and upgraded
+// connections it is serving before it shuts their sockets (milliseconds).
+#define DRAIN_TIMEOUT_MS 10000
+
+// Threads that read and parse the frames of upgraded (HTTP/2, WebSocket)
+// connections.
+#define UPGRADE_READERS 2
 
 // Called with method and request url to match with RouteHandler to call.
 namespace cppserver {
@@ -34,39 +53,86 @@ void epoll_ctl_add(int epoll_fd, int sock_fd, struct epoll_event *event,
 
 class TCPServer {
  private:
-  int server_fd;                   // Server socket file descriptor.
-  int port;                        // Port to bind server.
-  int epoll_fd;                    // epoll file descriptor.
+  std::vector<Listener> listeners; // Sockets accepting connections.
+  std::unique_ptr<EventLoop> loop; // Event loop backend.
   ThreadPool *pool;                // ThreadPool
-  struct sockaddr_in server_addr;  // Server address.
-  // Epoll events
-  struct epoll_event event, events[MAX_EVENTS];
-
-  // Event loop.
+  std::shared_ptr<CompletionQueue> completions;  // Work for the event loop.
+  std::unique_ptr<TlsContext> tls;  // Set if listeners speak TLS.
+  int reserve_fd;  // Given up to turn clients away when out of descriptors.
+  CpuList loop_cpus;      // Where the event loop runs; empty if anywhere.
+  std::string placement;  // CPU placement, for the startup banner.
+  int worker_processes;   // Prefork workers; 0 serves from this process.
+  AccessLogOptions access_log;  // Started by Listen.
+  std::vector<LoopEvent> ready;  // Events being dispatched.
+
+  // Event loop. Once stopped by a signal, it drains: see Drain.
   void RunForever();
 
-  // Handle request.
-  void HandleClient(int client_fd);
+  // Wait up to timeout_ms (-1 forever) and handle what happened. Returns
+  // false if the event loop failed.
+  bool Dispatch(int timeout_ms);
 
-  // Accept new client connection and register it with epoll.
-  // Returns client file descriptor or -1 for errors.
-  int Accept();
+  // Stop accepting, then serve on until the requests being served are
+  // answered (with Connection: close) and upgraded connections have ended,
+  // for at most DRAIN_TIMEOUT_MS. Idle keep-alive connections are closed.
+  void Drain();
 
-  // Unregister client
-  void UnregisterClient(int client_fd);
+  // Start serving an accepted connection, or recover from a failed accept.
+  void HandleAccept(const LoopEvent &event);
+
+  // Handle request. received holds bytes already read by the event loop.
+  void HandleClient(int client_fd, std::string received);
+
+  // Let the upgraded connection on client_fd write what it has queued.
+  void HandleWritable(int client_fd);
+
+  // True if connections accepted on listen_fd start with a TLS handshake.
+  bool UsesTls(int listen_fd) const;
 
  public:
-  // Implicit copy/move members
-  TCPServer(const TCPServer &) = default;
+  // The server owns its sockets and event loop; it cannot be copied.
+  TCPServer(const TCPServer &) = delete;
   TCPServer(TCPServer &&) = delete;
 
-  TCPServer &operator=(const TCPServer &) = default;
+  TCPServer &operator=(const TCPServer &) = delete;
   TCPServer &operator=(TCPServer &&) = delete;
 
-  explicit TCPServer(int port);  // constructor
+  // Set up the event loop, without listeners. See EventBackend.
+  explicit TCPServer(EventBackend backend = EventBackend::Auto);
+
+  // Listen on every IPv4 address at port.
+  explicit TCPServer(int port, EventBackend backend = EventBackend::Auto);
   ~TCPServer();                  // destructor
 
-  // Start the event loop.
+  // Also accept connections on address (see openListener), e.g.
+  // "[::]:8443" or "unix:/run/app.sock". Call before Listen. Exits if the
+  // address cannot be bound.
+  void AddListener(const std::string &address,
+                   const ListenOptions &options = ListenOptions());
+
+  // Terminate TLS on the listeners that allow it (ListenOptions::tls),
+  // with ALPN (h2, http/1.1), session resumption and kTLS where available.
+  // Call before Listen. Exits if the certificate or key cannot be loaded.
+  void EnableTls(const TlsOptions &options);
+
+  // Pin the server's threads (see CpuAffinity). Call before adding routes
+  // with their own I/O workers and before Listen; exits if a CPU list is
+  // malformed or names CPUs the process may not use.
+  void SetCpuAffinity(const CpuAffinity &affinity);
+
+  // Serve from count worker processes under a supervising master that
+  // restarts them and upgrades the binary without dropping connections
+  // (see master.hpp). Each worker runs the program again up to Listen,
+  // so set up routes before calling Listen. 0, the default, serves from
+  // this process.
+  void SetWorkerProcesses(int count);
+
+  // Log requests as options say (see accesslog.hpp). By default they are
+  // logged to standard output in the Common Log Format. Call before
+  // Listen; Listen exits if the log file cannot be opened.
+  void SetAccessLog(const AccessLogOptions &options);
+
+  // Start the event loop, or the master of the worker processes.
   void Listen();
 };
 
@@ -0,0 +1,264 @@
+#include "sse.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <vector>
+
+// Format one event (https://html.spec.whatwg.org/#server-sent-events).
+// Each line of data becomes a data: field.
+static std::string formatEvent(uint64_t id, std::string_view event,
+                               std::string_view data) {
+  std::string out;
+  out.reserve(data.size() + event.size() + 32);
+  out += "id: " + std::to_string(id) + "\n";
+  if (!event.empty()) {
+    out += "event: ";
+    out += event;
+    out += "\n";
+  }
+
+  size_t pos = 0;
+  while (true) {
+    size_t end = data.find_first_of("\r\n", pos);
+    out += "data: ";
+    out += data.substr(pos, end - pos);
+    out += "\n";
+    if (end == std::string_view::npos) {
+      break;
+    }
+    pos = end + (data.compare(end, 2, "\r\n") == 0 ? 2 : 1);
+    if (pos == data.size()) {
+      break;
+    }
+  }
+  out += "\n";
+  return out;
+}
+
+SseSubscriber::SseSubscriber(
+    std::unique_ptr<cppserver::Client> socket, EventLoop *loop,
+    std::shared_ptr<CompletionQueue> completions,
+    std::function<void(std::shared_ptr<SseSubscriber>)> closed)
+    : socket(std::move(socket)), loop(loop),
+      completions(std::move(completions)), closed(std::move(closed)),
+      hub(nullptr), offset(0), scheduled(false), overflowed(false),
+      done(false), dropped(0) {}
+
+uint64_t SseSubscriber::Dropped() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return dropped;
+}
+
+bool SseSubscriber::Push(std::shared_ptr<const std::string> event,
+                         const SseOptions &o) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (done || overflowed) {
+    return false;
+  }
+
+  if (queue.size() >= o.queue_limit) {
+    if (o.overflow == SseOverflow::Disconnect) {
+      overflowed = true;
+      queue.clear();
+      offset = 0;
+    } else {
+      // Keep a partly written event; the client has its first bytes.
+      size_t victim = offset > 0 && queue.size() > 1 ? 1 : 0;
+      if (victim == 0) {
+        offset = 0;
+      }
+      queue.erase(queue.begin() + victim);
+      dropped++;
+    }
+  }
+  if (!overflowed) {
+    queue.push_back(std::move(event));
+  }
+
+  if (scheduled) {
+    return false;
+  }
+  scheduled = true;
+  return true;
+}
+
+void SseSubscriber::Write() {
+  std::unique_lock<std::mutex> lock(mutex);
+  bool failed = overflowed;
+  while (!failed && !queue.empty()) {
+    struct iovec iov[SSE_MAX_IOV];
+    int count = 0;
+    for (auto it = queue.begin(); it != queue.end() && count < SSE_MAX_IOV;
+         ++it, ++count) {
+      size_t skip = count == 0 ? offset : 0;
+      iov[count].iov_base = const_cast<char *>((*it)->data()) + skip;
+      iov[count].iov_len = (*it)->size() - skip;
+    }
+
+    ssize_t n = socket->TrySend(iov, count);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // Stay scheduled until the socket drains.
+        loop->ArmWritable(fd());
+        return;
+      }
+      failed = true;
+      break;
+    }
+
+    // Drop what was written.
+    size_t written = static_cast<size_t>(n);
+    while (written > 0) {
+      size_t left = queue.front()->size() - offset;
+      if (written < left) {
+        offset += written;
+        break;
+      }
+      written -= left;
+      queue.pop_front();
+      offset = 0;
+    }
+  }
+
+  if (!failed) {
+    scheduled = false;
+    return;
+  }
+
+  // The client is gone or too slow.
+  Leave(lock);
+}
+
+void SseSubscriber::GoAway() {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!done) {
+    Leave(lock);
+  }
+}
+
+void SseSubscriber::Leave(std::unique_lock<std::mutex> &lock) {
+  done = true;
+  queue.clear();
+  lock.unlock();
+
+  std::shared_ptr<SseSubscriber> self = shared_from_this();
+  if (hub) {
+    hub->Unsubscribe(self);
+  }
+  if (closed) {
+    closed(self);
+  }
+}
+
+SseHub::SseHub(const SseOptions &options) : options(options) {
+  std::string response = "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: text/event-stream\r\n"
+                         "Cache-Control: no-cache\r\n"
+                         "Connection: close\r\n"
+                         "X-Accel-Buffering: no\r\n"
+                         "\r\n";
+  if (options.retry_ms > 0) {
+    response += "retry: " + std::to_string(options.retry_ms) + "\n\n";
+  }
+  head = std::make_shared<const std::string>(std::move(response));
+}
+
+uint64_t SseHub::Publish(const std::string &topic, std::string_view data,
+                         std::string_view event) {
+  std::vector<std::shared_ptr<SseSubscriber>> ready;
+  uint64_t id;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Topic &t = topics[topic];
+    id = ++t.last_id;
+    auto buffer =
+        std::make_shared<const std::string>(formatEvent(id, event, data));
+
+    if (options.replay > 0) {
+      if (t.history.size() >= options.replay) {
+        t.history.pop_front();
+      }
+      t.history.emplace_back(id, buffer);
+    }
+
+    for (const std::shared_ptr<SseSubscriber> &subscriber : t.subscribers) {
+      if (subscriber->Push(buffer, options)) {
+        ready.push_back(subscriber);
+      }
+    }
+  }
+
+  Schedule(ready);
+  return id;
+}
+
+size_t SseHub::Subscribers(const std::string &topic) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = topics.find(topic);
+  return it == topics.end() ? 0 : it->second.subscribers.size();
+}
+
+void SseHub::Subscribe(const std::string &topic,
+                       std::shared_ptr<SseSubscriber> subscriber,
+                       const std::string *last_event_id) {
+  subscriber->hub = this;
+  subscriber->topic = topic;
+
+  // The head and replayed events go out even past queue_limit.
+  std::vector<std::shared_ptr<const std::string>> backlog = {head};
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Topic &t = topics[topic];
+    if (last_event_id) {
+      char *end;
+      errno = 0;
+      uint64_t after = strtoull(last_event_id->c_str(), &end, 10);
+      if (errno != 0 || *end != '\0' || after > t.last_id) {
+        after = 0; // Unknown id (e.g. from before a restart): send all.
+      }
+      for (const auto &entry : t.history) {
+        if (entry.first > after) {
+          backlog.push_back(entry.second);
+        }
+      }
+    }
+
+    std::lock_guard<std::mutex> subscriber_lock(subscriber->mutex);
+    subscriber->queue.insert(subscriber->queue.end(), backlog.begin(),
+                             backlog.end());
+    subscriber->scheduled = true;
+    t.subscribers.insert(subscriber);
+  }
+
+  std::vector<std::shared_ptr<SseSubscriber>> ready = {subscriber};
+  Schedule(ready);
+}
+
+void SseHub::Schedule(std::vector<std::shared_ptr<SseSubscriber>> &ready) {
+  while (!ready.empty()) {
+    std::shared_ptr<CompletionQueue> completions = ready.back()->completions;
+    std::vector<std::shared_ptr<SseSubscriber>> batch;
+    for (size_t i = 0; i < ready.size();) {
+      if (ready[i]->completions == completions) {
+        batch.push_back(std::move(ready[i]));
+        ready[i] = std::move(ready.back());
+        ready.pop_back();
+      } else {
+        i++;
+      }
+    }
+    completions->Post([batch]() {
+      for (const std::shared_ptr<SseSubscriber> &subscriber : batch) {
+        subscriber->Write();
+      }
+    });
+  }
+}
+
+void SseHub::Unsubscribe(const std::shared_ptr<SseSubscriber> &subscriber) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = topics.find(subscriber->topic);
+  if (it != topics.end()) {
+    it->second.subscribers.erase(subscriber);
+  }
+}
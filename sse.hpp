@@ -0,0 +1,168 @@
+#ifndef SSE_H
+#define SSE_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "client.hpp"
+#include "eventloop.hpp"
+#include "ioexecutor.hpp"
+#include "upgrade.hpp"
+
+// Defaults for SseOptions.
+#define SSE_QUEUE_LIMIT 256
+#define SSE_REPLAY_EVENTS 256
+
+// Buffers written by one sendmsg(2) to a subscriber.
+#define SSE_MAX_IOV 64
+
+// What to do with a subscriber whose queue is full.
+enum class SseOverflow {
+  DropOldest, // Drop its oldest unsent event.
+  Disconnect, // Close the connection; the browser reconnects and replays.
+};
+
+// Settings of an SseHub.
+struct SseOptions {
+  // Events queued per subscriber before the overflow policy applies.
+  size_t queue_limit = SSE_QUEUE_LIMIT;
+  SseOverflow overflow = SseOverflow::DropOldest;
+
+  // Events kept per topic for clients reconnecting with Last-Event-ID.
+  size_t replay = SSE_REPLAY_EVENTS;
+
+  // Reconnection delay sent to new subscribers (milliseconds, 0 = none).
+  unsigned retry_ms = 0;
+};
+
+class SseHub;
+
+// A connection receiving one topic of an SseHub.
+//
+// Events are shared, immutable buffers; a subscriber only queues pointers
+// to them. Its socket is written without blocking on the event loop
+// thread: when the socket buffer is full it waits for writability, and
+// publishers keep queueing up to the hub's queue_limit.
+class SseSubscriber : public UpgradedConnection,
+                      public std::enable_shared_from_this<SseSubscriber> {
+public:
+  // closed is called on the event loop thread once the subscriber is
+  // done, after it has left its hub.
+  SseSubscriber(std::unique_ptr<cppserver::Client> socket, EventLoop *loop,
+                std::shared_ptr<CompletionQueue> completions,
+                std::function<void(std::shared_ptr<SseSubscriber>)> closed);
+
+  SseSubscriber(const SseSubscriber &) = delete;
+  SseSubscriber &operator=(const SseSubscriber &) = delete;
+
+  // Events dropped because the subscriber fell behind.
+  uint64_t Dropped();
+
+  int fd() override { return socket->fd(); }
+
+  // Subscribers are never armed for input.
+  bool Receive(std::string) override { return false; }
+  void Feed(std::string) override {}
+
+  void Writable() override { Write(); }
+
+  // End the stream; the client reconnects (after SseOptions::retry_ms)
+  // with Last-Event-ID and misses nothing the hub replays.
+  void GoAway() override;
+
+private:
+  friend class SseHub;
+
+  // Queue event. Returns true if the caller must schedule Write.
+  bool Push(std::shared_ptr<const std::string> event, const SseOptions &o);
+
+  // Write queued events until done or the socket is full. Event loop
+  // thread only.
+  void Write();
+
+  // Drop the queue and leave the hub and the server. Unlocks lock, which
+  // holds mutex.
+  void Leave(std::unique_lock<std::mutex> &lock);
+
+  std::unique_ptr<cppserver::Client> socket;
+  EventLoop *loop;
+  std::shared_ptr<CompletionQueue> completions;
+  std::function<void(std::shared_ptr<SseSubscriber>)> closed;
+  SseHub *hub;       // Set by SseHub::Subscribe.
+  std::string topic; // Topic subscribed to.
+
+  // Guarded by mutex.
+  std::mutex mutex;
+  std::deque<std::shared_ptr<const std::string>> queue;
+  size_t offset;    // Bytes of queue.front() already written.
+  bool scheduled;   // A Write is posted or waiting for writability.
+  bool overflowed;  // Queue overflowed with SseOverflow::Disconnect.
+  bool done;        // Closed; no more events.
+  uint64_t dropped;
+};
+
+// Topic-based Server-Sent Events broadcaster.
+//
+// Publish formats an event once into a shared buffer, appends it to the
+// topic's replay ring and queues the same buffer on every subscriber.
+// Writes are scheduled on the subscribers' event loops, one posted batch
+// per loop, so publishing never waits for clients. Thread-safe.
+//
+// A client that went away is noticed on the next write to it; topics with
+// rare events should publish a heartbeat now and then.
+class SseHub {
+public:
+  explicit SseHub(const SseOptions &options = SseOptions());
+
+  SseHub(const SseHub &) = delete;
+  SseHub &operator=(const SseHub &) = delete;
+
+  // Send data (split into data: lines) as an event of the given type
+  // ("message" if empty) to topic. Returns the event id.
+  uint64_t Publish(const std::string &topic, std::string_view data,
+                   std::string_view event = "");
+
+  // Subscribers of topic.
+  size_t Subscribers(const std::string &topic);
+
+  const SseOptions &Options() const { return options; }
+
+  // Start streaming topic to subscriber: the response head, the events
+  // after last_event_id (all kept ones if it is unknown, none if null),
+  // then every published event.
+  void Subscribe(const std::string &topic,
+                 std::shared_ptr<SseSubscriber> subscriber,
+                 const std::string *last_event_id);
+
+private:
+  friend class SseSubscriber;
+
+  struct Topic {
+    uint64_t last_id = 0;
+    // Recent events, oldest first, for Last-Event-ID.
+    std::deque<std::pair<uint64_t, std::shared_ptr<const std::string>>>
+        history;
+    std::unordered_set<std::shared_ptr<SseSubscriber>> subscribers;
+  };
+
+  // Post Write for the subscribers in ready (emptied) to their event
+  // loops, one callback per loop.
+  static void Schedule(std::vector<std::shared_ptr<SseSubscriber>> &ready);
+
+  void Unsubscribe(const std::shared_ptr<SseSubscriber> &subscriber);
+
+  SseOptions options;
+  std::shared_ptr<const std::string> head; // Response head and retry.
+  std::mutex mutex;
+  std::unordered_map<std::string, Topic> topics;
+};
+
+#endif /* SSE_H */
@@ -0,0 +1,138 @@
+#include "staticroot.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+extern "C" {
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+bool normalizeRequestPath(std::string_view raw, std::string &relpath) {
+  relpath.clear();
+  relpath.reserve(raw.size());
+  size_t segment_start = 0;
+
+  // Close the segment that starts at segment_start.
+  auto endSegment = [&]() -> bool {
+    std::string_view segment(relpath.data() + segment_start,
+                             relpath.size() - segment_start);
+    if (segment.empty() || segment == ".") {
+      relpath.resize(segment_start);
+    } else if (segment == "..") {
+      relpath.resize(segment_start);
+      if (relpath.empty()) {
+        return false; // Would escape the mount.
+      }
+      relpath.pop_back(); // '/' of the previous segment
+      size_t slash = relpath.rfind('/');
+      relpath.resize(slash == std::string::npos ? 0 : slash + 1);
+    } else {
+      relpath.push_back('/');
+    }
+    segment_start = relpath.size();
+    return true;
+  };
+
+  for (size_t i = 0; i < raw.size(); i++) {
+    char c = raw[i];
+    if (c == '%' && i + 2 < raw.size() && hexValue(raw[i + 1]) >= 0 &&
+        hexValue(raw[i + 2]) >= 0) {
+      c = static_cast<char>(hexValue(raw[i + 1]) * 16 + hexValue(raw[i + 2]));
+      i += 2;
+    }
+
+    if (c == '\0') {
+      return false;
+    }
+    if (c == '/') {
+      if (!endSegment()) {
+        return false;
+      }
+    } else {
+      relpath.push_back(c);
+    }
+  }
+
+  if (!endSegment()) {
+    return false;
+  }
+  if (!relpath.empty()) {
+    relpath.pop_back(); // Trailing '/'
+  }
+  return true;
+}
+
+StaticRoot::StaticRoot(const std::string &dirname, bool keep_fd)
+    : dirname(dirname) {
+  dir_fd = open(dirname.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1) {
+    throw std::runtime_error("cannot open static directory " + dirname +
+                             ": " + strerror(errno));
+  }
+
+  if (!keep_fd) {
+    close(dir_fd);
+    dir_fd = -1;
+  }
+}
+
+StaticRoot::~StaticRoot() {
+  if (dir_fd != -1) {
+    close(dir_fd);
+  }
+}
+
+int StaticRoot::Open(const std::string &relpath, int flags) const {
+  if (dir_fd == -1) {
+    std::string path = dirname;
+    if (!relpath.empty()) {
+      path += "/" + relpath;
+    }
+    return open(path.c_str(), flags);
+  }
+
+  const char *path = relpath.empty() ? "." : relpath.c_str();
+
+#ifdef SYS_openat2
+  static std::atomic<bool> have_openat2{true};
+  if (have_openat2) {
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = static_cast<uint64_t>(flags);
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    int fd;
+    do {
+      fd = static_cast<int>(syscall(SYS_openat2, dir_fd, path, &how,
+                                    sizeof(how)));
+    } while (fd == -1 && errno == EAGAIN);
+
+    if (fd != -1 || errno != ENOSYS) {
+      return fd;
+    }
+    have_openat2 = false;
+  }
+#endif
+
+  // normalizeRequestPath already removed "..", so this cannot walk out of
+  // the root except through symlinks placed inside it.
+  return openat(dir_fd, path, flags);
+}
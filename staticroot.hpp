@@ -0,0 +1,45 @@
+#ifndef STATICROOT_H
+#define STATICROOT_H
+
+#include <string>
+#include <string_view>
+
+// Decode and normalize the part of a request path below a static mount in
+// a single pass. Percent escapes are decoded, empty and "." segments are
+// dropped and ".." segments are resolved. On success relpath holds a
+// relative path without leading or trailing '/' ("" for the mount root).
+// Returns false for paths that would escape the mount or contain NUL.
+bool normalizeRequestPath(std::string_view raw, std::string &relpath);
+
+// An open directory that a static mount serves files from.
+//
+// Files are opened relative to the directory fd with
+// openat2(RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS), so only the components
+// below the mount are resolved per request and neither ".." nor symlinks
+// can reach outside it. On kernels without openat2 (before 5.6) plain
+// openat is used on the normalized path.
+class StaticRoot {
+ public:
+  // Opens dirname. Throws std::runtime_error if it is not a directory.
+  // If keep_fd is false the directory is only checked, and Open resolves
+  // the full path on every call instead of using the directory fd.
+  explicit StaticRoot(const std::string &dirname, bool keep_fd = true);
+  ~StaticRoot();
+
+  StaticRoot(const StaticRoot &) = delete;
+  StaticRoot &operator=(const StaticRoot &) = delete;
+
+  // Open relpath (as produced by normalizeRequestPath) beneath the root.
+  // Returns a file descriptor, or -1 with errno set.
+  int Open(const std::string &relpath, int flags) const;
+
+  // Returns the directory path and file descriptor (-1 without keep_fd).
+  const std::string &path() const { return dirname; }
+  int fd() const { return dir_fd; }
+
+ private:
+  std::string dirname;
+  int dir_fd;
+};
+
+#endif /* STATICROOT_H */
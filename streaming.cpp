@@ -0,0 +1,56 @@
+#include "streaming.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+
+// Transfers smaller than this are not used for throughput estimates.
+#define MIN_MEASURED_BYTES (256 * 1024)
+
+// Upper bound on tracked peers. The table is cleared when it fills up.
+#define MAX_TRACKED_PEERS 4096
+
+// Weight of the newest sample in the moving average.
+#define THROUGHPUT_ALPHA 0.3
+
+static std::mutex throughput_mutex;
+static std::unordered_map<std::string, double> throughput;
+
+void recordThroughput(const std::string &peer, off64_t bytes,
+                      double seconds) {
+  if (peer.empty() || bytes < MIN_MEASURED_BYTES || seconds <= 0) {
+    return;
+  }
+
+  double sample = static_cast<double>(bytes) / seconds;
+
+  std::lock_guard<std::mutex> lock(throughput_mutex);
+  auto it = throughput.find(peer);
+  if (it != throughput.end()) {
+    it->second =
+        THROUGHPUT_ALPHA * sample + (1 - THROUGHPUT_ALPHA) * it->second;
+    return;
+  }
+
+  if (throughput.size() >= MAX_TRACKED_PEERS) {
+    throughput.clear();
+  }
+  throughput.emplace(peer, sample);
+}
+
+double estimateThroughput(const std::string &peer) {
+  std::lock_guard<std::mutex> lock(throughput_mutex);
+  auto it = throughput.find(peer);
+  return it == throughput.end() ? 0 : it->second;
+}
+
+off64_t streamingWindow(const StreamingProfile &profile,
+                        const std::string &peer) {
+  double rate = estimateThroughput(peer);
+  if (rate <= 0) {
+    return profile.min_window;
+  }
+
+  off64_t window = static_cast<off64_t>(rate * profile.window_seconds);
+  return std::clamp(window, profile.min_window, profile.max_window);
+}
@@ -0,0 +1,44 @@
+#ifndef STREAMING_H
+#define STREAMING_H
+
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <string>
+#include <sys/types.h>
+
+// Disk access profile for serving large media files.
+//
+// Files are sent in segments. Before each segment the next readahead bytes
+// are prefetched with POSIX_FADV_WILLNEED, and for files of at least
+// dontneed_threshold bytes the pages already sent are dropped from the page
+// cache with POSIX_FADV_DONTNEED so one big download does not evict the rest
+// of the library.
+//
+// Open-ended ranges ("bytes=N-") are answered with a window sized to
+// window_seconds of the client's measured throughput, clamped to
+// [min_window, max_window]. Until a client has been measured, min_window is
+// used.
+struct StreamingProfile {
+  off64_t segment = 1 << 20;           // Bytes per sendfile call.
+  off64_t readahead = 4 << 20;         // Prefetch ahead of the send position.
+  off64_t dontneed_threshold = 256ll << 20;
+  double window_seconds = 8.0;
+  off64_t min_window = 2 << 20;
+  off64_t max_window = 64 << 20;
+};
+
+// Record that bytes were sent to peer in seconds. Short transfers are
+// ignored since they only measure the socket buffer.
+void recordThroughput(const std::string &peer, off64_t bytes, double seconds);
+
+// Returns the smoothed throughput for peer in bytes/sec, or 0 if unknown.
+double estimateThroughput(const std::string &peer);
+
+// Returns the number of bytes to send for an open-ended range to peer.
+off64_t streamingWindow(const StreamingProfile &profile,
+                        const std::string &peer);
+
+#endif /* STREAMING_H */
@@ -1,9 +1,26 @@
 #include "threadpool.hpp"
 
-ThreadPool::ThreadPool(size_t num_threads) : should_terminate(false) {
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "affinity.hpp"
+
+static const Histogram queue_wait("cppserver_queue_wait_seconds",
+                                  "Time jobs waited for a request worker.");
+
+ThreadPool::ThreadPool(size_t num_threads)
+    : should_terminate(false), active(0) {
   Start(num_threads);
 }
 
+ThreadPool::ThreadPool(const std::vector<int> &cpus)
+    : should_terminate(false), active(0) {
+  for (int cpu : cpus) {
+    threads.emplace_back(&ThreadPool::PinnedLoop, this, cpu);
+  }
+}
+
 ThreadPool::~ThreadPool() { Stop(); }
 
 void ThreadPool::Start(size_t num_threads) {
@@ -28,8 +45,30 @@ void ThreadPool::Stop() {
 }
 
 void ThreadPool::Wait() {
-  while (Busy()) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  idle_condition.wait(lock, [this] { return jobs.empty() && active == 0; });
+}
+
+bool ThreadPool::WaitFor(std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  return idle_condition.wait_for(
+      lock, timeout, [this] { return jobs.empty() && active == 0; });
+}
+
+void ThreadPool::Abandon() {
+  std::queue<Job> dropped;
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    should_terminate = true;
+    dropped.swap(jobs);
+  }
+
+  mutex_condition.notify_all();
+
+  for (auto &thread : threads) {
+    if (thread.joinable()) {
+      thread.detach();
+    }
   }
 }
 
@@ -46,21 +85,36 @@ void ThreadPool::ThreadLoop() {
       return;
     }
 
-    auto job = jobs.front();
+    Job job = std::move(jobs.front());
     jobs.pop();
+    active++;
 
     lock.unlock();
+    queue_wait.RecordSince(job.queued);
 
     // Execute the job outside the lock
-    job();
+    job.run();
+
+    lock.lock();
+    if (--active == 0 && jobs.empty()) {
+      idle_condition.notify_all();
+    }
+  }
+}
+
+void ThreadPool::PinnedLoop(int cpu) {
+  if (!pinThread(pthread_self(), CpuList{cpu})) {
+    fprintf(stderr, "worker: cannot pin to CPU %d: %s\n", cpu,
+            strerror(errno));
   }
+  ThreadLoop();
 }
 
 bool ThreadPool::Busy() {
   bool poolbusy;
   {
     std::unique_lock<std::mutex> lock(queue_mutex);
-    poolbusy = !jobs.empty();
+    poolbusy = !jobs.empty() || active > 0;
   }
   return poolbusy;
 }
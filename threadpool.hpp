@@ -14,6 +14,7 @@
  * https://stackoverflow.com/questions/15752659/thread-pooling-in-c11
  */
 
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <iostream>
@@ -22,9 +23,15 @@
 #include <thread>
 #include <vector>
 
+#include "metrics.hpp"
+
 class ThreadPool {
  public:
   ThreadPool(size_t num_threads = std::thread::hardware_concurrency());
+
+  // One thread per CPU in cpus, each pinned to its CPU before it takes
+  // jobs, so that its stack and malloc arena are local to that CPU's node.
+  explicit ThreadPool(const std::vector<int> &cpus);
   ~ThreadPool();
 
   // Start the thread-pool with the given number of threads.
@@ -34,8 +41,9 @@ class ThreadPool {
   template <typename Function, typename... Args>
   void QueueJob(Function &&job, Args &&...args) {
     std::unique_lock<std::mutex> lock(queue_mutex);
-    jobs.emplace(
-        std::bind(std::forward<Function>(job), std::forward<Args>(args)...));
+    jobs.push(
+        {std::bind(std::forward<Function>(job), std::forward<Args>(args)...),
+         metricsNow()});
     lock.unlock();
     mutex_condition.notify_one();
   }
@@ -43,22 +51,44 @@ class ThreadPool {
   // Stop processing jobs and stop all threads.
   void Stop();
 
-  // Returns true if the pool still has jobs to be done.
+  // Returns true if the pool has jobs queued or running.
   bool Busy();
 
   // Wait for all the jobs to finish
   void Wait();
 
+  // Wait at most timeout for all the jobs to finish. Returns false if some
+  // are still queued or running.
+  bool WaitFor(std::chrono::milliseconds timeout);
+
+  // Drop the queued jobs and let the threads go without joining them; each
+  // exits once its running job returns. The pool must then be leaked, not
+  // deleted, since those threads still use it.
+  void Abandon();
+
  private:
+  // A queued job and when it was queued (metricsNow), for the queue wait
+  // metric.
+  struct Job {
+    std::function<void()> run;
+    uint64_t queued;
+  };
+
   void ThreadLoop();
 
+  // Pin the thread to cpu, then run ThreadLoop.
+  void PinnedLoop(int cpu);
+
   bool should_terminate;   // Tells threads to stop looking for jobs
   std::mutex queue_mutex;  // Prevents data races to the job queue
 
   // Allows threads to wait on new jobs or termination
   std::condition_variable mutex_condition;
+
+  size_t active;  // Jobs being run
+  std::condition_variable idle_condition;  // Notified when the pool idles
   std::vector<std::thread> threads;
-  std::queue<std::function<void()>> jobs;
+  std::queue<Job> jobs;
 };
 
 #endif /* THREADPOOL_H */
@@ -0,0 +1,399 @@
+#include "tls.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <vector>
+
+#include <openssl/err.h>
+#include <poll.h>
+
+#include "metrics.hpp"
+
+// Server preference order for ALPN, in wire format.
+static const unsigned char alpnWithH2[] = "\x02h2\x08http/1.1";
+static const unsigned char alpnHttp1[] = "\x08http/1.1";
+
+static void tlsFatal(const char *what) {
+  fprintf(stderr, "%s: ", what);
+  ERR_print_errors_fp(stderr);
+  fprintf(stderr, "\n");
+  exit(EXIT_FAILURE);
+}
+
+static int selectAlpn(SSL *, const unsigned char **out, unsigned char *outlen,
+                      const unsigned char *in, unsigned int inlen, void *arg) {
+  bool http2 = *static_cast<bool *>(arg);
+  const unsigned char *server = http2 ? alpnWithH2 : alpnHttp1;
+  unsigned int server_len =
+      http2 ? sizeof(alpnWithH2) - 1 : sizeof(alpnHttp1) - 1;
+
+  unsigned char *selected;
+  if (SSL_select_next_proto(&selected, outlen, server, server_len, in,
+                            inlen) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  *out = selected;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+TlsContext::TlsContext(const TlsOptions &options) : http2(options.http2) {
+  ctx = SSL_CTX_new(TLS_server_method());
+  if (!ctx) {
+    tlsFatal("SSL_CTX_new");
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+  if (SSL_CTX_use_certificate_chain_file(
+          ctx, options.certificate_file.c_str()) != 1) {
+    tlsFatal(options.certificate_file.c_str());
+  }
+  if (SSL_CTX_use_PrivateKey_file(ctx, options.private_key_file.c_str(),
+                                  SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    tlsFatal(options.private_key_file.c_str());
+  }
+  if (!options.ciphers.empty() &&
+      SSL_CTX_set_cipher_list(ctx, options.ciphers.c_str()) != 1) {
+    tlsFatal("ciphers");
+  }
+
+  uint64_t flags = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  // A client closing without close_notify is an ordinary end of stream.
+  flags |= SSL_OP_IGNORE_UNEXPECTED_EOF;
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+  if (options.ktls) {
+    flags |= SSL_OP_ENABLE_KTLS;
+  }
+#endif
+  if (!options.session_tickets) {
+    flags |= SSL_OP_NO_TICKET;
+  }
+  SSL_CTX_set_options(ctx, flags);
+
+  // Write what fits and let the buffer move between retries (queued
+  // responses are retried from their current position), and drop the
+  // record buffers of idle connections.
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                            SSL_MODE_RELEASE_BUFFERS);
+
+  static const unsigned char session_context[] = "cppserver";
+  SSL_CTX_set_session_id_context(ctx, session_context,
+                                 sizeof(session_context) - 1);
+  if (options.session_cache_size > 0) {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, options.session_cache_size);
+  } else {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+  }
+  SSL_CTX_set_timeout(ctx, options.session_timeout);
+
+  SSL_CTX_set_alpn_select_cb(ctx, selectAlpn, &http2);
+}
+
+TlsContext::~TlsContext() { SSL_CTX_free(ctx); }
+
+BIO_METHOD *TlsClient::ReadMethod() {
+  static BIO_METHOD *method = [] {
+    BIO_METHOD *m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+                                 "cppserver read");
+    BIO_meth_set_read(m, TlsClient::BioRead);
+    BIO_meth_set_ctrl(m, [](BIO *, int cmd, long, void *) -> long {
+      return cmd == BIO_CTRL_FLUSH ? 1 : 0;
+    });
+    BIO_meth_set_create(m, [](BIO *bio) {
+      BIO_set_init(bio, 1);
+      return 1;
+    });
+    return m;
+  }();
+  return method;
+}
+
+int TlsClient::BioRead(BIO *bio, char *buf, int size) {
+  TlsClient *client = static_cast<TlsClient *>(BIO_get_data(bio));
+  BIO_clear_retry_flags(bio);
+
+  size_t available = client->pending.size() - client->pending_pos;
+  if (available > 0) {
+    size_t n = std::min(available, static_cast<size_t>(size));
+    memcpy(buf, client->pending.data() + client->pending_pos, n);
+    client->pending_pos += n;
+    if (client->pending_pos == client->pending.size()) {
+      client->pending.clear();
+      client->pending_pos = 0;
+    }
+    return static_cast<int>(n);
+  }
+
+  ssize_t n;
+  do {
+    n = recv(client->fd(), buf, size, 0);
+  } while (n == -1 && errno == EINTR);
+  if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    BIO_set_retry_read(bio);
+  }
+  return static_cast<int>(n);
+}
+
+TlsClient::TlsClient(int client_fd, const TlsContext &context)
+    : cppserver::Client(client_fd), pending_pos(0), established(false) {
+  ssl = SSL_new(context.get());
+  BIO *rbio = BIO_new(ReadMethod());
+  BIO *wbio = BIO_new_socket(client_fd, BIO_NOCLOSE);
+  if (!ssl || !rbio || !wbio) {
+    tlsFatal("SSL_new");
+  }
+  BIO_set_data(rbio, this);
+  SSL_set_bio(ssl, rbio, wbio);
+  SSL_set_accept_state(ssl);
+}
+
+TlsClient::~TlsClient() {
+  if (established) {
+    Flush();
+    // Send close_notify; the peer's reply is not waited for.
+    SSL_shutdown(ssl);
+  }
+  SSL_free(ssl);
+  ERR_clear_error();
+}
+
+bool TlsClient::WaitFor(int error, bool may_read) {
+  struct pollfd pfd;
+  pfd.fd = fd();
+  pfd.revents = 0;
+  switch (error) {
+  case SSL_ERROR_WANT_WRITE:
+    pfd.events = POLLOUT;
+    break;
+  case SSL_ERROR_WANT_READ:
+    if (!may_read) {
+      return false;
+    }
+    pfd.events = POLLIN;
+    break;
+  default:
+    ERR_clear_error();
+    return false;
+  }
+
+  int ready;
+  do {
+    ready = poll(&pfd, 1, SEND_TIMEOUT_MS);
+  } while (ready == -1 && errno == EINTR);
+  return ready == 1 && !(pfd.revents & (POLLERR | POLLNVAL));
+}
+
+void TlsClient::TakeReceived(std::string data, std::string &) {
+  std::lock_guard<std::mutex> lock(mutex);
+  pending.append(data);
+}
+
+int TlsClient::Handshake() {
+  while (!established) {
+    int rc, error;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      rc = SSL_do_handshake(ssl);
+      error = SSL_get_error(ssl, rc);
+    }
+    if (rc == 1) {
+      established = true;
+      break;
+    }
+
+    if (error == SSL_ERROR_WANT_READ) {
+      return 0; // Wait for the event loop to report more input.
+    }
+    if (error != SSL_ERROR_WANT_WRITE || !WaitFor(error, false)) {
+      ERR_clear_error();
+      return -1;
+    }
+  }
+  return 1;
+}
+
+int TlsClient::Read(std::string &buffer) {
+  if (!established) {
+    return -1;
+  }
+
+  char chunk[TLS_RECORD_SIZE];
+  while (true) {
+    int n, error;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      n = SSL_read(ssl, chunk, sizeof(chunk));
+      error = SSL_get_error(ssl, n);
+    }
+    if (n > 0) {
+      buffer.append(chunk, static_cast<size_t>(n));
+      CountReceived(static_cast<size_t>(n));
+      continue;
+    }
+
+    if (error == SSL_ERROR_WANT_READ) {
+      break; // No more input for now.
+    }
+    if (error == SSL_ERROR_ZERO_RETURN ||
+        (error == SSL_ERROR_SYSCALL && ERR_peek_error() == 0 && n == 0)) {
+      peer_closed = true;
+      break;
+    }
+    if (error == SSL_ERROR_WANT_WRITE && WaitFor(error, false)) {
+      continue;
+    }
+    ERR_clear_error();
+    return -1;
+  }
+  return static_cast<int>(buffer.size());
+}
+
+bool TlsClient::WriteAll(struct iovec *iov, int iovcnt, int) {
+  // Coalesce small writes (e.g. batched output and a body) into one record.
+  std::string joined;
+  struct iovec single;
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+  if (iovcnt > 1 && total <= TLS_RECORD_SIZE) {
+    joined.reserve(total);
+    for (int i = 0; i < iovcnt; i++) {
+      joined.append(static_cast<const char *>(iov[i].iov_base),
+                    iov[i].iov_len);
+    }
+    single.iov_base = joined.data();
+    single.iov_len = joined.size();
+    iov = &single;
+    iovcnt = 1;
+  }
+
+  for (int i = 0; i < iovcnt; i++) {
+    const char *data = static_cast<const char *>(iov[i].iov_base);
+    size_t left = iov[i].iov_len;
+    while (left > 0) {
+      int n, error;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        n = SSL_write(ssl, data,
+                      static_cast<int>(std::min<size_t>(left, INT_MAX)));
+        error = SSL_get_error(ssl, n);
+      }
+      if (n > 0) {
+        data += n;
+        left -= static_cast<size_t>(n);
+      } else if (!WaitFor(error, true)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+ssize_t TlsClient::TrySend(const struct iovec *iov, int iovcnt) {
+  std::lock_guard<std::mutex> lock(mutex);
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len == 0) {
+      continue;
+    }
+    int n = SSL_write(ssl, iov[i].iov_base,
+                      static_cast<int>(std::min<size_t>(iov[i].iov_len,
+                                                        INT_MAX)));
+    if (n <= 0) {
+      int error = SSL_get_error(ssl, n);
+      ERR_clear_error();
+      if (total > 0) {
+        break;
+      }
+      errno = error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ
+                  ? EAGAIN
+                  : EPIPE;
+      return -1;
+    }
+    total += n;
+    if (static_cast<size_t>(n) < iov[i].iov_len) {
+      break;
+    }
+  }
+  CountWritten(static_cast<size_t>(total), 0);
+  return total;
+}
+
+ssize_t TlsClient::SendFile(int file_fd, off_t offset, size_t count) {
+  if (!WriteBatched(0)) {
+    return -1;
+  }
+
+  size_t sent = 0;
+  uint64_t start = metricsNow();
+#ifdef SSL_OP_ENABLE_KTLS
+  if (KernelTls()) {
+    // The kernel encrypts; the file never enters user space.
+    while (sent < count) {
+      ossl_ssize_t n;
+      int error;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        n = SSL_sendfile(ssl, file_fd, offset, count - sent, 0);
+        error = SSL_get_error(ssl, static_cast<int>(n));
+      }
+      if (n > 0) {
+        sent += static_cast<size_t>(n);
+        offset += n;
+      } else if (!WaitFor(error, false)) {
+        break;
+      }
+    }
+    CountWritten(sent, start);
+    bytes_sent += sent;
+    return sent > 0 || count == 0 ? static_cast<ssize_t>(sent) : -1;
+  }
+#endif
+
+  std::vector<char> buffer(4 * TLS_RECORD_SIZE);
+  while (sent < count) {
+    size_t want = std::min(buffer.size(), count - sent);
+    ssize_t n = pread(file_fd, buffer.data(), want, offset);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break; // Error, or the file was truncated while sending.
+    }
+
+    struct iovec iov;
+    iov.iov_base = buffer.data();
+    iov.iov_len = static_cast<size_t>(n);
+    if (!WriteAll(&iov, 1, 0)) {
+      CountWritten(sent, start);
+      return -1;
+    }
+    sent += static_cast<size_t>(n);
+    offset += n;
+  }
+  CountWritten(sent, start);
+  bytes_sent += sent;
+  return static_cast<ssize_t>(sent);
+}
+
+std::string_view TlsClient::Protocol() {
+  std::lock_guard<std::mutex> lock(mutex);
+  const unsigned char *protocol;
+  unsigned int length;
+  SSL_get0_alpn_selected(ssl, &protocol, &length);
+  return std::string_view(reinterpret_cast<const char *>(protocol), length);
+}
+
+bool TlsClient::KernelTls() {
+#ifdef SSL_OP_ENABLE_KTLS
+  return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+  return false;
+#endif
+}
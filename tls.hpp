@@ -0,0 +1,108 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include <openssl/ssl.h>
+
+#include "client.hpp"
+
+// Defaults for TlsOptions.
+#define TLS_SESSION_CACHE_SIZE 20480
+#define TLS_SESSION_TIMEOUT 300 // Seconds.
+
+// Largest plaintext of one TLS record.
+#define TLS_RECORD_SIZE 16384
+
+// Settings of a TLS listener.
+struct TlsOptions {
+  // PEM certificate chain and private key.
+  std::string certificate_file;
+  std::string private_key_file;
+
+  // TLS 1.2 cipher list in OpenSSL syntax; the library default if empty.
+  std::string ciphers;
+
+  // Offer h2 before http/1.1 in ALPN.
+  bool http2 = true;
+
+  // Let clients resume sessions with stateless tickets, and from a server
+  // side cache of session_cache_size entries (0 disables the cache).
+  bool session_tickets = true;
+  size_t session_cache_size = TLS_SESSION_CACHE_SIZE;
+  long session_timeout = TLS_SESSION_TIMEOUT;
+
+  // Hand the record layer to the kernel (kTLS) after the handshake when
+  // the kernel and cipher allow it, so that files are sent with sendfile.
+  bool ktls = true;
+};
+
+// An OpenSSL server context built from TlsOptions. Exits if the
+// certificate or key cannot be loaded.
+class TlsContext {
+public:
+  explicit TlsContext(const TlsOptions &options);
+  ~TlsContext();
+
+  TlsContext(const TlsContext &) = delete;
+  TlsContext &operator=(const TlsContext &) = delete;
+
+  SSL_CTX *get() const { return ctx; }
+
+private:
+  SSL_CTX *ctx;
+  bool http2;
+};
+
+// A TLS connection on a non-blocking socket.
+//
+// The handshake is advanced by Handshake as input arrives, so a slow
+// client never holds a thread. Bytes the event loop already read are fed
+// to OpenSSL before the socket (see TakeReceived). Writes go straight to
+// the socket, which lets OpenSSL switch it to kTLS; SendFile then uses
+// sendfile(2) and otherwise encrypts the file in user space.
+//
+// One thread may read while others write (HTTP/2, WebSocket): calls into
+// OpenSSL are serialized, but waits for the socket are not.
+class TlsClient : public cppserver::Client {
+public:
+  TlsClient(int client_fd, const TlsContext &context);
+  ~TlsClient() override;
+
+  int Read(std::string &buffer) override;
+  void TakeReceived(std::string data, std::string &buffer) override;
+  int Handshake() override;
+  bool Stateful() const override { return true; }
+  ssize_t TrySend(const struct iovec *iov, int iovcnt) override;
+  ssize_t SendFile(int file_fd, off_t offset, size_t count) override;
+
+  // Protocol selected with ALPN ("h2", "http/1.1"), or empty.
+  std::string_view Protocol();
+
+  // True if the kernel encrypts what is sent (kTLS).
+  bool KernelTls();
+
+protected:
+  bool WriteAll(struct iovec *iov, int iovcnt, int flags) override;
+
+private:
+  // Read callback of the BIO OpenSSL reads from: pending bytes first,
+  // then the socket.
+  static int BioRead(BIO *bio, char *buf, int size);
+  static BIO_METHOD *ReadMethod();
+
+  // Wait for the socket as OpenSSL asked with error (SSL_get_error).
+  // Returns false on other errors, or if it wants input and may_read is
+  // false.
+  bool WaitFor(int error, bool may_read);
+
+  std::mutex mutex;    // Guards ssl and pending.
+  SSL *ssl;
+  std::string pending; // Received bytes not yet given to OpenSSL.
+  size_t pending_pos;  // Offset of the first of them.
+  bool established;    // Handshake complete.
+};
+
+#endif /* TLS_H */
@@ -0,0 +1,34 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <string>
+
+// A connection that switched from HTTP/1 to another protocol (HTTP/2,
+// WebSocket, an event stream). The server stays subscribed to its socket on
+// the event loop and hands it the input until Receive returns false.
+class UpgradedConnection {
+public:
+  virtual ~UpgradedConnection() = default;
+
+  // Socket file descriptor.
+  virtual int fd() = 0;
+
+  // Process received bytes, then whatever else the socket has to read.
+  // Called by one thread at a time. Returns false when the connection is
+  // done and no more input should be read.
+  virtual bool Receive(std::string data) = 0;
+
+  // Queue input that was read and decoded before the upgrade, ahead of
+  // anything Receive gets later.
+  virtual void Feed(std::string data) = 0;
+
+  // Called on the event loop thread once the socket, armed with
+  // EventLoop::ArmWritable, can be written to.
+  virtual void Writable() {}
+
+  // Called on the event loop thread when the server shuts down: ask the
+  // peer to finish, so that the connection ends by itself.
+  virtual void GoAway() {}
+};
+
+#endif /* UPGRADE_H */
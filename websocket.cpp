@@ -0,0 +1,699 @@
+#include "websocket.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/socket.h>
+
+#include "ioexecutor.hpp"
+
+// Opcodes (RFC 6455 section 5.2).
+#define WS_CONTINUATION 0x0
+#define WS_TEXT 0x1
+#define WS_BINARY 0x2
+#define WS_CLOSE 0x8
+#define WS_PING 0x9
+#define WS_PONG 0xa
+
+// Frame header bits.
+#define WS_FIN 0x80
+#define WS_RSV1 0x40 // Message is compressed (permessage-deflate).
+#define WS_RSV23 0x30
+#define WS_MASKED 0x80
+
+// Largest control frame payload.
+#define WS_MAX_CONTROL 125
+
+// Appended by the handshake to Sec-WebSocket-Key before hashing.
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// Threads that write queued frames. Writes block on slow clients for up to
+// SEND_TIMEOUT_MS, so they are kept off the readers and request workers.
+static IoExecutor &webSocketWriters() {
+  static IoExecutor writers(WS_WRITERS, IO_DEFAULT_QUEUE_DEPTH);
+  return writers;
+}
+
+static uint32_t rotl(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+// SHA-1 digest of data (FIPS 180-4), only used for Sec-WebSocket-Accept.
+static void sha1(std::string_view data, uint8_t digest[20]) {
+  uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                   0xc3d2e1f0};
+
+  std::string msg(data);
+  uint64_t bits = static_cast<uint64_t>(data.size()) * 8;
+  msg.push_back(static_cast<char>(0x80));
+  while (msg.size() % 64 != 56) {
+    msg.push_back('\0');
+  }
+  for (int i = 7; i >= 0; i--) {
+    msg.push_back(static_cast<char>(bits >> (i * 8)));
+  }
+
+  for (size_t block = 0; block < msg.size(); block += 64) {
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(msg.data()) + block;
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+      w[i] = static_cast<uint32_t>(p[i * 4]) << 24 | p[i * 4 + 1] << 16 |
+             p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+      w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotl(b, 30);
+      b = a;
+      a = temp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  for (int i = 0; i < 5; i++) {
+    digest[i * 4] = static_cast<uint8_t>(h[i] >> 24);
+    digest[i * 4 + 1] = static_cast<uint8_t>(h[i] >> 16);
+    digest[i * 4 + 2] = static_cast<uint8_t>(h[i] >> 8);
+    digest[i * 4 + 3] = static_cast<uint8_t>(h[i]);
+  }
+}
+
+static std::string base64Encode(const uint8_t *data, size_t size) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  for (size_t i = 0; i < size; i += 3) {
+    uint32_t n = static_cast<uint32_t>(data[i]) << 16;
+    if (i + 1 < size) {
+      n |= static_cast<uint32_t>(data[i + 1]) << 8;
+    }
+    if (i + 2 < size) {
+      n |= data[i + 2];
+    }
+    out.push_back(alphabet[(n >> 18) & 63]);
+    out.push_back(alphabet[(n >> 12) & 63]);
+    out.push_back(i + 1 < size ? alphabet[(n >> 6) & 63] : '=');
+    out.push_back(i + 2 < size ? alphabet[n & 63] : '=');
+  }
+  return out;
+}
+
+static std::string_view trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+// Returns true if the comma-separated list value contains token, ignoring
+// case, e.g "keep-alive, Upgrade" contains "upgrade".
+static bool hasToken(std::string_view value, std::string_view token) {
+  while (!value.empty()) {
+    size_t comma = value.find(',');
+    std::string_view item = trim(value.substr(0, comma));
+    if (item.size() == token.size() &&
+        strncasecmp(item.data(), token.data(), token.size()) == 0) {
+      return true;
+    }
+    if (comma == std::string_view::npos) {
+      break;
+    }
+    value.remove_prefix(comma + 1);
+  }
+  return false;
+}
+
+// Pick the first permessage-deflate offer in a Sec-WebSocket-Extensions
+// value that we can accept (RFC 7692 section 7.1). Returns the response
+// extension, or an empty string if there is none.
+static std::string negotiateDeflate(std::string_view offers,
+                                    WebSocketDeflate &deflate) {
+  while (!offers.empty()) {
+    size_t comma = offers.find(',');
+    std::string_view offer = offers.substr(0, comma);
+    offers.remove_prefix(comma == std::string_view::npos ? offers.size()
+                                                         : comma + 1);
+
+    size_t semi = offer.find(';');
+    if (trim(offer.substr(0, semi)) != "permessage-deflate") {
+      continue;
+    }
+
+    WebSocketDeflate candidate;
+    candidate.enabled = true;
+    std::string response = "permessage-deflate";
+    bool ok = true;
+    while (ok && semi != std::string_view::npos) {
+      offer.remove_prefix(semi + 1);
+      semi = offer.find(';');
+      std::string_view param = trim(offer.substr(0, semi));
+      size_t eq = param.find('=');
+      std::string_view name = trim(param.substr(0, eq));
+      std::string_view value;
+      if (eq != std::string_view::npos) {
+        value = trim(param.substr(eq + 1));
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+          value = value.substr(1, value.size() - 2);
+        }
+      }
+
+      if (name == "server_no_context_takeover" && value.empty()) {
+        candidate.server_no_context_takeover = true;
+        response += "; server_no_context_takeover";
+      } else if (name == "client_no_context_takeover" && value.empty()) {
+        candidate.client_no_context_takeover = true;
+        response += "; client_no_context_takeover";
+      } else if (name == "server_max_window_bits") {
+        // zlib cannot produce raw deflate streams with an 8 bit window.
+        int bits = value.empty() || value.size() > 2
+                       ? 0
+                       : std::atoi(std::string(value).c_str());
+        if (bits < 9 || bits > 15) {
+          ok = false;
+        } else {
+          candidate.server_max_window_bits = bits;
+          response += "; server_max_window_bits=" + std::to_string(bits);
+        }
+      } else if (name == "client_max_window_bits") {
+        // A hint only; we inflate with the largest window.
+      } else {
+        ok = false;
+      }
+    }
+
+    if (ok) {
+      deflate = candidate;
+      return response;
+    }
+  }
+  return "";
+}
+
+bool webSocketHandshake(Request &req, const WebSocketOptions &options,
+                        std::string &response, WebSocketDeflate &deflate) {
+  Header *upgrade = req.findRequestHeader("Upgrade");
+  Header *connection = req.findRequestHeader("Connection");
+  Header *version = req.findRequestHeader("Sec-WebSocket-Version");
+  Header *key = req.findRequestHeader("Sec-WebSocket-Key");
+  if (req.getMethod() != HttpMethod::GET || req.getVersion() != "HTTP/1.1" ||
+      !upgrade || !hasToken(upgrade->value, "websocket") || !connection ||
+      !hasToken(connection->value, "upgrade") || !version ||
+      trim(version->value) != "13" || !key || !req.Body().empty()) {
+    return false;
+  }
+
+  // The key is 16 random bytes in base64.
+  std::string_view nonce = trim(key->value);
+  if (nonce.size() != 24 || nonce.substr(22) != "==") {
+    return false;
+  }
+
+  uint8_t digest[20];
+  sha1(std::string(nonce) + WS_GUID, digest);
+
+  response = "HTTP/1.1 101 Switching Protocols\r\n"
+             "Upgrade: websocket\r\n"
+             "Connection: Upgrade\r\n"
+             "Sec-WebSocket-Accept: " +
+             base64Encode(digest, sizeof(digest)) + "\r\n";
+
+  deflate = WebSocketDeflate();
+  Header *extensions = req.findRequestHeader("Sec-WebSocket-Extensions");
+  if (options.permessage_deflate && extensions) {
+    std::string accepted = negotiateDeflate(extensions->value, deflate);
+    if (!accepted.empty()) {
+      response += "Sec-WebSocket-Extensions: " + accepted + "\r\n";
+    }
+  }
+  response += "\r\n";
+  return true;
+}
+
+// XOR payload with the 4 byte masking key. Works a 64 bit word at a time
+// (which the compiler vectorizes) and finishes byte by byte.
+static void unmask(char *payload, size_t size, const uint8_t key[4]) {
+  uint64_t key64;
+  uint8_t repeated[8] = {key[0], key[1], key[2], key[3],
+                         key[0], key[1], key[2], key[3]};
+  memcpy(&key64, repeated, sizeof(key64));
+
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, payload + i, sizeof(word));
+    word ^= key64;
+    memcpy(payload + i, &word, sizeof(word));
+  }
+  for (; i < size; i++) {
+    payload[i] = static_cast<char>(payload[i] ^ key[i % 4]);
+  }
+}
+
+// Returns true if data is well-formed UTF-8 (no overlongs, surrogates or
+// code points above U+10FFFF).
+static bool validUtf8(std::string_view data) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(data.data());
+  const uint8_t *end = p + data.size();
+  while (p < end) {
+    // Skip ASCII 8 bytes at a time.
+    if (end - p >= 8) {
+      uint64_t word;
+      memcpy(&word, p, sizeof(word));
+      if ((word & 0x8080808080808080ULL) == 0) {
+        p += 8;
+        continue;
+      }
+    }
+
+    uint8_t c = *p;
+    if (c < 0x80) {
+      p++;
+      continue;
+    }
+
+    int length;
+    uint8_t low = 0x80, high = 0xbf; // Range of the second byte.
+    if (c >= 0xc2 && c <= 0xdf) {
+      length = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      length = 3;
+      if (c == 0xe0) {
+        low = 0xa0;
+      } else if (c == 0xed) {
+        high = 0x9f;
+      }
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      length = 4;
+      if (c == 0xf0) {
+        low = 0x90;
+      } else if (c == 0xf4) {
+        high = 0x8f;
+      }
+    } else {
+      return false;
+    }
+
+    if (end - p < length || p[1] < low || p[1] > high) {
+      return false;
+    }
+    for (int i = 2; i < length; i++) {
+      if ((p[i] & 0xc0) != 0x80) {
+        return false;
+      }
+    }
+    p += length;
+  }
+  return true;
+}
+
+// Returns true if code may be sent in a close frame.
+static bool validCloseCode(uint16_t code) {
+  return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) ||
+         (code >= 3000 && code <= 4999);
+}
+
+WebSocket::WebSocket(std::unique_ptr<cppserver::Client> socket,
+                     std::unique_ptr<Request> request,
+                     std::shared_ptr<const WebSocketHandlers> handlers,
+                     const WebSocketDeflate &deflate)
+    : socket(std::move(socket)), request(std::move(request)),
+      handlers(std::move(handlers)), deflate(deflate), message_opcode(0),
+      message_compressed(false), inflate_ready(false), close_notified(false),
+      queued(0), flushing(false), close_sent(false), failed(false),
+      deflate_ready(false) {
+  memset(&inflater, 0, sizeof(inflater));
+  memset(&deflater, 0, sizeof(deflater));
+}
+
+WebSocket::~WebSocket() {
+  if (inflate_ready) {
+    inflateEnd(&inflater);
+  }
+  if (deflate_ready) {
+    deflateEnd(&deflater);
+  }
+}
+
+void WebSocket::Open() {
+  if (handlers->on_open) {
+    handlers->on_open(shared_from_this());
+  }
+}
+
+bool WebSocket::Send(std::string_view message, bool binary) {
+  return Queue(binary ? WS_BINARY : WS_TEXT, message, false);
+}
+
+void WebSocket::Close(uint16_t code, std::string_view reason) {
+  std::string payload;
+  payload.push_back(static_cast<char>(code >> 8));
+  payload.push_back(static_cast<char>(code & 0xff));
+  payload.append(reason.substr(0, WS_MAX_CONTROL - 2));
+  Queue(WS_CLOSE, payload, true);
+}
+
+size_t WebSocket::QueuedBytes() {
+  std::lock_guard<std::mutex> lock(send_mutex);
+  return queued;
+}
+
+bool WebSocket::Queue(uint8_t opcode, std::string_view payload,
+                      bool control) {
+  std::unique_lock<std::mutex> lock(send_mutex);
+  if (close_sent || failed ||
+      (!control && queued >= handlers->options.send_queue_limit)) {
+    return false;
+  }
+  if (opcode == WS_CLOSE) {
+    close_sent = true;
+  }
+
+  // Compress data frames. The deflater's window carries over between
+  // messages, so frames are compressed in the order they are queued.
+  uint8_t first = WS_FIN | opcode;
+  std::string compressed;
+  if (!control && deflate.enabled &&
+      payload.size() >= handlers->options.compress_min_size) {
+    if (!deflate_ready) {
+      if (deflateInit2(&deflater, handlers->options.compression_level,
+                       Z_DEFLATED, -deflate.server_max_window_bits, 8,
+                       Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+      }
+      deflate_ready = true;
+    }
+
+    deflater.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(payload.data()));
+    deflater.avail_in = static_cast<uInt>(payload.size());
+    char buffer[16 * 1024];
+    do {
+      deflater.next_out = reinterpret_cast<Bytef *>(buffer);
+      deflater.avail_out = sizeof(buffer);
+      ::deflate(&deflater, Z_SYNC_FLUSH);
+      compressed.append(buffer, sizeof(buffer) - deflater.avail_out);
+    } while (deflater.avail_out == 0);
+
+    // Drop the empty block that ends the sync flush (RFC 7692 7.2.1).
+    if (compressed.size() >= 4 &&
+        compressed.compare(compressed.size() - 4, 4, "\0\0\xff\xff", 4) ==
+            0) {
+      compressed.resize(compressed.size() - 4);
+    }
+    if (deflate.server_no_context_takeover) {
+      deflateReset(&deflater);
+    }
+    payload = compressed;
+    first |= WS_RSV1;
+  }
+
+  std::string frame;
+  frame.reserve(payload.size() + 10);
+  frame.push_back(static_cast<char>(first));
+  if (payload.size() < 126) {
+    frame.push_back(static_cast<char>(payload.size()));
+  } else if (payload.size() <= 0xffff) {
+    frame.push_back(126);
+    frame.push_back(static_cast<char>(payload.size() >> 8));
+    frame.push_back(static_cast<char>(payload.size() & 0xff));
+  } else {
+    frame.push_back(127);
+    for (int i = 7; i >= 0; i--) {
+      frame.push_back(static_cast<char>(
+          static_cast<uint64_t>(payload.size()) >> (i * 8)));
+    }
+  }
+  frame.append(payload);
+
+  queued += frame.size();
+  queue.push_back(std::move(frame));
+  if (flushing) {
+    return true;
+  }
+  flushing = true;
+  lock.unlock();
+
+  std::shared_ptr<WebSocket> self = shared_from_this();
+  if (!webSocketWriters().Submit([self]() { self->Flush(); })) {
+    // Writers are overloaded; write on this thread.
+    Flush();
+  }
+  return true;
+}
+
+// Write out the queue until it is empty. Only one thread flushes at a time
+// (the one that set flushing).
+void WebSocket::Flush() {
+  std::unique_lock<std::mutex> lock(send_mutex);
+  while (!queue.empty()) {
+    std::deque<std::string> frames;
+    frames.swap(queue);
+    lock.unlock();
+
+    size_t written = 0;
+    bool ok = true;
+    socket->Cork();
+    for (const std::string &frame : frames) {
+      ok = ok && socket->Send(frame) != -1;
+      written += frame.size();
+    }
+    ok = socket->Flush() && ok;
+
+    lock.lock();
+    queued -= written;
+    if (!ok) {
+      // Give up on the connection; the reader sees it end.
+      failed = true;
+      queued = 0;
+      queue.clear();
+      shutdown(socket->fd(), SHUT_RDWR);
+    }
+  }
+  flushing = false;
+}
+
+bool WebSocket::Receive(std::string data) {
+  size_t before = input.size();
+  socket->TakeReceived(std::move(data), input);
+  if (socket->Read(input) == -1 ||
+      (input.size() == before && socket->PeerClosed())) {
+    // Connection lost or closed without a closing handshake.
+    Closed(WS_CLOSE_ABNORMAL);
+    return false;
+  }
+
+  size_t pos = 0;
+  while (input.size() - pos >= 2) {
+    uint8_t *p = reinterpret_cast<uint8_t *>(input.data() + pos);
+    size_t available = input.size() - pos;
+    bool fin = p[0] & WS_FIN;
+    uint8_t opcode = p[0] & 0x0f;
+    uint64_t length = p[1] & 0x7f;
+
+    size_t header = 2;
+    if (length == 126) {
+      header = 4;
+      if (available < header) {
+        break;
+      }
+      length = static_cast<uint64_t>(p[2]) << 8 | p[3];
+    } else if (length == 127) {
+      header = 10;
+      if (available < header) {
+        break;
+      }
+      length = 0;
+      for (int i = 2; i < 10; i++) {
+        length = length << 8 | p[i];
+      }
+    }
+
+    // Clients must mask every frame; reserved bits need an extension.
+    bool compressed = p[0] & WS_RSV1;
+    if (!(p[1] & WS_MASKED) || (p[0] & WS_RSV23) ||
+        (compressed && !deflate.enabled)) {
+      return Fail(WS_CLOSE_PROTOCOL_ERROR);
+    }
+    if (length > handlers->options.max_message_size) {
+      return Fail(WS_CLOSE_TOO_BIG);
+    }
+
+    header += 4;
+    if (available < header + length) {
+      break;
+    }
+
+    char *payload = input.data() + pos + header;
+    unmask(payload, length, p + header - 4);
+    pos += header + length;
+    if (!ProcessFrame(opcode, fin, compressed,
+                      std::string_view(payload, length))) {
+      return false;
+    }
+  }
+
+  input.erase(0, pos);
+  return true;
+}
+
+bool WebSocket::ProcessFrame(uint8_t opcode, bool fin, bool compressed,
+                             std::string_view payload) {
+  if (opcode & 0x8) {
+    // Control frames may come between the fragments of a message.
+    if (!fin || compressed || payload.size() > WS_MAX_CONTROL) {
+      return Fail(WS_CLOSE_PROTOCOL_ERROR);
+    }
+
+    switch (opcode) {
+    case WS_CLOSE: {
+      uint16_t code = 1005; // No status received.
+      if (payload.size() == 1) {
+        return Fail(WS_CLOSE_PROTOCOL_ERROR);
+      }
+      if (payload.size() >= 2) {
+        code = static_cast<uint16_t>(static_cast<uint8_t>(payload[0]) << 8 |
+                                     static_cast<uint8_t>(payload[1]));
+        if (!validCloseCode(code)) {
+          return Fail(WS_CLOSE_PROTOCOL_ERROR);
+        }
+        if (!validUtf8(payload.substr(2))) {
+          return Fail(WS_CLOSE_INVALID_DATA);
+        }
+      }
+
+      // Echo the close unless we started the closing handshake.
+      Queue(WS_CLOSE, payload.substr(0, 2), true);
+      Closed(code);
+      return false;
+    }
+    case WS_PING:
+      Queue(WS_PONG, payload, true);
+      return true;
+    case WS_PONG:
+      return true;
+    default:
+      return Fail(WS_CLOSE_PROTOCOL_ERROR);
+    }
+  }
+
+  if (opcode == WS_CONTINUATION) {
+    if (message_opcode == 0 || compressed) {
+      return Fail(WS_CLOSE_PROTOCOL_ERROR);
+    }
+  } else if (opcode == WS_TEXT || opcode == WS_BINARY) {
+    if (message_opcode != 0) {
+      return Fail(WS_CLOSE_PROTOCOL_ERROR);
+    }
+    message_opcode = opcode;
+    message_compressed = compressed;
+  } else {
+    return Fail(WS_CLOSE_PROTOCOL_ERROR);
+  }
+
+  if (message.size() + payload.size() > handlers->options.max_message_size) {
+    return Fail(WS_CLOSE_TOO_BIG);
+  }
+  message.append(payload);
+  return !fin || OnMessage();
+}
+
+bool WebSocket::OnMessage() {
+  std::string inflated;
+  std::string_view data = message;
+  if (message_compressed) {
+    if (!inflate_ready) {
+      if (inflateInit2(&inflater, -15) != Z_OK) {
+        return Fail(WS_CLOSE_PROTOCOL_ERROR);
+      }
+      inflate_ready = true;
+    }
+
+    // Put back the end of the sync flush the sender removed.
+    message.append("\0\0\xff\xff", 4);
+    inflater.next_in = reinterpret_cast<Bytef *>(message.data());
+    inflater.avail_in = static_cast<uInt>(message.size());
+    char buffer[16 * 1024];
+    int rc;
+    do {
+      inflater.next_out = reinterpret_cast<Bytef *>(buffer);
+      inflater.avail_out = sizeof(buffer);
+      rc = inflate(&inflater, Z_SYNC_FLUSH);
+      // When the last round filled the buffer exactly, all the input may
+      // already be used, and inflate then reports that it cannot progress.
+      if (rc == Z_BUF_ERROR && inflater.avail_in == 0) {
+        break;
+      }
+      if (rc != Z_OK && rc != Z_STREAM_END) {
+        return Fail(WS_CLOSE_INVALID_DATA);
+      }
+      inflated.append(buffer, sizeof(buffer) - inflater.avail_out);
+      if (inflated.size() > handlers->options.max_message_size) {
+        return Fail(WS_CLOSE_TOO_BIG);
+      }
+    } while (rc == Z_OK && (inflater.avail_out == 0 || inflater.avail_in > 0));
+
+    // A final block ends the stream; the next message starts a new one.
+    if (rc == Z_STREAM_END || deflate.client_no_context_takeover) {
+      inflateReset(&inflater);
+    }
+    data = inflated;
+  }
+
+  bool binary = message_opcode == WS_BINARY;
+  if (!binary && !validUtf8(data)) {
+    return Fail(WS_CLOSE_INVALID_DATA);
+  }
+
+  if (handlers->on_message) {
+    handlers->on_message(shared_from_this(), data, binary);
+  }
+  message.clear();
+  message_opcode = 0;
+  return true;
+}
+
+// Close the connection because of an error in what the client sent.
+bool WebSocket::Fail(uint16_t code) {
+  Close(code);
+  Closed(code);
+  return false;
+}
+
+void WebSocket::Closed(uint16_t code) {
+  {
+    // No more messages once the connection is done.
+    std::lock_guard<std::mutex> lock(send_mutex);
+    close_sent = true;
+  }
+  if (!close_notified) {
+    close_notified = true;
+    if (handlers->on_close) {
+      handlers->on_close(shared_from_this(), code);
+    }
+  }
+}
@@ -0,0 +1,160 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include <zlib.h>
+
+#include "client.hpp"
+#include "request.hpp"
+#include "upgrade.hpp"
+
+// Defaults for WebSocketOptions.
+#define WS_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+#define WS_SEND_QUEUE_LIMIT (1024 * 1024)
+
+// Threads that write queued WebSocket messages to their sockets.
+#define WS_WRITERS 2
+
+// Close status codes (RFC 6455 section 7.4.1).
+enum WebSocketCloseCode : uint16_t {
+  WS_CLOSE_NORMAL = 1000,
+  WS_CLOSE_GOING_AWAY = 1001,
+  WS_CLOSE_PROTOCOL_ERROR = 1002,
+  WS_CLOSE_UNSUPPORTED = 1003,
+  WS_CLOSE_ABNORMAL = 1006, // Never sent: the connection was lost.
+  WS_CLOSE_INVALID_DATA = 1007,
+  WS_CLOSE_TOO_BIG = 1009,
+};
+
+// Settings of a WebSocket endpoint.
+struct WebSocketOptions {
+  // Messages larger than this (after decompression) close the connection
+  // with 1009.
+  size_t max_message_size = WS_MAX_MESSAGE_SIZE;
+
+  // Bytes of outgoing frames queued per connection. Send fails while the
+  // queue is over the limit, so slow clients cannot grow it without bound.
+  size_t send_queue_limit = WS_SEND_QUEUE_LIMIT;
+
+  // Negotiate permessage-deflate (RFC 7692) when the client offers it.
+  // Messages shorter than compress_min_size are sent uncompressed.
+  bool permessage_deflate = true;
+  int compression_level = 6;
+  size_t compress_min_size = 64;
+};
+
+class WebSocket;
+
+// Callbacks of a WebSocket endpoint. Each may be empty.
+//
+// on_open runs on the request worker that accepted the upgrade; on_message
+// and on_close run on the thread reading the connection, one at a time and
+// in order. They should not block: Send only queues the message.
+struct WebSocketHandlers {
+  std::function<void(const std::shared_ptr<WebSocket> &)> on_open;
+  std::function<void(const std::shared_ptr<WebSocket> &,
+                     std::string_view message, bool binary)>
+      on_message;
+  std::function<void(const std::shared_ptr<WebSocket> &, uint16_t code)>
+      on_close;
+  WebSocketOptions options;
+};
+
+// Negotiated permessage-deflate parameters.
+struct WebSocketDeflate {
+  bool enabled = false;
+  bool server_no_context_takeover = false;
+  bool client_no_context_takeover = false;
+  int server_max_window_bits = 15;
+};
+
+// A WebSocket connection (RFC 6455).
+//
+// Incoming frames are parsed as the event loop reports input, and complete
+// messages are passed to on_message. Outgoing messages are framed (and
+// compressed) when Send is called and queued; the queue is written out by a
+// small pool of writer threads, so handlers never wait for slow clients.
+class WebSocket : public UpgradedConnection,
+                  public std::enable_shared_from_this<WebSocket> {
+public:
+  WebSocket(std::unique_ptr<cppserver::Client> socket,
+            std::unique_ptr<Request> request,
+            std::shared_ptr<const WebSocketHandlers> handlers,
+            const WebSocketDeflate &deflate);
+  ~WebSocket() override;
+
+  WebSocket(const WebSocket &) = delete;
+  WebSocket &operator=(const WebSocket &) = delete;
+
+  // The upgrade request, for its path, query and headers.
+  Request *getRequest() { return request.get(); }
+
+  // Queue a text (or binary) message. Returns false if the connection is
+  // closing or the send queue is over its limit. Thread-safe.
+  bool Send(std::string_view message, bool binary = false);
+
+  // Start the closing handshake. Messages queued before are still sent.
+  void Close(uint16_t code = WS_CLOSE_NORMAL, std::string_view reason = "");
+
+  // Bytes of frames waiting to be written.
+  size_t QueuedBytes();
+
+  int fd() override { return socket->fd(); }
+  bool Receive(std::string data) override;
+  void Feed(std::string data) override { input.append(data); }
+  void GoAway() override { Close(WS_CLOSE_GOING_AWAY); }
+
+  // Call on_open. Used by the server once the connection is registered.
+  void Open();
+
+private:
+  // Input handling, on the thread running Receive.
+  bool ProcessFrame(uint8_t opcode, bool fin, bool compressed,
+                    std::string_view payload);
+  bool OnMessage();
+  bool Fail(uint16_t code);
+  void Closed(uint16_t code);
+
+  // Queue a frame. control frames are queued even over the limit.
+  bool Queue(uint8_t opcode, std::string_view payload, bool control);
+  void Flush();
+
+  std::unique_ptr<cppserver::Client> socket;
+  std::unique_ptr<Request> request;
+  std::shared_ptr<const WebSocketHandlers> handlers;
+  WebSocketDeflate deflate;
+
+  // Receive side.
+  std::string input;      // Received bytes not yet processed.
+  std::string message;    // Fragments of the message being received.
+  uint8_t message_opcode; // Opcode of that message, 0 if none.
+  bool message_compressed;
+  bool inflate_ready;
+  z_stream inflater;
+  bool close_notified;    // on_close was called.
+
+  // Send side; guarded by send_mutex.
+  std::mutex send_mutex;
+  std::deque<std::string> queue; // Framed messages.
+  size_t queued;                 // Bytes in queue and being written.
+  bool flushing;                 // A writer owns the socket.
+  bool close_sent;               // Close frame queued; no more messages.
+  bool failed;                   // A write failed.
+  bool deflate_ready;
+  z_stream deflater;
+};
+
+// Check the opening handshake in req (RFC 6455 section 4.2.1) and build
+// the 101 response, negotiating permessage-deflate if options allow.
+// Returns false if req is not a valid WebSocket upgrade.
+bool webSocketHandshake(Request &req, const WebSocketOptions &options,
+                        std::string &response, WebSocketDeflate &deflate);
+
+#endif /* WEBSOCKET_H */